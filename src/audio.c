@@ -0,0 +1,316 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: This file provides the audio backends, which take the
+ * finished frames of samples from sound.c and send them on: "oss" to an
+ * OSS sound device (or any other file, as raw samples), "wav" to a WAV
+ * file and "null" nowhere, though every frame is still synthesized.
+ *
+ * The WAV writer collects the samples in a buffer and writes it out
+ * when it fills up, from the audio thread if there is one, so the game
+ * never waits for the disk. It never drops samples either: if the disk
+ * is slow, the audio thread falls behind and the game waits for it
+ * (see UpdateAudio()). The file only depends on the game and the input,
+ * which makes it usable for comparing headless runs.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#ifdef HAVE_LINUX_SOUNDCARD_H
+#include <linux/soundcard.h>
+#endif /* HAVE_LINUX_SOUNDCARD_H */
+
+#ifdef HAVE_SYS_SOUNDCARD_H
+#include <sys/soundcard.h>
+#endif /* HAVE_SYS_SOUNDCARD_H */
+
+#include "audio.h"
+#include "globals.h"
+#include "sound.h"
+
+#define WAV_BUFFER      65536           /* bytes collected before a write */
+
+/* exports */
+int     InitAudioAuto(const char *file, int *rate, int *format);
+int     InitAudioOSS(const char *file, int *rate, int *format);
+ssize_t WriteAudioOSS(const void *buf, size_t len);
+int     LatencyAudioOSS(void);
+void    CloseAudioOSS(void);
+int     InitAudioWAV(const char *file, int *rate, int *format);
+ssize_t WriteAudioWAV(const void *buf, size_t len);
+void    CloseAudioWAV(void);
+int     InitAudioNull(const char *file, int *rate, int *format);
+ssize_t WriteAudioNull(const void *buf, size_t len);
+int     LatencyAudioUnknown(void);
+void    CloseAudioNull(void);
+
+/* globals */
+struct AudioBackend audio_backends[] = {
+	{ "oss", "OSS sound device, or raw samples to any file",
+	  InitAudioOSS, WriteAudioOSS, LatencyAudioOSS, CloseAudioOSS, -1 },
+	{ "wav", "WAV file",
+	  InitAudioWAV, WriteAudioWAV, LatencyAudioUnknown, CloseAudioWAV, -1 },
+	{ "null", "Synthesize the sound, but don't play it",
+	  InitAudioNull, WriteAudioNull, LatencyAudioUnknown, CloseAudioNull, -1 },
+	{ "auto", "wav for files named *.wav, otherwise oss",
+	  InitAudioAuto, 0, 0, 0, -1 },
+	{ 0, 0, 0, 0, 0, 0, 0 }     /* terminator */
+}, *audio_backend = 0;
+
+static int
+BytesPerSample(int format)
+{
+	return format == AFMT_U16_LE || format == AFMT_U16_BE
+	    || format == AFMT_S16_LE || format == AFMT_S16_BE ? 2 : 1;
+}
+
+int
+InitAudioAuto(const char *file, int *rate, int *format)
+{
+	size_t len = strlen(file);
+	const char *name = len > 4 && !strcasecmp(file + len - 4, ".wav")
+	                 ? "wav" : "oss";
+
+	for (audio_backend = audio_backends; audio_backend->name; audio_backend++)
+		if (!strcmp(audio_backend->name, name))
+			break;
+	return audio_backend->init(file, rate, format);
+}
+
+/****************************************************************************/
+
+static int ossfd = -1;
+
+int
+InitAudioOSS(const char *file, int *rate, int *format)
+{
+	int desired_fragmentsize = 0;
+
+	if ((ossfd = open(file, O_WRONLY | O_APPEND)) < 0) {
+		perror(file);
+		return 1;
+	}
+	audio_backend->fd = ossfd;
+#ifdef SNDCTL_DSP_RESET
+	if (!ioctl(ossfd, SNDCTL_DSP_RESET)) {
+		int desired_audiorate = *rate;
+		if (ioctl(ossfd, SNDCTL_DSP_SPEED, rate))
+			perror(file);
+
+		if (*rate != desired_audiorate) {
+			fprintf(stderr, "%s: wanted %d Hz, got %d Hz\n",
+			        file, desired_audiorate, *rate);
+		}
+		int desired_audiostereo = sound_config.audiostereo;
+		if (ioctl(ossfd, SNDCTL_DSP_STEREO, &sound_config.audiostereo))
+			perror(file);
+		/* sound.c mixes for whichever the device took */
+		if (sound_config.audiostereo != desired_audiostereo)
+			fprintf(stderr, "%s: wanted %s, got %s\n", file,
+			        desired_audiostereo ? "stereo" : "monaural",
+			        sound_config.audiostereo ? "stereo" : "monaural");
+		if (ioctl(ossfd, SNDCTL_DSP_SAMPLESIZE, format))
+			perror(file);
+	}
+#endif /* SNDCTL_DSP_RESET */
+#ifdef SNDCTL_DSP_SETFRAGMENT
+	/* this is necessary to get the sound out fast enough so that
+	 * the sound is in sync with the game
+	 * for performance issues, I believe a < 1/30 second delay is
+	 * very good, this will be tweaked for optimum performance
+	 */
+	for (int bytes = *rate * BytesPerSample(*format)
+	                 * (sound_config.audiostereo ? 2 : 1) / 30; bytes; bytes >>= 1)
+		++desired_fragmentsize;
+	if (ioctl(ossfd, SNDCTL_DSP_SETFRAGMENT, &desired_fragmentsize))
+		perror(file);
+	if (verbose)
+		fprintf(stderr, "BufSize: %u bytes\n", (1 << desired_fragmentsize));
+#endif /* SNDCTL_DSP_SETFRAGMENT */
+	return 0;
+}
+
+ssize_t
+WriteAudioOSS(const void *buf, size_t len)
+{
+	return write(ossfd, buf, len);
+}
+
+int
+LatencyAudioOSS(void)
+{
+#ifdef SNDCTL_DSP_GETODELAY
+	int odelay;
+
+	if (!ioctl(ossfd, SNDCTL_DSP_GETODELAY, &odelay))
+		return odelay;
+#endif
+	return -1;
+}
+
+void
+CloseAudioOSS(void)
+{
+	close(ossfd);
+	ossfd = -1;
+}
+
+/****************************************************************************/
+
+static int      wavfd = -1;
+static const char *wavname;
+static unsigned char *wavbuf;
+static size_t   wavlen = 0;             /* bytes in wavbuf */
+static uint32_t wavdata = 0;            /* bytes of samples in the file */
+static int      wav_failed = 0;
+
+static void
+put16(unsigned char *p, unsigned int x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+}
+
+static void
+put32(unsigned char *p, uint32_t x)
+{
+	put16(p, x);
+	put16(p + 2, x >> 16);
+}
+
+static void
+WriteAllWAV(const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len && !wav_failed) {
+		ssize_t n = write(wavfd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(wavname);
+			wav_failed = 1;
+			break;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+int
+InitAudioWAV(const char *file, int *rate, int *format)
+{
+	unsigned char header[44];
+	int channels = sound_config.audiostereo ? 2 : 1;
+	int bytes;
+
+	/* WAV only has unsigned 8-bit, signed 16-bit little-endian and
+	   mu-law samples */
+	if (*format != AFMT_MU_LAW)
+		*format = BytesPerSample(*format) == 2 ? AFMT_S16_LE : AFMT_U8;
+	bytes = BytesPerSample(*format);
+
+	wavname = file;
+	if (!strcmp(file, "-")) {
+		wavname = "stdout";
+		wavfd = STDOUT_FILENO;
+	} else if ((wavfd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		perror(file);
+		return 1;
+	}
+	if (!(wavbuf = malloc(WAV_BUFFER))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	/* the sizes are filled in by CloseAudioWAV(), if the file is seekable */
+	memcpy(header, "RIFF\377\377\377\377WAVEfmt ", 16);
+	put32(header + 16, 16);
+	put16(header + 20, *format == AFMT_MU_LAW ? 7 : 1);
+	put16(header + 22, channels);
+	put32(header + 24, *rate);
+	put32(header + 28, *rate * channels * bytes);   /* bytes per second */
+	put16(header + 32, channels * bytes);           /* bytes per frame */
+	put16(header + 34, 8 * bytes);
+	memcpy(header + 36, "data\377\377\377\377", 8);
+	WriteAllWAV(header, sizeof header);
+	return wav_failed;
+}
+
+ssize_t
+WriteAudioWAV(const void *buf, size_t len)
+{
+	if (wavlen + len > WAV_BUFFER) {
+		WriteAllWAV(wavbuf, wavlen);
+		wavlen = 0;
+	}
+	if (len > WAV_BUFFER) {
+		WriteAllWAV(buf, len);
+	} else {
+		memcpy(wavbuf + wavlen, buf, len);
+		wavlen += len;
+	}
+	wavdata += len;
+	return len;
+}
+
+void
+CloseAudioWAV(void)
+{
+	unsigned char size[4];
+
+	WriteAllWAV(wavbuf, wavlen);
+	wavlen = 0;
+	if (!wav_failed && lseek(wavfd, 0, SEEK_CUR) > 0) {
+		put32(size, wavdata + 36);
+		if (pwrite(wavfd, size, 4, 4) == 4) {
+			put32(size, wavdata);
+			pwrite(wavfd, size, 4, 40);
+		}
+	}
+	if (wavfd > STDERR_FILENO)
+		close(wavfd);
+	wavfd = -1;
+}
+
+/****************************************************************************/
+
+int
+InitAudioNull(const char *file, int *rate, int *format)
+{
+	(void)file;
+	(void)rate;
+	(void)format;
+	return 0;
+}
+
+ssize_t
+WriteAudioNull(const void *buf, size_t len)
+{
+	(void)buf;
+	return len;
+}
+
+int
+LatencyAudioUnknown(void)
+{
+	return -1;
+}
+
+void
+CloseAudioNull(void)
+{
+}
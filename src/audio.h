@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Abstract audio output interface
+ */
+
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <sys/types.h>
+
+/* sample format numbers, as OSS numbers them */
+#ifndef AFMT_MU_LAW
+#  define AFMT_MU_LAW 1
+#endif
+#ifndef AFMT_U8
+#  define AFMT_U8 8
+#endif
+#ifndef AFMT_S16_LE
+#  define AFMT_S16_LE 16
+#endif
+#ifndef AFMT_S16_BE
+#  define AFMT_S16_BE 32
+#endif
+#ifndef AFMT_S8
+#  define AFMT_S8 64
+#endif
+#ifndef AFMT_U16_LE
+#  define AFMT_U16_LE 128
+#endif
+#ifndef AFMT_U16_BE
+#  define AFMT_U16_BE 256
+#endif
+
+struct AudioBackend {
+	const char *name, *fullname;
+	/* open file for samples at *rate Hz in *format, changing either to
+	   what the backend can take; returns 0 on success */
+	int (*init)(const char *file, int *rate, int *format);
+	/* like write(2); if fd is non-blocking, it may fail with EAGAIN */
+	ssize_t (*write)(const void *buf, size_t len);
+	/* bytes written but not played yet, or -1 if there is no telling */
+	int (*latency)(void);
+	void (*close)(void);
+	int fd;         /* poll() this for room to write, or -1 if never full */
+};
+
+/* the currently selected audio backend */
+extern struct AudioBackend *audio_backend;
+
+/* table of audio backends, terminated by { 0, 0, 0, 0, 0, 0, 0 } */
+extern struct AudioBackend audio_backends[];
+
+#endif
@@ -0,0 +1,274 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Headless renderer which writes every emulated frame to a
+ * file or pipe, as YUV4MPEG2 (if the name ends in .y4m) or as raw 24-bit
+ * RGB. The game runs as fast as the frames can be written, without
+ * waiting for real time. Frames are copied into a fixed pool of buffers
+ * and written out by a separate thread, so the emulation only waits for
+ * the disk once the pool is full; no frame is ever dropped.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "globals.h"
+#include "ppulog.h"
+#include "renderer.h"
+#include "screenshot.h"
+
+#define CAPTURE_BUFFERS 8               /* frames in flight */
+#define FRAME_PIXELS    (256 * 240)
+
+/* exports */
+int     InitDisplayCapture(int argc, char **argv);
+void    UpdateColorsCapture(void);
+void    UpdateDisplayCapture(void);
+
+/* imports */
+extern void     fbinit(void);
+extern void     fbprivate(void);
+extern void     fbcolors(void);
+extern void     quit(void);
+
+static int      capfd = -1;
+static const char *capname;
+static int      y4m;
+static unsigned char *outbuf;           /* one frame in the output format */
+static unsigned long frames_written = 0;
+static int      write_failed = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+#ifdef HAVE_PTHREAD
+static uint32_t *pool[CAPTURE_BUFFERS];
+static unsigned int pool_head = 0;      /* next buffer to fill */
+static unsigned int pool_tail = 0;      /* next buffer to write */
+static pthread_t        writer_thread;
+static pthread_mutex_t  pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   pool_cond = PTHREAD_COND_INITIALIZER;
+static int      writer_running = 0;
+static int      closing = 0;
+#endif
+
+static void
+writeall(const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len && !write_failed) {
+		ssize_t n = write(capfd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "[%s] %s: %s\n",
+			        renderer->name, capname, strerror(errno));
+			write_failed = 1;
+			break;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+/* Convert one frame of 0x00RRGGBB pixels and write it out */
+static void
+WriteFrameCapture(const uint32_t *frame)
+{
+	unsigned char *out = outbuf;
+
+	if (y4m) {
+		/* BT.601 studio range, full-resolution (4:4:4) chroma */
+		unsigned char *cb = outbuf + FRAME_PIXELS;
+		unsigned char *cr = cb + FRAME_PIXELS;
+
+		writeall("FRAME\n", 6);
+		for (int i = 0; i < FRAME_PIXELS; i++) {
+			int r = frame[i] >> 16 & 0xff;
+			int g = frame[i] >>  8 & 0xff;
+			int b = frame[i]       & 0xff;
+
+			out[i] = (( 66 * r + 129 * g +  25 * b + 128) >> 8) +  16;
+			cb[i]  = ((-38 * r -  74 * g + 112 * b + 128) >> 8) + 128;
+			cr[i]  = ((112 * r -  94 * g -  18 * b + 128) >> 8) + 128;
+		}
+		writeall(outbuf, 3 * FRAME_PIXELS);
+	} else {
+		for (int i = 0; i < FRAME_PIXELS; i++) {
+			*out++ = frame[i] >> 16;
+			*out++ = frame[i] >> 8;
+			*out++ = frame[i];
+		}
+		writeall(outbuf, 3 * FRAME_PIXELS);
+	}
+	frames_written++;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+WriterCapture(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (pool_tail == pool_head && !closing)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		if (pool_tail == pool_head)
+			break;
+		const uint32_t *frame = pool[pool_tail % CAPTURE_BUFFERS];
+		pthread_mutex_unlock(&pool_lock);
+		WriteFrameCapture(frame);
+		pthread_mutex_lock(&pool_lock);
+		pool_tail++;
+		pthread_cond_signal(&pool_cond);
+	}
+	pthread_mutex_unlock(&pool_lock);
+	return NULL;
+}
+#endif
+
+/* Ctrl-C: finish the current frame, then quit() */
+static void
+StopCapture(int signum)
+{
+	(void)signum;
+	stop_requested = 1;
+}
+
+/* Called at exit: write out the frames still queued */
+static void
+CloseCapture(void)
+{
+#ifdef HAVE_PTHREAD
+	if (writer_running) {
+		pthread_mutex_lock(&pool_lock);
+		closing = 1;
+		pthread_cond_signal(&pool_cond);
+		pthread_mutex_unlock(&pool_lock);
+		pthread_join(writer_thread, NULL);
+		writer_running = 0;
+	}
+#endif
+	if (verbose)
+		fprintf(stderr, "[%s] %lu frames written\n",
+		        renderer->name, frames_written);
+	if (capfd >= 0)
+		close(capfd);
+	capfd = -1;
+}
+
+int
+InitDisplayCapture(int argc, char **argv)
+{
+	(void)argc;
+	capname = renderer_config.display_id;
+	/* standard output is left to --benchmark and -s - */
+	if (!capname || !strcmp(capname, "-")) {
+		fprintf(stderr, "%s: [%s] needs an output file, see --display\n",
+		        *argv, renderer->name);
+		return 1;
+	}
+	capfd = open(capname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (capfd < 0) {
+		fprintf(stderr, "%s: [%s] %s: %s\n",
+		        *argv, renderer->name, capname, strerror(errno));
+		return 1;
+	}
+	size_t len = strlen(capname);
+	y4m = len > 4 && !strcasecmp(capname + len - 4, ".y4m");
+
+	if (!(outbuf = malloc(3 * FRAME_PIXELS))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+
+	if (y4m) {
+		/* the NTSC NES runs at 39375000/655171, about 60.0988 Hz */
+		static const char header[] =
+			"YUV4MPEG2 W256 H240 F39375000:655171 Ip A8:7 C444\n";
+		writeall(header, sizeof header - 1);
+	}
+
+#ifdef HAVE_PTHREAD
+	for (int i = 0; i < CAPTURE_BUFFERS; i++)
+		if (!(pool[i] = malloc(FRAME_PIXELS * sizeof **pool))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	int err = pthread_create(&writer_thread, NULL, WriterCapture, NULL);
+	if (err) {
+		fprintf(stderr, "[%s] Can't start writer thread: %s\n",
+		        renderer->name, strerror(err));
+		exit(EXIT_FAILURE);
+	}
+	writer_running = 1;
+#endif
+	atexit(CloseCapture);
+	signal(SIGINT, StopCapture);
+	signal(SIGTERM, StopCapture);
+	if (verbose)
+		fprintf(stderr, "[%s] Writing %s frames to %s\n",
+		        renderer->name, y4m ? "Y4M" : "raw RGB", capname);
+
+	/* draw 0x00RRGGBB pixels into a private framebuffer */
+	fbprivate();
+	screenshot_init(".png");
+	fbinit();
+	return 0;
+}
+
+void
+UpdateDisplayCapture(void)
+{
+	const char *frame;
+
+	/* poll the joysticks like `none', but never wait for real time and
+	   draw every frame */
+	PollJoysticks();
+	frameskip = 0;
+
+	if (stop_requested)
+		quit();
+	if (!(frame = ppu_endframe()))
+		return;
+	screenshot_frame(frame, NULL, NULL, 0);
+	if (write_failed)
+		return;
+
+#ifdef HAVE_PTHREAD
+	/* wait for the writer to free a buffer */
+	pthread_mutex_lock(&pool_lock);
+	while (pool_head - pool_tail == CAPTURE_BUFFERS)
+		pthread_cond_wait(&pool_cond, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+	memcpy(pool[pool_head % CAPTURE_BUFFERS], frame, FRAME_PIXELS * sizeof **pool);
+	pthread_mutex_lock(&pool_lock);
+	pool_head++;
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+#else
+	WriteFrameCapture((const uint32_t *)frame);
+#endif
+}
+
+/* Set the palette tables if the palette changed */
+void
+UpdateColorsCapture(void)
+{
+	fbcolors();
+}
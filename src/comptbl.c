@@ -24,7 +24,7 @@
 #include <unistd.h>
 
 #define BLOCK_SIZE (256 * sizeof (uintptr_t *))
-#define TREE_SIZE (4662 * BLOCK_SIZE)
+#define TREE_SIZE (6199 * BLOCK_SIZE)
 #define DATA_SIZE (9624)
 
 static uintptr_t *tree;
@@ -140,7 +140,7 @@ main(int argc, char *argv[])
 					 || i == 'M' || i == 'P' || i == 'A' || i == 'J'
 					 || i == 'I' || i == 'W' || i == 'X' || i == 'O'
 					 || i == 'Y' || i == 'L' || i == '!' || i == '>'
-					 || i == '^') {
+					 || i == '^' || i == 'K') {
 						omc = i;
 					} else if (i >= '0' && i <= '9') {
 						omo = i - '0';
@@ -157,7 +157,7 @@ main(int argc, char *argv[])
 						 || omc == 'M' || omc == 'A' || omc == 'I'
 						 || omc == 'J' || omc == 'U' || omc == 'X'
 						 || omc == 'O' || omc == 'Y' || omc == 'L'
-						 || omc == 'N') {
+						 || omc == 'N' || omc == 'K') {
 							objseq[dbn++] = 0;
 							objseq[dbn++] = 0;
 							objseq[dbn++] = 0;
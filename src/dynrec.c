@@ -120,6 +120,8 @@ translate(int addr)
 					*(void **)&bptr[l] = (void *)((unsigned char *)&INPUT - &bptr[l + 4]);
 				else if (m == 'O')
 					*(void **)&bptr[l] = (void *)((unsigned char *)&OUTPUT - &bptr[l + 4]);
+				else if (m == 'K')
+					*(void **)&bptr[l] = (void *)((unsigned char *)&VRAMCOPY - &bptr[l + 4]);
 				else if (m == 'U')
 					*(void **)&bptr[l] = (void *)((unsigned char *)&U - &bptr[l + 4]);
 				else if (m == 'N')
@@ -25,14 +25,20 @@
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "audio.h"
 #include "consts.h"
 #include "controller.h"
 #include "gamegenie.h"
 #include "globals.h"
 #include "joystick.h"
 #include "loader.h"
+#include "movie.h"
 #include "renderer.h"
+#include "rewind.h"
+#include "savestate.h"
+#include "screenshot.h"
 #include "sound.h"
+#include "stats.h"
 
 /* filenames */
 #define JS1 "/dev/js0"
@@ -68,11 +74,26 @@ int     unisystem = 0;
 int     verbose = 0;
 
 const char      *rendname = "auto";
+static const char *audioname = "auto";
+static int      sound_muted = 0;        /* -smute */
 
 #define USAGE "Usage: %s [--help] [options] filename\n"
 
 /* Long options with no short equivalents */
 #define OPTVAL_DISPLAY 256
+#define OPTVAL_PPUTHREAD 257
+#define OPTVAL_SCREENSHOTBURST 258
+#define OPTVAL_BENCHMARK 259
+#define OPTVAL_RECORDMOVIE 260
+#define OPTVAL_PLAYMOVIE 261
+#define OPTVAL_REWIND 262
+#define OPTVAL_BANDLIMIT 263
+#define OPTVAL_AUDIO 264
+#define OPTVAL_STEREO 265
+#define OPTVAL_PAN 266
+#define OPTVAL_GAIN 267
+#define OPTVAL_MUTE 268
+#define OPTVAL_SOLO 269
 
 static void     help_help(int);
 static void     help_version(int);
@@ -404,6 +425,10 @@ traphandler(int signum)
 void
 quit(void)
 {
+	if (verbose && renderer_data.skippedframes)
+		fprintf(stderr, "Skipped %lu unchanged frames\n",
+		        renderer_data.skippedframes);
+
 	/* Clean up char pointers */
 	free(tuxnesdir);
 	free(basefilename);
@@ -530,6 +555,14 @@ help_options(int terse)
 		       renderer->name,
 		       renderer->fullname);
 	printf("  -I, --in-root       Display in root window\n");
+	printf("      --ppu-thread    Draw on a separate thread (adds a frame of latency)\n");
+	printf("      --benchmark=N[,nodraw]\n"
+	       "                      Run N frames as fast as possible, then print timing\n"
+	       "                      statistics as JSON (uses the bench renderer unless\n"
+	       "                      -r is given; nodraw skips drawing the pixels)\n");
+	printf("      --screenshot-burst=COUNT[,EVERY]\n"
+	       "                      Take COUNT screenshots, one every EVERY frames,\n"
+	       "                      for each screenshot request (default: 1,1)\n");
 	printf("  -K, --sticky-keys   Hit keys once to press buttons, again to release\n");
 	printf("  -X, --swap-inputs   Swap P1 and P2 controls\n");
 	if (terse) {
@@ -545,6 +578,11 @@ help_sound(int terse)
 {
 	printf("  -s, --sound[=FILE]  Append sound data to FILE (default: %s)\n"
 	       "      (specify sound file as mute or none for no sound, e.g., -smute)\n", DSP);
+	printf("      --audio=...     Select an audio backend (default: auto)\n");
+	for (audio_backend = audio_backends; audio_backend->name; audio_backend++)
+		printf("      %-10s %s\n",
+		       audio_backend->name,
+		       audio_backend->fullname);
 	printf("  -F, --format=...    Use the specified sound sample format (default: %s)\n",
 	       sample_format_name);
 	for (sample_format = sample_formats; sample_format->name; sample_format++)
@@ -554,6 +592,18 @@ help_sound(int terse)
 	printf("  -R, --soundrate=NUM Set sound sample rate to NUM Hz (default: %d)\n",
 	       sound_config.audiorate);
 	printf("  -D, --delay=NUM     Resynchronize if sound delay exceeds NUM seconds\n");
+	printf("      --stereo        Play the sound in stereo\n");
+	printf("      --pan=CH=NUM[,...]\n"
+	       "                      Pan channel CH from -1 (left) to 1 (right)\n");
+	printf("      --gain=CH=NUM[,...]\n"
+	       "                      Scale channel CH by NUM, from 0 to 4 (default: 1)\n");
+	printf("      --mute=CH[,...] Start with channel CH muted\n");
+	printf("      --solo=CH[,...] Start with only the channels CH playing\n");
+	printf("      (CH is sq1, sq2, tri, noise, dmc, or exp1 to exp8 for the channels\n"
+	       "      of the cartridge's sound chip)\n");
+#ifdef HAVE_LIBM
+	printf("      --bandlimit     Band-limit the sound channels (less aliasing)\n");
+#endif /* HAVE_LIBM */
 /*	printf("  -e, --echo          Simulate echoing\n");
  */
 }
@@ -636,6 +686,9 @@ help_controls(int terse)
 	       "        2:B0,B1,B5,B2,B10,B12,B11,B13,B4\n"
 	       "        1:B0B8,B1B9,B5,B2\n"
 	       "        2:,,,,A2,A3\n");
+	printf("      --record-movie=FILE     Record the controller input to FILE\n");
+	printf("      --play-movie=FILE       Replay the controller input recorded in FILE\n");
+	printf("      --rewind=SECONDS        Keep SECONDS of play to rewind with F6\n");
 	printf("\n"
 	       "  Keyboard:\n"
 	       "    Arrows      - Move (P1)\n"
@@ -655,13 +708,24 @@ help_controls(int terse)
 	       "    0-8, `      - Adjust emulation speed\n"
 	       "      0 stops the game, ` runs the game at half speed\n"
 	       "      1 runs at normal speed, 2..8 runs at 2..8x normal speed\n"
+	       "    F5          - Save state to ~/.tuxnes/<game>.sta\n"
+	       "    F8          - Load the state saved with F5\n"
+	       "    F6 (hold)   - Rewind (with --rewind)\n"
+	       "    F9          - Select the next sound channel\n"
+	       "    F10         - Mute or unmute the selected sound channel\n"
+	       "    F11         - Solo the selected sound channel, or not\n"
 	       "    S, F7, PrintScreen\n"
 	       "                - Capture screenshot\n"
+#ifdef SCREENSHOT_PNG
+	       "                  Save to ~/.tuxnes/<game>-snap-????.png\n"
+	       "                  (also on SIGUSR1, e.g. with --renderer=capture)\n");
+#else
 #ifdef HAVE_X
-	       "                  Under X11, save to ~/.tuxnes/snap????.xpm\n"
+	       "                  Under X11, save to ~/.tuxnes/<game>-snap-????.xpm\n"
 #endif /* HAVE_X */
 	       "                  (Note: XPM support must be installed and compiled\n"
 	       "                   for this to work; see the README file for more info.)\n");
+#endif /* SCREENSHOT_PNG */
 	printf("\n"
 	       "  Keypad:\n"
 	       "    Arrows/12346789  - Move (P1)\n"
@@ -934,6 +998,60 @@ read_err:
 	}
 }
 
+/*
+ * Parse the list of channels given to --pan, --gain, --mute or --solo:
+ * CH=NUM[,...] for the first two, CH[,...] for the others
+ */
+static void
+parse_channels(int opt, const char *arg)
+{
+	while (*arg) {
+		size_t len = strcspn(arg, "=,");
+		const char *value = arg[len] == '=' ? arg + len + 1 : NULL;
+		const char *end = arg + len;
+		double x = 0.0;
+		int c;
+
+		for (c = 0; sound_channels[c]; c++) {
+			if (strlen(sound_channels[c]) == len
+			 && !strncmp(sound_channels[c], arg, len))
+				break;
+		}
+		if (!sound_channels[c]) {
+			fprintf(stderr, "%.*s: not a sound channel\n", (int)len, arg);
+			exit(EX_USAGE);
+		}
+		if (opt == OPTVAL_PAN || opt == OPTVAL_GAIN) {
+			if (value) {
+				char *p;
+
+				x = strtod(value, &p);
+				end = p;
+			}
+			if (!value || end == value || (*end && *end != ',')
+			 || (opt == OPTVAL_PAN ? x < -1.0 || x > 1.0 : x < 0.0 || x > 4.0)) {
+				fprintf(stderr, "%s: not a valid %s (must be a number from %s)\n",
+				        arg, opt == OPTVAL_PAN ? "pan" : "gain",
+				        opt == OPTVAL_PAN ? "-1 to 1" : "0 to 4");
+				exit(EX_USAGE);
+			}
+			if (opt == OPTVAL_PAN)
+				sound_config.pan[c] = x;
+			else
+				sound_config.gain[c] = x;
+		} else if (value) {
+			fprintf(stderr, "%s: --%s takes only channel names\n",
+			        arg, opt == OPTVAL_MUTE ? "mute" : "solo");
+			exit(EX_USAGE);
+		} else if (opt == OPTVAL_MUTE) {
+			sound_config.mute |= 1U << c;
+		} else {
+			sound_config.solo |= 1U << c;
+		}
+		arg = *end ? end + 1 : end;
+	}
+}
+
 /****************************************************************************/
 
 int
@@ -983,6 +1101,8 @@ main(int argc, char **argv)
 	verbose = 0;
 	dolink = 0;
 	disassemble = 0;
+	for (int c = 0; c < SOUND_CHANNELS; c++)
+		sound_config.gain[c] = 1.0f;
 
 	/* check for the default output device */
 	int audiofd;
@@ -1029,6 +1149,18 @@ main(int argc, char **argv)
 			{"hqx", 2, 0, 'Q'},
 			{"geometry", 1, 0, 'G'},
 			{"display", 1, 0, OPTVAL_DISPLAY},
+			{"ppu-thread", 0, 0, OPTVAL_PPUTHREAD},
+			{"screenshot-burst", 1, 0, OPTVAL_SCREENSHOTBURST},
+			{"benchmark", 1, 0, OPTVAL_BENCHMARK},
+			{"record-movie", 1, 0, OPTVAL_RECORDMOVIE},
+			{"play-movie", 1, 0, OPTVAL_PLAYMOVIE},
+			{"rewind", 1, 0, OPTVAL_REWIND},
+			{"audio", 1, 0, OPTVAL_AUDIO},
+			{"stereo", 0, 0, OPTVAL_STEREO},
+			{"pan", 1, 0, OPTVAL_PAN},
+			{"gain", 1, 0, OPTVAL_GAIN},
+			{"mute", 1, 0, OPTVAL_MUTE},
+			{"solo", 1, 0, OPTVAL_SOLO},
 			{"renderer", 1, 0, 'r'},
 			{"echo", 0, 0, 'e'},
 			{"swap-inputs", 0, 0, 'X'},
@@ -1037,6 +1169,7 @@ main(int argc, char **argv)
 			{"bw", 0, 0, 'b'},
 #ifdef HAVE_LIBM
 			{"ntsc-palette", 2, 0, 'N'},
+			{"bandlimit", 0, 0, OPTVAL_BANDLIMIT},
 #endif
 			{0, 0, 0, 0}
 		};
@@ -1130,10 +1263,13 @@ main(int argc, char **argv)
 		case 's':
 			if (optarg
 			 && ((strcmp(optarg, "mute") == 0)
-			  || (strcmp(optarg, "none") == 0)))
+			  || (strcmp(optarg, "none") == 0))) {
 				sound_config.audiofile = NULL;
-			else
+				sound_muted = 1;
+			} else {
 				sound_config.audiofile = optarg ? optarg : DSP;
+				sound_muted = 0;
+			}
 			break;
 		case 'S':
 			renderer_config.indexedcolor = 0;
@@ -1222,6 +1358,18 @@ main(int argc, char **argv)
 		case 'r':
 			rendname = optarg;
 			break;
+		case OPTVAL_AUDIO:
+			audioname = optarg;
+			break;
+		case OPTVAL_STEREO:
+			sound_config.audiostereo = 1;
+			break;
+		case OPTVAL_PAN:
+		case OPTVAL_GAIN:
+		case OPTVAL_MUTE:
+		case OPTVAL_SOLO:
+			parse_channels(parseret, optarg);
+			break;
 #ifdef HAVE_LIBM
 		case 'N':
 			if (optarg) {
@@ -1249,10 +1397,57 @@ main(int argc, char **argv)
 			palfile = NULL;
 			NES_palette = palette_buf;
 			break;
+		case OPTVAL_BANDLIMIT:
+			sound_config.bandlimit = 1;
+			break;
 #endif
 		case OPTVAL_DISPLAY:
 			renderer_config.display_id = optarg;
 			break;
+		case OPTVAL_PPUTHREAD:
+			renderer_config.threaded = 1;
+			break;
+		case OPTVAL_SCREENSHOTBURST: {
+			char *p;
+			screenshot_burst = strtol(optarg, &p, 10);
+			if (*p == ',')
+				screenshot_every = strtol(p + 1, &p, 10);
+			if (*p || screenshot_burst < 1 || screenshot_every < 1) {
+				fprintf(stderr, "%s: not a valid screenshot burst (COUNT[,EVERY])\n", optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		}
+		case OPTVAL_BENCHMARK: {
+			char *p;
+			long frames = strtol(optarg, &p, 10);
+			if (!strcmp(p, ",nodraw"))
+				benchmark_draw = 0;
+			else if (*p)
+				frames = 0;
+			if (frames < 1) {
+				fprintf(stderr, "%s: not a valid benchmark length (N[,nodraw])\n", optarg);
+				exit(EX_USAGE);
+			}
+			stats_init(frames);
+			break;
+		}
+		case OPTVAL_RECORDMOVIE:
+			movie_record_file = optarg;
+			break;
+		case OPTVAL_PLAYMOVIE:
+			movie_play_file = optarg;
+			break;
+		case OPTVAL_REWIND: {
+			char *p;
+			long seconds = strtol(optarg, &p, 10);
+			if (*p || seconds < 1 || seconds > 3600) {
+				fprintf(stderr, "%s: not a valid rewind length (1 to 3600 seconds)\n", optarg);
+				exit(EX_USAGE);
+			}
+			rewind_seconds = seconds;
+			break;
+		}
 		default:
 			fprintf(stderr, USAGE, *argv);
 			exit(EX_USAGE);
@@ -1376,6 +1571,37 @@ main(int argc, char **argv)
 	if (verbose)
 		fprintf(stderr, "Rom size: %d\n", size);
 
+	/* Choose audio backend */
+	{
+		int matches = 0; /* number of matches */
+		struct AudioBackend *match = 0; /* first match */
+
+		for (audio_backend = audio_backends; audio_backend->name; audio_backend++)
+			if (!strcmp(audio_backend->name, audioname)) {
+				match = audio_backend;
+				matches = 1;
+				break;
+			} else if (!strncmp(audio_backend->name, audioname, strlen(audioname))) {
+				match = audio_backend;
+				matches++;
+			}
+		if (matches != 1) {
+			if (matches)
+				fprintf(stderr, "%s: audio backend name `%s' is ambiguous\n",
+				        *argv, audioname);
+			else
+				fprintf(stderr, "%s: unrecognized audio backend name `%s'\n",
+				        *argv, audioname);
+			fprintf(stderr, USAGE, *argv);
+			exit(EX_USAGE);
+		}
+		audio_backend = match;
+		/* the null backend doesn't need a sound device */
+		if (!strcmp(audio_backend->name, "null") && !sound_config.audiofile
+		 && !sound_muted)
+			sound_config.audiofile = "null";
+	}
+
 	/* Initialize sound playback */
 	if (InitAudio()) {
 		fprintf(stderr, "%s: warning: failed to initialize sound playback\n", *argv);
@@ -1638,6 +1864,8 @@ main(int argc, char **argv)
 	}
 
 	/* Choose renderer */
+	if (benchmark_frames && !strcmp(rendname, "auto"))
+		rendname = "bench";
 	{
 		int matches = 0; /* number of matches */
 		struct Renderer *match = 0; /* first match */
@@ -1672,12 +1900,28 @@ main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	/* Nametable layout from the ROM header or --mirror, for every
+	   renderer; this needs drawimage, so it comes after InitDisplay */
+	if (osmirror)
+		ntmirror(MIRROR_ONESCREEN);
+	else if (nomirror)
+		ntmirror(MIRROR_FOURSCREEN);
+	else if (hvmirror)
+		ntmirror(MIRROR_HORIZONTAL);
+	else
+		ntmirror(MIRROR_VERTICAL);
+
 	/* trap traps */
 	if (!disassemble)
 		if ((oldtraphandler = signal(SIGTRAP, &traphandler)) == SIG_ERR) {
 			perror("signal");
 		}
 
+	/* input movie, from the very first frame */
+	movie_start();
+	savestate_init();
+	rewind_init();
+
 	/* start the show */
 	START();
 
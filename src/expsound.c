@@ -0,0 +1,437 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: The sound channels of the chips some cartridges add to
+ * the NES: the two pulses and the PCM of the MMC5, the eight wavetable
+ * channels of the Namco 163 and the three squares of the Sunsoft 5B (an
+ * FME-7 with sound).
+ *
+ * A mapper whose cartridge may have one of them hands it to
+ * SoundExpansion() when the game first writes to its sound registers,
+ * and not before, so that the APU keeps its full volume on the boards
+ * without the chip. The mapper posts the writes to the chip's sound
+ * registers to the same ring as the APU's, SynthFrame() applies them in
+ * time with those, and the chip renders the samples in between into a
+ * buffer of its own, or one for each channel when they are panned, scaled
+ * or muted apart, which is added to the APU's output. The chips are
+ * sampled at the output rate, whether or not --bandlimit is given.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "expsound.h"
+
+#define SQUARE_LEVEL    4876    /* an APU square at full volume */
+#define DMC_LEVEL       18393   /* the DMC at full volume */
+
+static unsigned int cycles_per_sample;  /* in 1/65536 cycle */
+
+/* The chip's state, for saved states; only one is ever in use */
+static union {
+	struct mmc5 {
+		struct pulse {
+			unsigned char   enabled;
+			unsigned char   duty;
+			unsigned char   halt;           /* and envelope loop */
+			unsigned char   constant;
+			unsigned char   volume;         /* and envelope period */
+			unsigned short  timer;
+			unsigned char   length;
+			unsigned char   env_start;
+			unsigned char   env_divider;
+			unsigned char   env_decay;
+			unsigned char   step;
+			unsigned long long counter;
+		} pulse[2];
+		unsigned char   pcm_read;               /* PCM in read mode */
+		unsigned char   pcm;
+		unsigned long long frame;               /* 240 Hz sequencer */
+	} mmc5;
+	struct n163 {
+		unsigned char   ram[128];
+		unsigned char   out[8];                 /* of each channel */
+		unsigned int    channel;                /* to be updated next */
+		unsigned long long counter;
+	} n163;
+	struct s5b {
+		unsigned char   reg[16];
+		unsigned char   tone[3];
+		unsigned int    lfsr;
+		unsigned char   env_pos;
+		unsigned char   env_up;
+		unsigned char   env_held;
+		unsigned char   env_level;
+		unsigned long long tone_counter[3];
+		unsigned long long noise_counter;
+		unsigned long long env_counter;
+	} s5b;
+} chip;
+
+/* Output levels, scaled when the chip is set up */
+static int      mmc5_pulse_level[31];
+static int      mmc5_pcm_level[256];
+static int      n163_gain[9];           /* by active channels, in 1/256 */
+static int      s5b_level[32];
+
+/* The chip's state, for saved states */
+void *
+ExpansionSoundState(unsigned int *size)
+{
+	*size = sizeof(chip);
+	return &chip;
+}
+
+/*
+ * Advance a counter by a sample; returns how many times a period of n
+ * cycles ended.
+ */
+static inline unsigned int
+tick(unsigned long long *counter, unsigned int n)
+{
+	unsigned long long period = (unsigned long long)n << 16;
+	unsigned int k;
+
+	*counter += cycles_per_sample;
+	if (*counter < period)
+		return 0;
+	k = *counter / period;
+	*counter -= k * period;
+	return k;
+}
+
+/****************************************************************************/
+
+/*
+ * The MMC5's pulses work like the APU's, without the sweep, and with the
+ * envelope and the length counter clocked at 240 Hz by a sequencer of
+ * their own.  The PCM channel only plays what is written to $5011.
+ */
+
+#define MMC5_FRAME      7457    /* CPU cycles a 240 Hz clock */
+
+static const unsigned char length_table[0x20] = {
+	10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+	12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
+
+static const unsigned char duty_table[4][8] = {
+	{ 0, 1, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 1, 0, 0, 0, 0, 0 },
+	{ 0, 1, 1, 1, 1, 0, 0, 0 },
+	{ 1, 0, 0, 1, 1, 1, 1, 1 },
+};
+
+static void
+InitMMC5(unsigned int cps, int scale)
+{
+	memset(&chip, 0, sizeof(chip));
+	cycles_per_sample = cps;
+	for (int i = 0; i <= 30; i++)
+		mmc5_pulse_level[i] = (long long)i * SQUARE_LEVEL * scale / (15 << 16);
+	for (int i = 0; i < 256; i++)
+		mmc5_pcm_level[i] = (long long)i * DMC_LEVEL * scale / (255 << 16);
+}
+
+static void
+WriteMMC5(unsigned long addr, unsigned char value)
+{
+	struct pulse *p = &chip.mmc5.pulse[(addr >> 2) & 1];
+
+	switch (addr) {
+	case 0x5000:
+	case 0x5004:
+		p->duty = value >> 6;
+		p->halt = value & 0x20;
+		p->constant = value & 0x10;
+		p->volume = value & 0x0F;
+		break;
+	case 0x5002:
+	case 0x5006:
+		p->timer = (p->timer & 0x0700) | value;
+		break;
+	case 0x5003:
+	case 0x5007:
+		p->timer = (p->timer & 0x00FF) | ((value & 0x07) << 8);
+		if (p->enabled)
+			p->length = length_table[value >> 3];
+		p->env_start = 1;
+		p->step = 0;
+		break;
+	case 0x5010:
+		chip.mmc5.pcm_read = value & 0x01;
+		break;
+	case 0x5011:
+		/* 0 doesn't play; reading samples from ROM isn't supported */
+		if (!chip.mmc5.pcm_read && value)
+			chip.mmc5.pcm = value;
+		break;
+	case 0x5015:
+		for (int i = 0; i < 2; i++) {
+			p = &chip.mmc5.pulse[i];
+			p->enabled = value & (1 << i);
+			if (!p->enabled)
+				p->length = 0;
+		}
+		break;
+	}
+}
+
+/* The 240 Hz clock of the envelopes and the length counters */
+static void
+ClockMMC5(struct pulse *p)
+{
+	if (p->env_start) {
+		p->env_start = 0;
+		p->env_decay = 15;
+		p->env_divider = p->volume;
+	} else if (p->env_divider) {
+		p->env_divider--;
+	} else {
+		p->env_divider = p->volume;
+		if (p->env_decay)
+			p->env_decay--;
+		else if (p->halt)
+			p->env_decay = 15;
+	}
+	if (!p->halt && p->length)
+		p->length--;
+}
+
+/* The pulses are mixed like the APU's, through one table, unless apart */
+static void
+RenderMMC5(int *const *out, unsigned int start, unsigned int n)
+{
+	for (unsigned int i = start; i < start + n; i++) {
+		int level[2] = { 0, 0 };
+
+		for (unsigned int k = tick(&chip.mmc5.frame, MMC5_FRAME); k; k--) {
+			ClockMMC5(&chip.mmc5.pulse[0]);
+			ClockMMC5(&chip.mmc5.pulse[1]);
+		}
+		for (int c = 0; c < 2; c++) {
+			struct pulse *p = &chip.mmc5.pulse[c];
+
+			p->step = (p->step + tick(&p->counter, (p->timer + 1) * 2)) & 7;
+			if (p->length && duty_table[p->duty][p->step])
+				level[c] = p->constant ? p->volume : p->env_decay;
+		}
+		if (out[0] == out[1]) {
+			out[0][i] += mmc5_pulse_level[level[0] + level[1]]
+			           + mmc5_pcm_level[chip.mmc5.pcm];
+		} else {
+			out[0][i] += mmc5_pulse_level[level[0]];
+			out[1][i] += mmc5_pulse_level[level[1]];
+			out[2][i] += mmc5_pcm_level[chip.mmc5.pcm];
+		}
+	}
+}
+
+const struct ExpansionSound mmc5_sound = {
+	"MMC5", 2 * SQUARE_LEVEL + DMC_LEVEL, 3,
+	InitMMC5, WriteMMC5, RenderMMC5,
+};
+
+/****************************************************************************/
+
+/*
+ * The Namco 163 keeps its channels in the top of 128 bytes of RAM, which
+ * also holds the 4-bit samples of their waveforms.  Every 15 CPU cycles
+ * it updates the next of the channels enabled, 1 to 8 of them counting
+ * down from the last; its output switches between them, and here it is
+ * their average.
+ */
+
+#define N163_CYCLES     15      /* CPU cycles a channel update */
+
+static void
+InitN163(unsigned int cps, int scale)
+{
+	memset(&chip, 0, sizeof(chip));
+	cycles_per_sample = cps;
+	/* one channel at full volume is two APU squares */
+	for (int n = 1; n <= 8; n++)
+		n163_gain[n] = 2.0 * SQUARE_LEVEL * 256 / 225 / n * scale / 65536;
+}
+
+static void
+WriteN163(unsigned long addr, unsigned char value)
+{
+	chip.n163.ram[addr & 0x7F] = value;
+}
+
+/* Step channel c through its waveform */
+static void
+UpdateN163(unsigned int c)
+{
+	unsigned char *r = chip.n163.ram + 0x40 + c * 8;
+	unsigned int freq = r[0] | r[2] << 8 | (r[4] & 0x03) << 16;
+	unsigned int phase = r[1] | r[3] << 8 | r[5] << 16;
+	unsigned int addr;
+
+	phase = (phase + freq) % ((256 - (r[4] & 0xFC)) << 16);
+	r[1] = phase;
+	r[3] = phase >> 8;
+	r[5] = phase >> 16;
+	addr = (r[6] + (phase >> 16)) & 0xFF;
+	chip.n163.out[c] = (chip.n163.ram[addr >> 1] >> ((addr & 1) << 2) & 0x0F)
+	                 * (r[7] & 0x0F);
+}
+
+static void
+RenderN163(int *const *out, unsigned int start, unsigned int n)
+{
+	unsigned int channels = ((chip.n163.ram[0x7F] >> 4) & 0x07) + 1;
+	unsigned int first = 8 - channels;
+	int gain = n163_gain[channels];
+
+	for (unsigned int i = start; i < start + n; i++) {
+		int sum = 0;
+
+		for (unsigned int k = tick(&chip.n163.counter, N163_CYCLES); k; k--) {
+			if (chip.n163.channel < first)
+				chip.n163.channel = first;
+			UpdateN163(chip.n163.channel);
+			chip.n163.channel = chip.n163.channel == 7
+			                  ? first : chip.n163.channel + 1;
+		}
+		if (out[0] == out[7]) {
+			for (unsigned int c = first; c < 8; c++)
+				sum += chip.n163.out[c];
+			out[0][i] += sum * gain >> 8;
+		} else {
+			for (unsigned int c = first; c < 8; c++)
+				out[c][i] += chip.n163.out[c] * gain >> 8;
+		}
+	}
+}
+
+const struct ExpansionSound namco163_sound = {
+	"Namco 163", 2 * SQUARE_LEVEL, 8,
+	InitN163, WriteN163, RenderN163,
+};
+
+/****************************************************************************/
+
+/*
+ * The Sunsoft 5B is a YM2149: three squares, with noise and an envelope
+ * which can be mixed into any of them, at 1.5 dB a volume step.
+ */
+
+/* 65535 * 10^((level - 31) * 1.5 / 20) */
+static const unsigned short s5b_volume[32] = {
+	    0,   369,   438,   521,   619,   735,   874,  1039,
+	 1234,  1467,  1744,  2072,  2463,  2927,  3479,  4135,
+	 4914,  5841,  6942,  8250,  9806, 11654, 13851, 16462,
+	19565, 23253, 27636, 32845, 39037, 46395, 55141, 65535,
+};
+
+static void
+InitS5B(unsigned int cps, int scale)
+{
+	memset(&chip, 0, sizeof(chip));
+	cycles_per_sample = cps;
+	chip.s5b.lfsr = 1;
+	chip.s5b.env_held = 1;
+	/* each channel at full volume is an APU square */
+	for (int i = 0; i < 32; i++)
+		s5b_level[i] = (long long)s5b_volume[i] * SQUARE_LEVEL * scale
+		               / 65535 / 65536;
+}
+
+static void
+WriteS5B(unsigned long addr, unsigned char value)
+{
+	chip.s5b.reg[addr & 0x0F] = value;
+	if ((addr & 0x0F) == 0x0D) {
+		/* restart the envelope */
+		chip.s5b.env_pos = 0;
+		chip.s5b.env_up = (value & 0x04) != 0;
+		chip.s5b.env_held = 0;
+		chip.s5b.env_level = chip.s5b.env_up ? 0 : 31;
+		chip.s5b.env_counter = 0;
+	}
+}
+
+/* One of the 32 steps of the envelope */
+static void
+StepEnvelopeS5B(void)
+{
+	unsigned char shape = chip.s5b.reg[0x0D];
+
+	if (chip.s5b.env_held)
+		return;
+	if (++chip.s5b.env_pos == 32) {
+		chip.s5b.env_pos = 0;
+		if (!(shape & 0x08)) {
+			/* once, then silence */
+			chip.s5b.env_held = 1;
+			chip.s5b.env_level = 0;
+			return;
+		}
+		if (shape & 0x02)       /* alternate */
+			chip.s5b.env_up = !chip.s5b.env_up;
+		if (shape & 0x01) {     /* hold */
+			chip.s5b.env_held = 1;
+			chip.s5b.env_level = chip.s5b.env_up ? 31 : 0;
+			return;
+		}
+	}
+	chip.s5b.env_level = chip.s5b.env_up ? chip.s5b.env_pos
+	                                     : 31 - chip.s5b.env_pos;
+}
+
+static void
+RenderS5B(int *const *out, unsigned int start, unsigned int n)
+{
+	const unsigned char *reg = chip.s5b.reg;
+	unsigned int noise = reg[6] & 0x1F;
+	unsigned int env = reg[0x0B] | reg[0x0C] << 8;
+
+	/* a period of 0 is taken as 1 */
+	if (!noise)
+		noise = 1;
+	if (!env)
+		env = 1;
+
+	for (unsigned int i = start; i < start + n; i++) {
+		int level[3] = { 0, 0, 0 };
+
+		for (int c = 0; c < 3; c++) {
+			unsigned int period = reg[2 * c] | (reg[2 * c + 1] & 0x0F) << 8;
+
+			chip.s5b.tone[c] ^= tick(&chip.s5b.tone_counter[c],
+			                         16 * (period ? period : 1)) & 1;
+		}
+		for (unsigned int k = tick(&chip.s5b.noise_counter, 32 * noise); k; k--)
+			chip.s5b.lfsr = chip.s5b.lfsr >> 1
+			              | ((chip.s5b.lfsr ^ chip.s5b.lfsr >> 3) & 1) << 16;
+		for (unsigned int k = tick(&chip.s5b.env_counter, 16 * env); k; k--)
+			StepEnvelopeS5B();
+
+		for (int c = 0; c < 3; c++) {
+			unsigned int off = reg[7] >> c;
+			unsigned int volume = reg[8 + c] & 0x10 ? chip.s5b.env_level
+			                    : reg[8 + c] & 0x0F
+			                    ? (reg[8 + c] & 0x0F) * 2 + 1 : 0;
+
+			if ((chip.s5b.tone[c] | off) & (chip.s5b.lfsr | off >> 3) & 1)
+				level[c] = s5b_level[volume];
+		}
+		if (out[0] == out[1]) {
+			out[0][i] += level[0] + level[1] + level[2];
+		} else {
+			for (int c = 0; c < 3; c++)
+				out[c][i] += level[c];
+		}
+	}
+}
+
+const struct ExpansionSound sunsoft5b_sound = {
+	"Sunsoft 5B", 3 * SQUARE_LEVEL, 3,
+	InitS5B, WriteS5B, RenderS5B,
+};
@@ -0,0 +1,40 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Sound channels of the mappers' expansion chips
+ */
+
+#ifndef EXPSOUND_H
+#define EXPSOUND_H
+
+struct ExpansionSound {
+	const char *name;
+	int        peak;        /* loudest output, where the APU's is 32767 */
+	int        channels;    /* named exp1, exp2, ... in the mixer */
+	/* start from power-up; the chip's CPU clock is cycles_per_sample
+	   (in 1/65536 cycle) a sample, and its output is scaled by
+	   scale / 65536 */
+	void (*init)(unsigned int cycles_per_sample, int scale);
+	/* a write to a sound register, from the event ring; see below */
+	void (*write)(unsigned long addr, unsigned char value);
+	/* add the next n samples of channel c's output to out[c], from
+	   out[c][start] on; either every channel has a buffer of its own or
+	   they all share one, and then they may be mixed as one */
+	void (*render)(int *const *out, unsigned int start, unsigned int n);
+};
+
+/*
+ * The chips, the addresses their writes are posted at, and their channels:
+ *   MMC5         $5000-$5015, as written; the two pulses and the PCM
+ *   Namco 163    $4800 + the internal RAM address written through $4800;
+ *                the channels at $40, $48, ... $78 of that RAM
+ *   Sunsoft 5B   $E000 + the register written through $E000; A, B and C
+ */
+extern const struct ExpansionSound mmc5_sound;
+extern const struct ExpansionSound namco163_sound;
+extern const struct ExpansionSound sunsoft5b_sound;
+
+extern void    *ExpansionSoundState(unsigned int *size);
+
+#endif
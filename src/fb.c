@@ -16,6 +16,7 @@
 #include <string.h>
 
 #include "globals.h"
+#include "ppulog.h"
 #include "renderer.h"
 
 /* globals */
@@ -26,10 +27,7 @@ unsigned int    bytes_per_line;
 unsigned int    lsb_first;
 unsigned int    lsn_first; /* nybbles swapped? Ick! */
 unsigned int    pix_swab;
-unsigned int    vline = 0;
-unsigned int    vscan = 0;
 unsigned int    frameskip = 0;
-unsigned int    vwrap = 0;
 char    *fb = 0;
 char    *rfb = 0;
 static int      palette_alloc[25];
@@ -37,10 +35,26 @@ int     *palette = palette_alloc;
 
 void    (*drawimage)(int);
 void    fbinit(void);
+void    fbprivate(void);
+void    fbcolors(void);
+int     fbdirtyrows(const char *, unsigned char *);
 
 void    mmc2_4_latch(int);
 void    mmc2_4_latchspr(int);
 
+/* Drawing state, carried from one drawimage call to the next */
+static unsigned int     lastclock = 0;
+static unsigned int     curhscroll = 0;
+static unsigned int     scannt = 0;     /* logical nametable being drawn */
+static unsigned int     scanpage = 0;   /* its address in VRAM */
+static int      bit;
+static unsigned char    byte1, byte2;
+static unsigned int     curpal[4];
+static unsigned char    tilecolor;
+static unsigned char    pix_mask;
+static char    *drawrptr, *drawrptr0;
+static char    *drawptr, *drawptr0;
+
 #define BPP 1
 #include "pixels.h"
 #undef BPP
@@ -71,11 +85,71 @@ drawimage_old(int endclock)
 	return;
 }
 
+/*
+ * Compare each row of an unscaled frame against a copy of the previous
+ * frame and set dirty[y] for the rows that changed, so a renderer can
+ * skip scaling and uploading the rest. Comparing rows with memcmp() is
+ * exact, and much cheaper than the hqx pass or an XPutImage of the same
+ * row. Returns the number of changed rows.
+ */
+int
+fbdirtyrows(const char *frame, unsigned char *dirty)
+{
+	static char lastframe[240][256 * 32 / 8];
+	unsigned int rowbytes = 256 * bpp / 8;
+	int changed = 0;
+
+	for (int y = 0; y < 240; y++) {
+		const char *row = frame + y * bytes_per_line;
+
+		dirty[y] = memcmp(lastframe[y], row, rowbytes) != 0;
+		if (dirty[y]) {
+			memcpy(lastframe[y], row, rowbytes);
+			changed++;
+		}
+	}
+	return changed;
+}
+
+/*
+ * Set up a private framebuffer of 0x00RRGGBB pixels, for renderers that
+ * don't draw straight into a display's image
+ */
+void
+fbprivate(void)
+{
+	bpp = bpu = 32;
+	bytes_per_line = 256 * 4;
+	lsb_first = lsn_first = 1;
+	pix_swab = 0;
+	renderer_config.indexedcolor = 0;
+	if (!(rfb = fb = calloc(240, bytes_per_line))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	fbcolors();
+}
+
+/* Set the palette tables of a private framebuffer from VRAM */
+void
+fbcolors(void)
+{
+	static unsigned char palette_cache[32];
+
+	if (VRAM[0x3f00] != palette_cache[0])
+		renderer_data.redrawbackground = 1;
+	palette[24] = NES_palette[VRAM[0x3f00] & 0x3f];
+	for (int x = 0; x < 24; x++)
+		palette[x] = NES_palette[VRAM[0x3f01 + x + (x / 3)] & 0x3f];
+	memcpy(palette_cache, &VRAM[0x3f00], 32);
+}
+
 void
 fbinit(void)
 {
-	if (renderer->InitDisplay == InitDisplayNone) {
-		/* Point drawimage to the no-op version */
+	if (!fb) {
+		/* Nothing to draw into (the `none' renderer);
+		   point drawimage to the no-op version */
 		drawimage = drawimage_old;
 	} else {
 		/* Point drawimage to the correct version for the bpp used: */
@@ -121,5 +195,6 @@ fbinit(void)
 			        bpp, bpu);
 			exit(EXIT_FAILURE);
 		}
+		ppu_init();
 	}
 }
@@ -14,6 +14,7 @@
 extern void     START(void);
 extern void     INPUT(void);
 extern void     OUTPUT(void);
+extern void     VRAMCOPY(void);
 extern void     U(void);
 extern void     NMI(void);
 extern unsigned int      MAPPERNUMBER;
@@ -21,10 +22,13 @@ extern unsigned char    *ROM_BASE;
 extern void     (*const MapperInit[])(void);
 extern void     (*const Mapper[])(void);
 extern void     (*drawimage)(int);
+extern void     ntmap(int, int);
+extern void     ntmirror(int);
+extern void     sprite0_invalidate(void);
+extern void    *io_state(unsigned int *);
+extern void    *mapper_state(unsigned int *);
 
 /* Global Variables */
-extern unsigned short int hscroll[], vscroll[];
-extern unsigned char     linereg[];
 extern unsigned char     spriteram[];
 extern unsigned char     vram[];
 extern const unsigned int *NES_palette;
@@ -40,9 +44,6 @@ extern unsigned int      lsb_first;
 extern unsigned int      lsn_first;
 extern unsigned int      pix_swab;
 extern unsigned int      frameskip;
-extern unsigned int      vline;
-extern unsigned int      vscan;
-extern unsigned int      vwrap;
 extern unsigned char     vscrollreg;
 extern unsigned char     hscrollreg;
 extern char     *rfb;
@@ -77,6 +78,17 @@ extern unsigned char **INT_MAP;
 #define NVRAM     (RAM+0x6000)      /* Battery RAM */
 #define VRAM      vram              /* Video memory */
 
+/* Nametable layouts for ntmirror() */
+#define MIRROR_ONESCREEN    0         /* all on page 0 */
+#define MIRROR_ONESCREEN_HI 1         /* all on page 1 */
+#define MIRROR_VERTICAL     2
+#define MIRROR_HORIZONTAL   3
+#define MIRROR_FOURSCREEN   4
+
+/* Physical 1k nametable pages for ntmap(); page n is at VRAM + 0x2000 + n * 0x400 */
+#define NT_EXRAM  4                   /* MMC5 expansion RAM */
+#define NT_FILL   5                   /* MMC5 fill-mode nametable */
+
 /* configuration variables */
 struct configvars {
 	char *tuxnesdir;  /* the home directory */
@@ -18,11 +18,20 @@
 #include "consts.h"
 #include "controller.h"
 #include "globals.h"
+#include "movie.h"
+#include "ppulog.h"
 #include "renderer.h"
+#include "rewind.h"
+#include "savestate.h"
 #include "sound.h"
+#include "stats.h"
 
 /* forward and external declarations */
 void    vs(int, unsigned char);
+void    mmc5(int, unsigned char);
+void    namcot106(int, unsigned char);
+unsigned char namcot106_read(int);
+void    quit(void);
 
 /* Declaration of global variables */
 unsigned char   vram[16384];
@@ -30,64 +39,193 @@ unsigned char   spriteram[256];
 unsigned int    hvmirror = 0;
 unsigned int    nomirror = 0;
 unsigned int    osmirror = 0;
-unsigned short int      hscroll[240];
-unsigned short int      vscroll[240];
-unsigned char   linereg[240];
 unsigned char   hscrollreg, vscrollreg;
 
-static int last_clock; /* For vblank bit */
-static int vbl = 0;
-static int hvscroll = 0;
-static unsigned int vramlatch = 0;
-static unsigned int VRAMPTR; /* address to read/write video memory */
-static int hscrollval, vscrollval;
+/*
+   PPU and I/O state which isn't kept in RAM[].  It is all in one
+   structure so that a saved state can copy it in one go; see io_state().
+ */
+static struct IOState {
+	unsigned int ntpage[4];         /* VRAM address of each of the four
+	                                   logical nametables; set up in main() */
+	int last_clock;                 /* For vblank bit */
+	int vbl;
+	int hvscroll;
+	unsigned int vramlatch;
+	unsigned int VRAMPTR;           /* address to read/write video memory */
+	unsigned char vram_read;        /* $2007 read buffer */
+	unsigned char spriteaddr;       /* $2003 */
+} io;
+
 static int sprite0hit;
+static int sprite0valid = 0; /* sprite0hit is up to date */
+
+/* The I/O state, for saved states */
+void *
+io_state(unsigned int *size)
+{
+	*size = sizeof(io);
+	return &io;
+}
+
+/*
+   Forget the cached sprite 0 hit time.  Called whenever sprite 0's
+   OAM entry, the sprite size or pattern table, or the pattern data
+   may have changed.
+ */
+void
+sprite0_invalidate(void)
+{
+	sprite0valid = 0;
+}
+
+/* Work out the PPU clock at which sprite 0 hits the background */
+static void
+sprite0_compute(void)
+{
+	unsigned char *ptr;
+
+	/* +40 is to account for the latency of the PPU; from the time it reads
+	   the background tile to the time the flag is set is about 40 cycles,
+	   give or take a few. */
+	sprite0hit = spriteram[0] * HCYCLES + HCYCLES + 85 + spriteram[3] + 40;
+	if (RAM[0x2000] & 0x20)
+		ptr = VRAM + ((spriteram[1] & 0xFE) << 4) + ((spriteram[1] & 1) << 12);         /* 8x16 sprites */
+	else
+		ptr = VRAM + (spriteram[1] << 4) + ((RAM[0x2000] & 0x08) << 9);         /* 8x8 sprites */
+	if ((RAM[0x2000] & 0x20)
+	 && (((long long *)ptr)[0] | ((long long *)ptr)[8]) == 0) {
+		sprite0hit += 8 * HCYCLES;
+		ptr += 16;
+	}
+	while ((ptr[0] | ptr[8]) == 0 && sprite0hit < spriteram[0] * HCYCLES + 5797) {
+		sprite0hit += HCYCLES;
+		ptr++;
+	}
+	sprite0valid = 1;
+}
+
+/* pages for each slot in the ntmirror() layouts */
+static const unsigned char ntlayout[][4] = {
+	[MIRROR_ONESCREEN]    = { 0, 0, 0, 0 },
+	[MIRROR_ONESCREEN_HI] = { 1, 1, 1, 1 },
+	[MIRROR_VERTICAL]     = { 0, 1, 0, 1 },
+	[MIRROR_HORIZONTAL]   = { 0, 0, 1, 1 },
+	[MIRROR_FOURSCREEN]   = { 0, 1, 2, 3 },
+};
+
+/*
+   Point a logical nametable (0-3, as selected by $2000) at a physical
+   1k page.  Mappers call this to change mirroring; the part of the
+   frame up to the current clock is still drawn with the old mapping.
+ */
+void
+ntmap(int slot, int page)
+{
+	unsigned int addr = 0x2000 + (page << 10);
+
+	if (io.ntpage[slot] == addr)
+		return;
+	io.ntpage[slot] = addr;
+	ppu_set(PPU_NT0 + slot, addr);
+}
+
+/* Switch to one of the standard MIRROR_* nametable layouts */
+void
+ntmirror(int mirror)
+{
+	for (int slot = 0; slot < 4; slot++)
+		ntmap(slot, ntlayout[mirror][slot]);
+}
+
+/* VRAM address of a PPU address in $2000-$3EFF */
+#define NTADDR(addr) (io.ntpage[((addr) >> 10) & 3] + ((addr) & 0x3FF))
+
+static void
+vram_write(unsigned int addr, unsigned char val)
+{
+	VRAM[addr] = val;
+	ppu_vram(addr, 1);
+	if (addr < 0x2000)
+		sprite0valid = 0;
+}
+
+/* Write to $2007 */
+static void
+vram_data(unsigned char val)
+{
+	/* A little bit about VRAM:
+
+	   The NES has two pages of internal VRAM.  The emulator always stores
+	   the data internally at 2000 and 2400, however the page at 2400 may
+	   be mapped to 2800 in the PPU address space, with the page at 2400
+	   mirroring 2000, or vice versa.
+
+	   0000-1FFF is mapped in from the game cartridge, and may be RAM or ROM.
+
+	   3Fxx holds the color palette.
+	 */
+
+	io.VRAMPTR &= 0x3fff;
+	/*mmc2_latch(io.VRAMPTR); */
+	/* For debugging */
+	/*if (CLOCK < VBL && (RAM[0x2001] & 8)) printf("vram write during refresh! "); */
+	/*printf("VRAM: %4x=%2x (+%d) scan %d\n", io.VRAMPTR, val, 1 << (((*REG1 & 4) >> 2) * 5), CLOCK); */
+	if (io.VRAMPTR >= 0x3f00) {
+		/* Write to color palette */
+
+		/* FIXME: when CLOCK<VBL we should switch into static-color mode */
+		unsigned int paladdr = io.VRAMPTR & ((io.VRAMPTR & 0x3) ? 0x3f1f : 0x3f0f);
+
+		/* Let the renderer pick up the new colours once the
+		 * whole batch of writes is in, see ppu_palette().
+		 *
+		 * FIXME - This might flicker on palettized displays; see
+		 * above for suggested fix, or use the "--static-color"
+		 * command-line parameter as a workaround.
+		 */
+		ppu_palette(paladdr & 0x1f);
+		VRAM[paladdr] = val;
+	} else if (io.VRAMPTR >= 0x2000) {
+		/* Nametables, mirrored through the page table */
+		vram_write(NTADDR(io.VRAMPTR), val);
+	} else
+		vram_write(io.VRAMPTR, val);
+
+	io.VRAMPTR += 1 << (((*REG1 & 4) >> 2) * 5);     /* bit 2 of $2000 controls increment */
+	io.VRAMPTR &= 0x3fff;
+}
 
 /* This is called whenever the game reads from 2xxx or 4xxx */
 unsigned char
 input(int addr)
 {
-	static unsigned char vram_read;
 	unsigned char INRET = 0;
 
 	/* Read PPU status register */
 	if (addr == 0x2002) {
-		/* +40 is to account for the latency of the PPU; from the time it reads
-		   the background tile to the time the flag is set is about 40 cycles,
-		   give or take a few. */
-		sprite0hit = spriteram[0] * HCYCLES + HCYCLES + 85 + spriteram[3] + 40;
-		unsigned char *ptr;
-		if (RAM[0x2000] & 0x20)
-			ptr = VRAM + ((spriteram[1] & 0xFE) << 4) + ((spriteram[1] & 1) << 12);         /* 8x16 sprites */
-		else
-			ptr = VRAM + (spriteram[1] << 4) + ((RAM[0x2000] & 0x08) << 9);         /* 8x8 sprites */
-		if ((RAM[0x2000] & 0x20)
-		 && (((long long *)ptr)[0] | ((long long *)ptr)[8]) == 0) {
-			sprite0hit += 8 * HCYCLES;
-			ptr += 16;
-		}
-		while ((ptr[0] | ptr[8]) == 0 && sprite0hit < spriteram[0] * HCYCLES + 5797) {
-			sprite0hit += HCYCLES;
-			ptr++;
-		}
+		/* Games poll this in tight loops, so only rescan sprite 0's
+		   pattern when something it depends on has changed. */
+		if (!sprite0valid)
+			sprite0_compute();
 		/* I'm sure this isn't really accurate.  The vblank flag is set
 		   before the NMI is triggered, but the timing here is just a
 		   guess; also a read should always clear the flag. */
-		/*        if ((vbl && CLOCK >= VBL && CLOCK < 29695) | */
+		/*        if ((io.vbl && CLOCK >= VBL && CLOCK < 29695) | */
 		/*          (CLOCK < VBL && CLOCK > 27393)) */
 		/*          { */
 		/*            INRET |= 0x80; */
-		/*            vbl--; */
+		/*            io.vbl--; */
 		/*          } */
 
 		if ((CLOCK >= 27393)
-		 && (last_clock >= CLOCK || last_clock <= 27393)) {
-			vbl=1;
+		 && (io.last_clock >= CLOCK || io.last_clock <= 27393)) {
+			io.vbl=1;
 		}
-		last_clock=CLOCK;
-		if (vbl && (CLOCK > 27393)) {
+		io.last_clock=CLOCK;
+		if (io.vbl && (CLOCK > 27393)) {
 			INRET |= 0x80;
-			vbl--;
+			io.vbl--;
 		}
 
 		/*       if ((CLOCK * 3 >= sprite0hit) && (CLOCK < 29695)) */
@@ -103,31 +241,26 @@ input(int addr)
 		if (CLOCK > VBL && !(RAM[0x2000] & 0x80)) {
 			/* This is totally wierd, but SMB and Zelda depend on it. */
 			RAM[0x2000] &= 0xFE;
-			for (int x = 0; x < 240; x++)
-				hscroll[x] = hscrollval & 255;
-			for (int x = 0; x < 240; x++)
-				linereg[x] = RAM[0x2000];
+			ppu_set(PPU_CTRL, RAM[0x2000]);
 			/*printf("Read: %4x=%2x (scan %d)\n", addr, INRET&0xff, CLOCK);*/
 		}
-		hvscroll = 0;
+		io.hvscroll = 0;
 		/*printf("Read: %4x=%2x (scan %d)\n", addr, INRET&0xff, CLOCK);*/
 	}
 
 	/* Read from VRAM */
 	if (addr == 0x2007) {
-		INRET = vram_read;
-		VRAMPTR &= 0x3fff;
-		if (VRAMPTR >= 0x3f00)
-			vram_read = VRAM[VRAMPTR & ((VRAMPTR & 0x3) ? 0x3f1f : 0x3f0f)];
-		else if (osmirror && VRAMPTR >= 0x2000 && VRAMPTR < 0x3000)
-			vram_read = VRAM[VRAMPTR & 0x23FF];     /* one screen */
-		else if (!nomirror && hvmirror && VRAMPTR >= 0x2400 && VRAMPTR < 0x2c00)
-			vram_read = VRAM[VRAMPTR - 0x400];
+		INRET = io.vram_read;
+		io.VRAMPTR &= 0x3fff;
+		if (io.VRAMPTR >= 0x3f00)
+			io.vram_read = VRAM[io.VRAMPTR & ((io.VRAMPTR & 0x3) ? 0x3f1f : 0x3f0f)];
+		else if (io.VRAMPTR >= 0x2000)
+			io.vram_read = VRAM[NTADDR(io.VRAMPTR)];
 		else
-			vram_read = VRAM[VRAMPTR];
-		VRAMPTR += 1 << (((*REG1 & 4) >> 2) * 5);     /* bit 2 of $2000 controls increment */
-		VRAMPTR &= 0x3fff;
-		/*printf("VRAM Read: %4x=%2x (scan %d)\n", VRAMPTR, INRET, CLOCK); */
+			io.vram_read = VRAM[io.VRAMPTR];
+		io.VRAMPTR += 1 << (((*REG1 & 4) >> 2) * 5);     /* bit 2 of $2000 controls increment */
+		io.VRAMPTR &= 0x3fff;
+		/*printf("VRAM Read: %4x=%2x (scan %d)\n", io.VRAMPTR, INRET, CLOCK); */
 
 		/*
 		 * This is the so-called mid-hblank update.  If an address is written
@@ -138,19 +271,12 @@ input(int addr)
 		 * address into horizontal/vertical offsets.
 		 */
 		if (CLOCK < VBL && (RAM[0x2001] & 8)) {
-			for (int x = (CLOCK * 3 / HCYCLES) + 1; x < 240; x++) {
-				hscroll[x] = (hscroll[x] & 0xff) | ((VRAMPTR & 0x400) >> 2);
-				vscroll[x] = (480 + 480 + (((VRAMPTR & 0x800) >> 11) * 240) + ((VRAMPTR & 0x3e0) >> 2) - ((CLOCK * 3 / HCYCLES) + 1)) % 480;
-			}
+			ppu_set(PPU_VLINE, (io.VRAMPTR & 0x3e0) >> 5);
+			ppu_set(PPU_VSCAN, 0);
 
-			drawimage(CLOCK * 3);
-			vline = (VRAMPTR & 0x3e0) >> 5;
-			vscan = 0;
-
-			/*printf("Read: %4x (scan %d, sprite0 %d) 2000=%2x 2001=%2x vbl=%d\n", addr, CLOCK, sprite0hit*HCYCLES, RAM[0x2000], RAM[0x2001], vbl); */
+			/*printf("Read: %4x (scan %d, sprite0 %d) 2000=%2x 2001=%2x vbl=%d\n", addr, CLOCK, sprite0hit*HCYCLES, RAM[0x2000], RAM[0x2001], io.vbl); */
 			/* For debugging */
-			/*printf("vram read during refresh! (%4x)\n", VRAMPTR); */
-			/*printf("v=%d oldv=%d\n", vscroll[CLOCK/HCYCLES/8], vscroll[CLOCK/HCYCLES/8-1]); */
+			/*printf("vram read during refresh! (%4x)\n", io.VRAMPTR); */
 		}
 	}
 
@@ -158,6 +284,10 @@ input(int addr)
 	if (addr == 0x4015) {
 		INRET = SoundGetLengthReg();
 	}
+
+	/* Namco 163 sound RAM */
+	if ((MAPPERNUMBER == 19) && ((addr & 0xF800) == 0x4800))
+		INRET = namcot106_read(addr);
 #if 0
 	if ((addr >= 0x4000) && (addr <= 0x4015)) {
 		INRET = RAM[addr];
@@ -191,79 +321,56 @@ input(int addr)
 void
 output(int addr, unsigned char val)
 {
-	int scanline;
-	static int spriteaddr;
-
-	if ((scanline = (CLOCK * 3 / HCYCLES) + 1) >= 240)
-		scanline = 0;
-
 	/* Select pattern table */
 	if (addr == 0x2000) {
-		drawimage(CLOCK * 3);
-
 		/* Ugly kludge - bit 1 of 2000 does not take effect until the
 		   next frame so this supresses it using the vertical wraparound
 		   bit.  This could be done a better way. */
-		if (hvmirror || nomirror)
-			vwrap ^= ((val ^ RAM[0x2000]) >> 1) & 1;
+		ppu_set(PPU_VWRAP_XOR, ((val ^ RAM[0x2000]) >> 1) & 1);
+		/* sprite size and sprite pattern table */
+		if ((val ^ RAM[0x2000]) & 0x28)
+			sprite0valid = 0;
 		RAM[0x2000] = val;
-		hscrollval = ((RAM[0x2000] & 1) << 8) | (hscrollval & 255);
-		vscrollval = (RAM[0x2000] & 2) * 120 + (vscrollval % 240);
+		ppu_set(PPU_CTRL, val);
 		/*printf("vrom base:0x%4x\n", 0x2000+((RAM[0x2000]&3)<<10)); */
-		for (int x = scanline; x < 240; x++)
-			hscroll[x] = hscrollval;
-		for (int x = scanline; x < 240; x++)
-			linereg[x] = RAM[0x2000];
 		/*printf("Write: %4x,%2x (scan %d)\n", addr, val, CLOCK); */
 	}
 
 	if (addr == 0x2001) {
-		drawimage(CLOCK * 3);
 		RAM[0x2001] = val;
+		ppu_set(PPU_MASK, val);
 	}
 
 	/* Set horizontal/vertical scroll */
 	if (addr == 0x2005) {
-		if (hvscroll ^= 1) {
-			drawimage(CLOCK * 3);
+		if (io.hvscroll ^= 1) {
 			hscrollreg = val;
-			hscrollval = ((RAM[0x2000] & 1) << 8) + val;
-			for (int x = scanline; x < 240; x++)
-				hscroll[x] = hscrollval;
-			/*printf("hscroll: %d\n", hscrollval); */
+			ppu_set(PPU_HSCROLL, val);
+			/*printf("hscroll: %d\n", val); */
 		} else {
 			vscrollreg = val;
-			/* A little kludge here... It appears that the PPU will actually
-			   accept bogus vscroll values above 240, wrapping around to 0
-			   when it reaches 256, without the usual page flip at line 240.
-			   The val+224 hack below is to compensate for this, so that the
-			   rest of the lines end up where they're supposed to be. */
-			vscrollval = ((RAM[0x2000] & 2) * 120 + ((val < 240) ? val : val + 224)) % 480;
-			if (scanline < 1)
-				for (int x = scanline; x < 240; x++)
-					vscroll[x] = vscrollval;
+			ppu_set(PPU_VSCROLL, val);
 			/* Note: Unlike the h-scroll, the v-scroll register only gets read
 			   on the first scanline.  To create split-screen vertical scrolling,
 			   2006/2007 must be used to directly update the PPU registers. */
 
 			/* More weirdness */
-			vramlatch = (vramlatch & 0x3c00) | (val << 2);
+			io.vramlatch = (io.vramlatch & 0x3c00) | (val << 2);
 
-			/*printf("vscroll: %d\n", vscrollval); */
+			/*printf("vscroll: %d\n", val); */
 		}
 	}
 
 	/* Load VRAM target address */
 	if (addr == 0x2006) {
-		drawimage(CLOCK * 3);
-		/* VRAMPTR = ((VRAMPTR & 0x3f) << 8) | val; */
+		/* io.VRAMPTR = ((io.VRAMPTR & 0x3f) << 8) | val; */
 
 		/* It appears that h/v scroll and the VRAM address registers share
 		   a common toggle-bit which deterines which byte is written to. */
-		if (hvscroll ^= 1) {
-			vramlatch = (vramlatch & 0xFF) | (val << 8);
+		if (io.hvscroll ^= 1) {
+			io.vramlatch = (io.vramlatch & 0xFF) | (val << 8);
 		} else {
-			vramlatch = (vramlatch & 0xFF00) | val;
+			io.vramlatch = (io.vramlatch & 0xFF00) | val;
 		}
 
 		/* For mid-hblank updates: */
@@ -272,29 +379,28 @@ output(int addr, unsigned char val)
 		   register load is followed by a read of 2005, then the scanline
 		   number is reset to zero and the scan starts with the top of the
 		   current char/tile line. (see above) */
-		if (hvscroll) {
+		if (io.hvscroll) {
 			/* Set page only on first write */
 			/* This is guesswork, but seems to function correctly. */
-			RAM[0x2000] = (RAM[0x2000] & 0xFC) | ((vramlatch & 0xC00) >> 10);
-			vscan = vramlatch >> 12;
-			vwrap = 0;
-			/*vscrollreg=(vscrollreg&0x3F)|((VRAMPTR&3)<<6);*/
+			RAM[0x2000] = (RAM[0x2000] & 0xFC) | ((io.vramlatch & 0xC00) >> 10);
+			ppu_set(PPU_CTRL, RAM[0x2000]);
+			ppu_set(PPU_VSCAN, io.vramlatch >> 12);
+			ppu_set(PPU_VWRAP, 0);
+			/*vscrollreg=(vscrollreg&0x3F)|((io.VRAMPTR&3)<<6);*/
 		} else {
 			/* Set offset on second write */
-			hscrollreg = (hscrollreg & 7) | ((vramlatch & 31) << 3);
-			vline = (vramlatch & 0x3e0) >> 5;
-			vscan = vramlatch >> 12;
-			vwrap = 0;
+			hscrollreg = (hscrollreg & 7) | ((io.vramlatch & 31) << 3);
+			ppu_set(PPU_HSCROLL, hscrollreg);
+			ppu_set(PPU_VLINE, (io.vramlatch & 0x3e0) >> 5);
+			ppu_set(PPU_VSCAN, io.vramlatch >> 12);
+			ppu_set(PPU_VWRAP, 0);
 		}
-		hscrollval = ((RAM[0x2000] & 1) << 8) + hscrollreg;
-		for (int x = scanline; x < 240; x++)
-			hscroll[x] = hscrollval;
 
-		/*if(CLOCK<VBL)printf("hbl update: %4x %d\n", VRAMPTR, CLOCK); */
+		/*if(CLOCK<VBL)printf("hbl update: %4x %d\n", io.VRAMPTR, CLOCK); */
 
-		/*if(CLOCK<VBL)printf("hbl update: %4x %d /%d /%d \n", VRAMPTR, CLOCK, vramlatch, hvscroll); */
-		/*VRAMPTR&=0x3fff; */
-		VRAMPTR = vramlatch & 0x3fff;
+		/*if(CLOCK<VBL)printf("hbl update: %4x %d /%d /%d \n", io.VRAMPTR, CLOCK, io.vramlatch, io.hvscroll); */
+		/*io.VRAMPTR&=0x3fff; */
+		io.VRAMPTR = io.vramlatch & 0x3fff;
 	}
 	/* Argh... This 2006 shit is complicated.  It seems that writing to
 	   2006 alters the low two bits of 2000, and furthermore makes it so
@@ -307,74 +413,21 @@ output(int addr, unsigned char val)
 	   completely correct. */
 
 	/* Write VRAM */
-	if (addr == 0x2007) {
-		/* A little bit about VRAM:
-
-		   The NES has two pages of internal VRAM.  The emulator always stores
-		   the data internally at 2000 and 2400, however the page at 2400 may
-		   be mapped to 2800 in the PPU address space, with the page at 2400
-		   mirroring 2000, or vice versa.
-
-		   0000-1FFF is mapped in from the game cartridge, and may be RAM or ROM.
-
-		   3Fxx holds the color palette.
-		 */
-
-		VRAMPTR &= 0x3fff;
-		/*mmc2_latch(VRAMPTR); */
-		/* For debugging */
-		/*if (CLOCK < VBL && (RAM[0x2001] & 8)) printf("vram write during refresh! "); */
-		/*printf("VRAM: %4x=%2x (+%d) scan %d\n", VRAMPTR, val, 1 << (((*REG1 & 4) >> 2) * 5), CLOCK); */
-		if (VRAMPTR >= 0x3f00) {
-			/* Write to color palette */
-
-			/* FIXME: when CLOCK<VBL we should switch into static-color mode */
-			VRAM[VRAMPTR & ((VRAMPTR & 0x3) ? 0x3f1f : 0x3f0f)] = val;
-
-			/* FIXME - This might flicker on palettized displays; see
-			 * above for suggested fix, or use the "--static-color"
-			 * command-line parameter as a workaround.
-			 */
-			renderer->UpdateColors();
-		} else if (VRAMPTR >= 0x2000 && VRAMPTR < 0x3000) {
-			if (nomirror)
-				VRAM[VRAMPTR] = val;
-			else if (osmirror)
-				VRAM[VRAMPTR & 0x23FF] = val;       /* One-Screen Mirroring */
-			else if (!hvmirror)
-				VRAM[VRAMPTR] =
-				VRAM[VRAMPTR ^ 0x800] = val;
-			else if (hvmirror) {
-				if (VRAMPTR >= 0x2000 && VRAMPTR < 0x2400)
-					VRAM[VRAMPTR] =
-					VRAM[VRAMPTR ^ 0x800] = val;
-				if (VRAMPTR >= 0x2400 && VRAMPTR < 0x2800)
-					VRAM[VRAMPTR - 0x400] =
-					VRAM[VRAMPTR + 0x400] = val;
-				if (VRAMPTR >= 0x2800 && VRAMPTR < 0x2c00)
-					VRAM[VRAMPTR - 0x400] =
-					VRAM[VRAMPTR + 0x400] = val;
-				if (VRAMPTR >= 0x2c00 && VRAMPTR < 0x3000)
-					VRAM[VRAMPTR] =
-					VRAM[VRAMPTR ^ 0x800] = val;
-			}
-		} else
-			VRAM[VRAMPTR] = val;
-
-		VRAMPTR += 1 << (((*REG1 & 4) >> 2) * 5);     /* bit 2 of $2000 controls increment */
-		VRAMPTR &= 0x3fff;
-	}
+	if (addr == 0x2007)
+		vram_data(val);
 
 	/* Write to pAPU registers */
 	if ((addr >= 0x4000) && (addr <= 0x4015)) {
 		/* Sprite DMA */
 		if (addr == 0x4014) {
 			/* I'm not entirely sure of this, but it seems accurate. */
-			drawimage(CLOCK * 3);
+			ppu_draw(CLOCK * 3);
 			if (val < 0x80)
 				memcpy(spriteram, RAM + (val << 8), 256);
 			else
 				memcpy(spriteram, MAPTABLE[val >> 4] + (val << 8), 256);
+			ppu_oam(0, 256);
+			sprite0valid = 0;
 			CLOCK += 514;
 			CTNI += 514;
 		} else {
@@ -384,9 +437,22 @@ output(int addr, unsigned char val)
 	}
 
 	if (addr == 0x2003)
-		spriteaddr = val;
-	if (addr == 0x2004)
-		spriteram[spriteaddr] = val;
+		io.spriteaddr = val;
+	if (addr == 0x2004) {
+		spriteram[io.spriteaddr] = val;
+		ppu_oam(io.spriteaddr, 1);
+		if (io.spriteaddr < 4)
+			sprite0valid = 0;
+	}
+
+	/* MMC5 sound, nametable mapping and expansion RAM */
+	if ((MAPPERNUMBER == 5) && ((addr >= 0x5000 && addr <= 0x5015)
+	                         || (addr >= 0x5105 && addr <= 0x5107) || addr >= 0x5C00))
+		mmc5(addr, val);
+
+	/* Namco 163 sound RAM */
+	if ((MAPPERNUMBER == 19) && ((addr & 0xF800) == 0x4800))
+		namcot106(addr, val);
 
 	/* VS UniSystem CHR rom bank switch */
 	if ((MAPPERNUMBER == 99) && (addr == 0x4016))
@@ -394,8 +460,15 @@ output(int addr, unsigned char val)
 
 	/* Reset controller */
 	if ((addr | 1) == 0x4017) {
-		RAM[0x4016] = controller[0] | controllerd[0];
-		RAM[0x4017] = controller[1] | controllerd[1];
+		unsigned int pad[2] = {
+			controller[0] | controllerd[0],
+			controller[1] | controllerd[1],
+		};
+
+		/* record or play back an input movie */
+		movie_latch(pad);
+		RAM[0x4016] = pad[0];
+		RAM[0x4017] = pad[1];
 	}
 
 	/* more debugging stuff: */
@@ -408,33 +481,99 @@ output(int addr, unsigned char val)
 
 }
 
+/* Advance the clock from C, as store_ctni_clock does in x86.S */
+static void
+addcycles(int cycles)
+{
+	CTNI += cycles;
+	CLOCK += cycles;
+	if (CLOCK >= CPF)
+		CLOCK -= CPF;
+}
+
+/*
+ * Bulk form of the usual VRAM upload loop
+ *
+ *	loop:	LDA (zp),Y
+ *		STA $2007
+ *		INY
+ *		BNE loop
+ *
+ * which table.x86 turns into a single call to VRAMCOPY.  pc is the
+ * address of the BNE and regs points to the saved %edx, %ecx and %eax.
+ * Every iteration is charged the cycles the translated instructions
+ * would take, and the copy stops after a BNE whenever an interrupt is
+ * due, so that the caller can jump to NMI just as the BNE would have.
+ */
+void
+vram_copy(unsigned int zp, unsigned int pc, unsigned int *regs)
+{
+	unsigned int base = ZPMEM[zp] | (ZPMEM[(zp + 1) & 0xff] << 8);
+	unsigned int y = (regs[1] >> 8) & 0xff;
+	unsigned char a = regs[2];
+	/* taking the branch costs a cycle more if it leaves the page */
+	int cross = ((pc - 6) & 0xff00) != ((pc + 2) & 0xff00);
+
+	for (;;) {
+		unsigned int addr = (base + y) & 0xffff;
+
+		/* LDA (zp),Y */
+		addcycles(5 + ((base & 0xff) + y > 0xff));
+		if (addr - 0x2000 < 0x4000)
+			a = input(addr);
+		else
+			a = MAPTABLE[addr >> 12][addr];
+		/* STA $2007 */
+		addcycles(4);
+		vram_data(a);
+		/* INY, BNE; the branch checks for interrupts before it
+		   knows whether it is taken */
+		y = (y + 1) & 0xff;
+		if (y == 0 && CTNI + 2 + 3 + cross < 0) {
+			addcycles(2 + 2);
+			break;
+		}
+		addcycles(2 + 3 + cross);
+		if (CTNI >= 0 || y == 0)
+			break;
+	}
+
+	regs[0] = (signed char)y;
+	regs[1] = (regs[1] & ~0xff00) | (y << 8);
+	regs[2] = (regs[2] & ~0xff) | a;
+}
+
 /* This determines whether an NMI should occur. */
 /* This function is called even when interrupts are off, and also */
 /* refreshes the screen as necessary. */
+/* regs points to the saved %edx, %ecx, %eax and %edi (the PC). */
 void
-donmi(void)
+donmi(unsigned int *regs)
 {
 	/*printf("donmi: at %d\n", CLOCK); */
 
 	CLOCK = VBL + 7;              /* 7 cycle interrupt latency */
 	CTNI = -CPF + 7;
 
-	if (last_clock >= CLOCK || last_clock <= 27393)
-		vbl=1;
-	last_clock = CLOCK;
+	if (io.last_clock >= CLOCK || io.last_clock <= 27393)
+		io.vbl=1;
+	io.last_clock = CLOCK;
 
-	UpdateAudio();
-	renderer->UpdateDisplay();
+	movie_frame();
+	if (stats_frame()) {
+		/* --benchmark run is over */
+		stats_report(stdout);
+		quit();
+	}
+	stats_time(STAT_AUDIO, UpdateAudio);
+	stats_time(STAT_DISPLAY, renderer->UpdateDisplay);
+	savestate_frame(regs);
+	rewind_frame(regs);
 
 	/*printf("donmi: stack at %x\n", STACKPTR); */
 
 	/* reset scroll registers */
-	/*hvscroll = 0;*/
-	for (int x = 0; x < 240; x++) {
-		hscroll[x] = hscrollval;
-		vscroll[x] = vscrollval;
-		linereg[x] = RAM[0x2000];
-	}
+	/*io.hvscroll = 0;*/
 }
 
 /*
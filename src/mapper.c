@@ -16,7 +16,10 @@
 #include <string.h>
 
 #include "consts.h"
+#include "expsound.h"
 #include "globals.h"
+#include "ppulog.h"
+#include "sound.h"
 
 /* some globals */
 extern unsigned char    *VROM_BASE;
@@ -27,8 +30,6 @@ extern unsigned int      VROM_MASK;
 extern unsigned int      VROM_MASK_1k;
 extern unsigned int      irqflag;
 
-extern void (*drawimage)(int);
-
 extern void MAPPER_NONE(void);
 extern void MAPPER_MMC1(void);
 extern void MAPPER_UNROM(void);
@@ -69,7 +70,56 @@ unsigned int mapmirror;
 
 static int prgmask;
 static int chrmask;
-static int commandregister;
+
+/*
+   Registers of the current mapper.  Everything a mapper has to remember
+   between writes lives here rather than in static variables, so that a
+   saved state can copy it in one go; see mapper_state().  Mappers that
+   are never used together share fields.
+ */
+static struct MapperRegs {
+	int mmc1reg[4];                 /* MMC1 */
+	int mmc1shc[4];
+	unsigned char mmc3cmd;          /* MMC3 */
+	unsigned char irqval;
+	unsigned char irqenabled;
+	int prgbanksize;                /* MMC5 */
+	int chrbanksize;
+	int exramselect;
+	int nametableselect;
+	int mmc2_4_latch1;              /* MMC2, MMC4 */
+	int mmc2_4_latch1hi;
+	int mmc2_4_latch1low;
+	int mmc2_4_latch2;
+	int mmc2_4_latch2hi;
+	int mmc2_4_latch2low;
+	int mmc2_4_init;
+	int loc8000;                    /* 100-in-1 */
+	int locA000;
+	int locC000;
+	int locE000;
+	int reg0000;                    /* VRC2 */
+	int reg0400;
+	int reg0800;
+	int reg0C00;
+	int reg1000;
+	int reg1400;
+	int reg1800;
+	int reg1C00;
+	int switchmode;                 /* Irem G-101 */
+	int commandregister;            /* Tengen RAMBO-1, Sunsoft FME-7 */
+	unsigned char soundreg;         /* Namco 163, Sunsoft 5B */
+	unsigned char n163ram[128];     /* Namco 163 */
+	int vsreg;                      /* VS UniSystem */
+} mapreg;
+
+/* The mapper registers, for saved states */
+void *
+mapper_state(unsigned int *size)
+{
+	*size = sizeof(mapreg);
+	return &mapreg;
+}
 
 /* #define DEBUG_MAPPER 1 */
 
@@ -122,6 +172,29 @@ MapRom(int page, unsigned loc, unsigned size)
 	return 0;
 }
 
+/*
+   Copy len bytes of VROM into video memory at addr, and let the
+   renderer know about it.
+ */
+static void
+chrcopy(unsigned int addr, const unsigned char *src, unsigned int len)
+{
+	memcpy(VRAM + addr, src, len);
+	ppu_vram(addr, len);
+	sprite0_invalidate();
+}
+
+/*
+   Switch between horizontal and vertical mirroring.  Cartridges with
+   their own four-screen VRAM keep it.
+ */
+static void
+mirror_hv(int horizontal)
+{
+	if (!nomirror)
+		ntmirror(horizontal ? MIRROR_HORIZONTAL : MIRROR_VERTICAL);
+}
+
 /****************************************************************************/
 
 static void
@@ -154,52 +227,56 @@ init_mmc1(void)
 void
 mmc1(int addr, unsigned char val)
 {
-	static int mmc1reg[4];
-	static int mmc1shc[4];
+	static const int mmc1mirror[4] = {
+		MIRROR_ONESCREEN, MIRROR_ONESCREEN_HI,
+		MIRROR_VERTICAL, MIRROR_HORIZONTAL
+	};
 	/*printf("Mapper MMC1:%4x,%2x\n", addr, val); */
 	/*printf("Mapper: %4x,%2x stack at %x, shift %d,%d,%d,%d\n", addr, val, STACKPTR,
-	   mmc1shc[0], mmc1shc[1], mmc1shc[2], mmc1shc[3]); */
+	   mapreg.mmc1shc[0], mapreg.mmc1shc[1], mapreg.mmc1shc[2], mapreg.mmc1shc[3]); */
 
 	if (val & 0x80) {
 		/* Reset Mapper */
-		mmc1reg[0] |= 12;
-		mmc1shc[0] = 0;
+		mapreg.mmc1reg[0] |= 12;
+		mapreg.mmc1shc[0] = 0;
 		/* When the mapper is reset, does it affect just one register or all?
 		   I think just one, but I am unsure of the exact effect of a reset. */
-		/*mmc1reg[1]=0; */ mmc1shc[1] = 0;
-		/*mmc1reg[2]=0; */ mmc1shc[2] = 0;
-		/*mmc1reg[3]=0; */ mmc1shc[3] = 0;
-		/*mmc1reg[1]=mmc1reg[2]=mmc1reg[3]=0; */
+		/*mapreg.mmc1reg[1]=0; */ mapreg.mmc1shc[1] = 0;
+		/*mapreg.mmc1reg[2]=0; */ mapreg.mmc1shc[2] = 0;
+		/*mapreg.mmc1reg[3]=0; */ mapreg.mmc1shc[3] = 0;
+		/*mapreg.mmc1reg[1]=mapreg.mmc1reg[2]=mapreg.mmc1reg[3]=0; */
 		/* MMC1 always has mirroring */
-		nomirror = 0;
+		if (nomirror) {
+			nomirror = 0;
+			ntmirror(osmirror ? MIRROR_ONESCREEN
+			         : hvmirror ? MIRROR_HORIZONTAL : MIRROR_VERTICAL);
+		}
 		/*printf("Mapper: MMC1 reset\n"); */
 	} else {
-		mmc1reg[(addr >> 13) & 3] >>= 1;
-		mmc1reg[(addr >> 13) & 3] |= (val & 1) << 4;
-		mmc1shc[(addr >> 13) & 3]++;
-		if (mmc1shc[(addr >> 13) & 3] % 5 == 0) {
+		mapreg.mmc1reg[(addr >> 13) & 3] >>= 1;
+		mapreg.mmc1reg[(addr >> 13) & 3] |= (val & 1) << 4;
+		mapreg.mmc1shc[(addr >> 13) & 3]++;
+		if (mapreg.mmc1shc[(addr >> 13) & 3] % 5 == 0) {
 			if (((addr >> 13) & 3) == 0) {
-				drawimage(CLOCK * 3);
-				hvmirror = mmc1reg[0] & 1;
-				osmirror = (~mmc1reg[0] & 2) >> 1;
+				ntmirror(mmc1mirror[mapreg.mmc1reg[0] & 3]);
 			} else if (VROM_PAGES) {
-				drawimage(CLOCK * 3);
+				ppu_draw(CLOCK * 3);
 				if (((addr >> 13) & 3) == 1)
-					memcpy(VRAM, VROM_BASE + (mmc1reg[1] & 31) * 0x1000, 4096 << ((mmc1reg[0] & 16) == 0));
-				if (((addr >> 13) & 3) == 2 && (mmc1reg[0] & 16) == 16)
-					memcpy(VRAM + 0x1000, VROM_BASE + (mmc1reg[2] & 31) * 0x1000, 4096);
+					chrcopy(0, VROM_BASE + (mapreg.mmc1reg[1] & 31) * 0x1000, 4096 << ((mapreg.mmc1reg[0] & 16) == 0));
+				if (((addr >> 13) & 3) == 2 && (mapreg.mmc1reg[0] & 16) == 16)
+					chrcopy(0x1000, VROM_BASE + (mapreg.mmc1reg[2] & 31) * 0x1000, 4096);
 			}
 
 			/* Set Map Table */
 
-			if (mmc1reg[0] & 8) {
+			if (mapreg.mmc1reg[0] & 8) {
 				/* Swap 16K rom */
-				if (mmc1reg[0] & 4) {
+				if (mapreg.mmc1reg[0] & 4) {
 					/* Swap $8000 */
 					MAPTABLE[8] =
 					MAPTABLE[9] =
 					MAPTABLE[10] =
-					MAPTABLE[11] = ROM_BASE + ((mmc1reg[3] & ROM_MASK) << 14) - 0x8000;
+					MAPTABLE[11] = ROM_BASE + ((mapreg.mmc1reg[3] & ROM_MASK) << 14) - 0x8000;
 					MAPTABLE[12] =
 					MAPTABLE[13] =
 					MAPTABLE[14] =
@@ -209,11 +286,11 @@ mmc1(int addr, unsigned char val)
 						MAPTABLE[8] =
 						MAPTABLE[9] =
 						MAPTABLE[10] =
-						MAPTABLE[11] = ROM_BASE + (mmc1reg[3] << 14) + ((mmc1reg[1] & 16) << 14) - 0x8000;
+						MAPTABLE[11] = ROM_BASE + (mapreg.mmc1reg[3] << 14) + ((mapreg.mmc1reg[1] & 16) << 14) - 0x8000;
 						MAPTABLE[12] =
 						MAPTABLE[13] =
 						MAPTABLE[14] =
-						MAPTABLE[15] = ROM_BASE + 262144 + ((mmc1reg[1] & 16) << 14) - 0x10000;    /* Last Page semi-hardwired */
+						MAPTABLE[15] = ROM_BASE + 262144 + ((mapreg.mmc1reg[1] & 16) << 14) - 0x10000;    /* Last Page semi-hardwired */
 					}
 				} else {
 					/* Swap $C000 */
@@ -224,7 +301,7 @@ mmc1(int addr, unsigned char val)
 					MAPTABLE[12] =
 					MAPTABLE[13] =
 					MAPTABLE[14] =
-					MAPTABLE[15] = ROM_BASE + ((mmc1reg[3] & ROM_MASK) << 14) + (((mmc1reg[1] & 16) << 14) & ((ROM_PAGES > 16) << 18)) - 0xC000;
+					MAPTABLE[15] = ROM_BASE + ((mapreg.mmc1reg[3] & ROM_MASK) << 14) + (((mapreg.mmc1reg[1] & 16) << 14) & ((ROM_PAGES > 16) << 18)) - 0xC000;
 				}
 			} else {
 				/* Swap 32K rom */
@@ -235,7 +312,7 @@ mmc1(int addr, unsigned char val)
 				MAPTABLE[12] =
 				MAPTABLE[13] =
 				MAPTABLE[14] =
-				MAPTABLE[15] = ROM_BASE + ((mmc1reg[3] & ROM_MASK & (~1)) << 14) + (((mmc1reg[1] & 16) << 14) & ((ROM_PAGES > 16) << 18)) - 0x8000;
+				MAPTABLE[15] = ROM_BASE + ((mapreg.mmc1reg[3] & ROM_MASK & (~1)) << 14) + (((mapreg.mmc1reg[1] & 16) << 14) & ((ROM_PAGES > 16) << 18)) - 0x8000;
 			}
 		}
 	}
@@ -285,7 +362,7 @@ init_cnrom(void)
 	}
 
 	init_none();
-	memcpy(VRAM, VROM_BASE, 8192);
+	chrcopy(0, VROM_BASE, 8192);
 }
 
 void
@@ -297,7 +374,7 @@ cnrom(int addr, unsigned char val)
 	}
 #endif
 
-	memcpy(VRAM, VROM_BASE + (val & chrmask) * 8192, 8192);
+	chrcopy(0, VROM_BASE + (val & chrmask) * 8192, 8192);
 }
 
 /****************************************************************************/
@@ -362,10 +439,6 @@ init_mmc3(void)
 void
 mmc3(int addr, unsigned char val)
 {
-	static unsigned char mmc3cmd;
-	static unsigned char irqval;
-	static unsigned char irqenabled = 0;
-
 #ifdef DEBUG_MAPPER
 	if (verbose) {
 		printf("addr = %04X, val = %02X\n", addr, val);
@@ -373,83 +446,82 @@ mmc3(int addr, unsigned char val)
 #endif
 
 	if (addr == 0x8000)
-		mmc3cmd = val;
+		mapreg.mmc3cmd = val;
 	if (addr == 0x8001) {
-		if ((mmc3cmd & 7) < 6)
-			drawimage(CLOCK * 3);
-
-		if ((mmc3cmd & 0x87) == 0)        /* Switch first 2k video ROM segment */
-			memcpy(VRAM, VROM_BASE + (val & VROM_MASK_1k & (~1)) * 1024, 2048);
-		if ((mmc3cmd & 0x87) == 1)        /* Switch second 2k video ROM segment */
-			memcpy(VRAM + 0x800, VROM_BASE + (val & VROM_MASK_1k & (~1)) * 1024, 2048);
-		if ((mmc3cmd & 0x87) == 0x80)     /* Switch first 2k video ROM segment to alternate address */
-			memcpy(VRAM + 0x1000, VROM_BASE + (val & VROM_MASK_1k & (~1)) * 1024, 2048);
-		if ((mmc3cmd & 0x87) == 0x81)     /* Switch second 2k video ROM segment to alternate address */
-			memcpy(VRAM + 0x1800, VROM_BASE + (val & VROM_MASK_1k & (~1)) * 1024, 2048);
-
-		if ((mmc3cmd & 0x87) == 2)        /* Switch first 1k video ROM segment */
-			memcpy(VRAM + 4096, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
-		if ((mmc3cmd & 0x87) == 3)        /* Switch second 1k video ROM segment */
-			memcpy(VRAM + 4096 + 1024, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
-		if ((mmc3cmd & 0x87) == 4)        /* Switch third 1k video ROM segment */
-			memcpy(VRAM + 4096 + 2048, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
-		if ((mmc3cmd & 0x87) == 5)        /* Switch fourth 1k video ROM segment */
-			memcpy(VRAM + 4096 + 3072, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
-		if ((mmc3cmd & 0x87) == 0x82)     /* Switch first 1k video ROM segment to alt addr */
-			memcpy(VRAM, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
-		if ((mmc3cmd & 0x87) == 0x83)     /* Switch second 1k video ROM segment to alt addr */
-			memcpy(VRAM + 1024, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
-		if ((mmc3cmd & 0x87) == 0x84)     /* Switch third 1k video ROM segment to alt addr */
-			memcpy(VRAM + 2048, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
-		if ((mmc3cmd & 0x87) == 0x85)     /* Switch fourth 1k video ROM segment to alt addr */
-			memcpy(VRAM + 3072, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
-
-		if ((mmc3cmd & 0x47) == 0x06)     /* Switch $8000 */
+		if ((mapreg.mmc3cmd & 7) < 6)
+			ppu_draw(CLOCK * 3);
+
+		if ((mapreg.mmc3cmd & 0x87) == 0)        /* Switch first 2k video ROM segment */
+			chrcopy(0, VROM_BASE + (val & VROM_MASK_1k & (~1)) * 1024, 2048);
+		if ((mapreg.mmc3cmd & 0x87) == 1)        /* Switch second 2k video ROM segment */
+			chrcopy(0x800, VROM_BASE + (val & VROM_MASK_1k & (~1)) * 1024, 2048);
+		if ((mapreg.mmc3cmd & 0x87) == 0x80)     /* Switch first 2k video ROM segment to alternate address */
+			chrcopy(0x1000, VROM_BASE + (val & VROM_MASK_1k & (~1)) * 1024, 2048);
+		if ((mapreg.mmc3cmd & 0x87) == 0x81)     /* Switch second 2k video ROM segment to alternate address */
+			chrcopy(0x1800, VROM_BASE + (val & VROM_MASK_1k & (~1)) * 1024, 2048);
+
+		if ((mapreg.mmc3cmd & 0x87) == 2)        /* Switch first 1k video ROM segment */
+			chrcopy(4096, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
+		if ((mapreg.mmc3cmd & 0x87) == 3)        /* Switch second 1k video ROM segment */
+			chrcopy(4096 + 1024, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
+		if ((mapreg.mmc3cmd & 0x87) == 4)        /* Switch third 1k video ROM segment */
+			chrcopy(4096 + 2048, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
+		if ((mapreg.mmc3cmd & 0x87) == 5)        /* Switch fourth 1k video ROM segment */
+			chrcopy(4096 + 3072, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
+		if ((mapreg.mmc3cmd & 0x87) == 0x82)     /* Switch first 1k video ROM segment to alt addr */
+			chrcopy(0, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
+		if ((mapreg.mmc3cmd & 0x87) == 0x83)     /* Switch second 1k video ROM segment to alt addr */
+			chrcopy(1024, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
+		if ((mapreg.mmc3cmd & 0x87) == 0x84)     /* Switch third 1k video ROM segment to alt addr */
+			chrcopy(2048, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
+		if ((mapreg.mmc3cmd & 0x87) == 0x85)     /* Switch fourth 1k video ROM segment to alt addr */
+			chrcopy(3072, VROM_BASE + (val & VROM_MASK_1k) * 1024, 1024);
+
+		if ((mapreg.mmc3cmd & 0x47) == 0x06)     /* Switch $8000 */
 			MAPTABLE[8] =
 			MAPTABLE[9] = ROM_BASE + 8192 * (val & LAST_HALF_PAGE) - 0x8000;
-		if ((mmc3cmd & 0x47) == 0x46)     /* Switch $C000 */
+		if ((mapreg.mmc3cmd & 0x47) == 0x46)     /* Switch $C000 */
 			MAPTABLE[12] =
 			MAPTABLE[13] = ROM_BASE + 8192 * (val & LAST_HALF_PAGE) - 0xC000;
-		if ((mmc3cmd & 7) == 7)   /* Switch $A000 */
+		if ((mapreg.mmc3cmd & 7) == 7)   /* Switch $A000 */
 			MAPTABLE[10] =
 			MAPTABLE[11] = ROM_BASE + 8192 * (val & LAST_HALF_PAGE) - 0xA000;
 
 	}
-	if (addr == 0xA000) {
-		hvmirror = val & 1;
-	}
+	if (addr == 0xA000)
+		mirror_hv(val & 1);
 	if (addr == 0xC000) {
-		irqval = val;
-		if (irqenabled) {
+		mapreg.irqval = val;
+		if (mapreg.irqenabled) {
 			if (CLOCK >= VBL) {
 				irqflag = 1;
-				CTNI = -((PPF - CLOCK * 3 + HCYCLES * (irqval)) / 3);
+				CTNI = -((PPF - CLOCK * 3 + HCYCLES * (mapreg.irqval)) / 3);
 			} else {
-				if ((CLOCK * 3 + (irqval + 1) * HCYCLES) < PBL) {
+				if ((CLOCK * 3 + (mapreg.irqval + 1) * HCYCLES) < PBL) {
 					irqflag = 1;
-					CTNI = -((HCYCLES * (irqval + 1) - ((CLOCK * 3) % HCYCLES)) / 3);
+					CTNI = -((HCYCLES * (mapreg.irqval + 1) - ((CLOCK * 3) % HCYCLES)) / 3);
 				}
-				/*printf("clock %d irqval %d set\n", CLOCK, irqval); */
+				/*printf("clock %d irqval %d set\n", CLOCK, mapreg.irqval); */
 			}
 		}
 	}
 
 	if (addr == 0xE000) {
-		irqenabled = 0;
+		mapreg.irqenabled = 0;
 		irqflag = 0;
 		CTNI = -((VBL - CLOCK + CPF) % CPF);
 	}
 
 	if (addr == 0xE001) {
-		irqenabled = 1;
+		mapreg.irqenabled = 1;
 		if (CLOCK >= VBL) {
 			irqflag = 1;
-			CTNI = -((PPF - CLOCK * 3 + HCYCLES * (irqval)) / 3);
+			CTNI = -((PPF - CLOCK * 3 + HCYCLES * (mapreg.irqval)) / 3);
 			/*printf("%d %d \n", CLOCK, CTNI); */
 		} else {
-			if ((CLOCK * 3 + (irqval + 1) * HCYCLES) < PBL) {
+			if ((CLOCK * 3 + (mapreg.irqval + 1) * HCYCLES) < PBL) {
 				irqflag = 1;
-				CTNI = -((HCYCLES * (irqval + 1) - ((CLOCK * 3) % HCYCLES)) / 3);
+				CTNI = -((HCYCLES * (mapreg.irqval + 1) - ((CLOCK * 3) % HCYCLES)) / 3);
 				/*printf("%d %d \n", CLOCK, CTNI); */
 			}
 		}
@@ -471,10 +543,7 @@ mmc3(int addr, unsigned char val)
 #define CHR_2K 2
 #define CHR_1K 3
 
-static int prgbanksize;
-static int chrbanksize;
-static int exramselect;
-static int nametableselect;
+static const int mmc5pages[4] = { 0, 1, NT_EXRAM, NT_FILL };
 static char *blankbank;
 
 static int prgmask8;
@@ -484,7 +553,7 @@ static int prgmask32;
 static void
 init_mmc5(void)
 {
-	prgbanksize = 2;
+	mapreg.prgbanksize = 2;
 
 	/* figure out if the PRG bank should be masked */
 	prgmask = 0;
@@ -520,24 +589,33 @@ mmc5(int addr, unsigned char val)
 	switch (addr) {
 	/* mapper registers */
 	case 0x5100:
-		prgbanksize = val & 0x03;
+		mapreg.prgbanksize = val & 0x03;
 		break;
 	case 0x5101:
-		chrbanksize = val & 0x03;
+		mapreg.chrbanksize = val & 0x03;
 		break;
 	case 0x5102:
 		break;
 	case 0x5103:
 		break;
 	case 0x5104:
-		exramselect = val & 0x03;
+		mapreg.exramselect = val & 0x03;
 		break;
 	case 0x5105:
-		nametableselect = val;
+		/* two bits per nametable: CIRAM page 0 or 1, ExRAM, fill */
+		mapreg.nametableselect = val;
+		for (int slot = 0; slot < 4; slot++)
+			ntmap(slot, mmc5pages[(val >> (slot * 2)) & 3]);
 		break;
 	case 0x5106:
+		/* fill-mode tile */
+		memset(VRAM + 0x2000 + NT_FILL * 0x400, val, 0x3C0);
+		ppu_vram(0x2000 + NT_FILL * 0x400, 0x3C0);
 		break;
 	case 0x5107:
+		/* fill-mode attribute */
+		memset(VRAM + 0x2000 + NT_FILL * 0x400 + 0x3C0, (val & 3) * 0x55, 0x40);
+		ppu_vram(0x2000 + NT_FILL * 0x400 + 0x3C0, 0x40);
 		break;
 
 	case 0x5113:
@@ -545,26 +623,26 @@ mmc5(int addr, unsigned char val)
 
 	/* PRG bank switching */
 	case 0x5114:
-		if (prgbanksize >= PRG_8K) {
+		if (mapreg.prgbanksize >= PRG_8K) {
 			MapRom(PAGE_8000, (val & prgmask8) * 8192, SIZE_8K);
 		}
 		break;
 	case 0x5115:
-		if (prgbanksize >= PRG_8K) {
+		if (mapreg.prgbanksize >= PRG_8K) {
 			MapRom(PAGE_A000, (val & prgmask8) * 8192, SIZE_8K);
-		} else if (prgbanksize == PRG_16K) {
+		} else if (mapreg.prgbanksize == PRG_16K) {
 			MapRom(PAGE_8000, ((val >> 1) & prgmask16) * 16384, SIZE_16K);
 		}
 		break;
 	case 0x5116:
-		if (prgbanksize >= PRG_8K) {
+		if (mapreg.prgbanksize >= PRG_8K) {
 			MapRom(PAGE_C000, (val & prgmask8) * 8192, SIZE_8K);
 		}
 		break;
 	case 0x5117:
-		if (prgbanksize >= PRG_8K) {
+		if (mapreg.prgbanksize >= PRG_8K) {
 			MapRom(PAGE_E000, (val & prgmask8) * 8192, SIZE_8K);
-		} else if (prgbanksize == PRG_16K) {
+		} else if (mapreg.prgbanksize == PRG_16K) {
 			MapRom(PAGE_8000, ((val >> 1) & prgmask16) * 16384, SIZE_16K);
 		} else {
 			MapRom(PAGE_8000, ((val >> 2) & prgmask32) * 32768, SIZE_32K);
@@ -573,79 +651,94 @@ mmc5(int addr, unsigned char val)
 
 	/* CHR bank switching for sprites */
 	case 0x5120:
-		if (chrbanksize == CHR_1K) {
-			memcpy(VRAM + 0x0000, VROM_BASE + val * 1024, 1024);
+		if (mapreg.chrbanksize == CHR_1K) {
+			chrcopy(0x0000, VROM_BASE + val * 1024, 1024);
 		}
 		break;
 	case 0x5121:
-		if (chrbanksize == CHR_1K) {
-			memcpy(VRAM + 0x0400, VROM_BASE + val * 1024, 1024);
-		} else if (chrbanksize == CHR_2K) {
-			memcpy(VRAM + 0x0000, VROM_BASE + val * 2048, 2048);
+		if (mapreg.chrbanksize == CHR_1K) {
+			chrcopy(0x0400, VROM_BASE + val * 1024, 1024);
+		} else if (mapreg.chrbanksize == CHR_2K) {
+			chrcopy(0x0000, VROM_BASE + val * 2048, 2048);
 		}
 		break;
 	case 0x5122:
-		if (chrbanksize == CHR_1K) {
-			memcpy(VRAM + 0x0800, VROM_BASE + val * 1024, 1024);
+		if (mapreg.chrbanksize == CHR_1K) {
+			chrcopy(0x0800, VROM_BASE + val * 1024, 1024);
 		}
 		break;
 	case 0x5123:
-		if (chrbanksize == CHR_1K) {
-			memcpy(VRAM + 0x0C00, VROM_BASE + val * 1024, 1024);
-		} else if (chrbanksize == CHR_2K) {
-			memcpy(VRAM + 0x0800, VROM_BASE + val * 2048, 2048);
-		} else if (chrbanksize == CHR_4K) {
-			memcpy(VRAM + 0x0000, VROM_BASE + val * 4096, 4096);
+		if (mapreg.chrbanksize == CHR_1K) {
+			chrcopy(0x0C00, VROM_BASE + val * 1024, 1024);
+		} else if (mapreg.chrbanksize == CHR_2K) {
+			chrcopy(0x0800, VROM_BASE + val * 2048, 2048);
+		} else if (mapreg.chrbanksize == CHR_4K) {
+			chrcopy(0x0000, VROM_BASE + val * 4096, 4096);
 		}
 		break;
 	case 0x5124:
-		if (chrbanksize == CHR_1K) {
-			memcpy(VRAM + 0x1000, VROM_BASE + val * 1024, 1024);
+		if (mapreg.chrbanksize == CHR_1K) {
+			chrcopy(0x1000, VROM_BASE + val * 1024, 1024);
 		}
 		break;
 	case 0x5125:
-		if (chrbanksize == CHR_1K) {
-			memcpy(VRAM + 0x1400, VROM_BASE + val * 1024, 1024);
-		} else if (chrbanksize == CHR_2K) {
-			memcpy(VRAM + 0x1000, VROM_BASE + val * 2048, 2048);
+		if (mapreg.chrbanksize == CHR_1K) {
+			chrcopy(0x1400, VROM_BASE + val * 1024, 1024);
+		} else if (mapreg.chrbanksize == CHR_2K) {
+			chrcopy(0x1000, VROM_BASE + val * 2048, 2048);
 		}
 		break;
 	case 0x5126:
-		if (chrbanksize == CHR_1K) {
-			memcpy(VRAM + 0x1800, VROM_BASE + val * 1024, 1024);
+		if (mapreg.chrbanksize == CHR_1K) {
+			chrcopy(0x1800, VROM_BASE + val * 1024, 1024);
 		}
 		break;
 	case 0x5127:
-		if (chrbanksize == CHR_1K) {
-			memcpy(VRAM + 0x1C00, VROM_BASE + val * 1024, 1024);
-		} else if (chrbanksize == CHR_2K) {
-			memcpy(VRAM + 0x1800, VROM_BASE + val * 2048, 2048);
-		} else if (chrbanksize == CHR_4K) {
-			memcpy(VRAM + 0x1000, VROM_BASE + val * 4096, 4096);
-		} else if (chrbanksize == CHR_8K) {
-			memcpy(VRAM + 0x1000, VROM_BASE + val * 4096, 4096);
+		if (mapreg.chrbanksize == CHR_1K) {
+			chrcopy(0x1C00, VROM_BASE + val * 1024, 1024);
+		} else if (mapreg.chrbanksize == CHR_2K) {
+			chrcopy(0x1800, VROM_BASE + val * 2048, 2048);
+		} else if (mapreg.chrbanksize == CHR_4K) {
+			chrcopy(0x1000, VROM_BASE + val * 4096, 4096);
+		} else if (mapreg.chrbanksize == CHR_8K) {
+			chrcopy(0x1000, VROM_BASE + val * 4096, 4096);
 		}
 		break;
 
 	/* CHR bank switching for nametables */
 	case 0x5128:
-		if ((exramselect & 0x01) == 0) {
-			memcpy(VRAM + 0x0000, VROM_BASE + val * 2048, 2048);
+		if ((mapreg.exramselect & 0x01) == 0) {
+			chrcopy(0x0000, VROM_BASE + val * 2048, 2048);
 		}
 		break;
 	case 0x5129:
-		if ((exramselect & 0x01) == 0) {
-			memcpy(VRAM + 0x0800, VROM_BASE + val * 2048, 2048);
+		if ((mapreg.exramselect & 0x01) == 0) {
+			chrcopy(0x0800, VROM_BASE + val * 2048, 2048);
 		}
 		break;
 	case 0x512A:
-		if ((exramselect & 0x01) == 0) {
-			memcpy(VRAM + 0x1000, VROM_BASE + val * 2048, 2048);
+		if ((mapreg.exramselect & 0x01) == 0) {
+			chrcopy(0x1000, VROM_BASE + val * 2048, 2048);
 		}
 		break;
 	case 0x512B:
-		if ((exramselect & 0x01) == 0) {
-			memcpy(VRAM + 0x1800, VROM_BASE + val * 2048, 2048);
+		if ((mapreg.exramselect & 0x01) == 0) {
+			chrcopy(0x1800, VROM_BASE + val * 2048, 2048);
+		}
+		break;
+
+	default:
+		/* sound */
+		if (addr >= 0x5000 && addr <= 0x5015) {
+			SoundExpansion(&mmc5_sound);
+			SoundEvent(addr, val);
+		}
+		/* expansion RAM, writable unless it's write-protected */
+		if (addr >= 0x5C00 && addr < 0x6000 && mapreg.exramselect != 3) {
+			unsigned int exaddr = 0x2000 + NT_EXRAM * 0x400 + (addr & 0x3FF);
+
+			VRAM[exaddr] = val;
+			ppu_vram(exaddr, 1);
 		}
 		break;
 	}
@@ -664,17 +757,9 @@ init_aorom(void)
 void
 aorom(int addr, unsigned char val)
 {
-	static int mirrorbit = 0;
-	char temp[1024];
 	/*printf("Mapper AOROM:%4x,%2x (%d)\n", addr, val, CLOCK); */
 	val &= 0x1f;
-	if ((val >> 4) != mirrorbit) {
-		drawimage(CLOCK * 3);
-		memcpy(temp, VRAM + 0x2000, 1024);
-		memcpy(VRAM + 0x2000, VRAM + 0x2400, 1024);
-		memcpy(VRAM + 0x2400, temp, 1024);
-		mirrorbit = (val >> 4);
-	}
+	ntmirror((val >> 4) ? MIRROR_ONESCREEN_HI : MIRROR_ONESCREEN);
 	val &= 0x0f;
 	val &= ROM_PAGES - 1;
 	MapRom(PAGE_8000, val << 15, SIZE_32K);
@@ -683,13 +768,6 @@ aorom(int addr, unsigned char val)
 /****************************************************************************/
 
 /* MMC2 for PunchOut contributed by Kristoffer Brånemyr */
-static int mmc2_4_latch1;
-static int mmc2_4_latch1hi;
-static int mmc2_4_latch1low;
-static int mmc2_4_latch2;
-static int mmc2_4_latch2hi;
-static int mmc2_4_latch2low;
-static int mmc2_4_init = 0;
 static void
 init_mmc2(void)
 {
@@ -704,13 +782,13 @@ init_mmc2(void)
 	MAPTABLE[14] =
 	MAPTABLE[15] = ROM_BASE + 0x10000;
 
-	mmc2_4_latch1 = 1;
-	mmc2_4_latch1low = 0;
-	mmc2_4_latch1hi = 0;
-	mmc2_4_latch2 = 1;
-	mmc2_4_latch2low = 0;
-	mmc2_4_latch2hi = 0;
-	mmc2_4_init = 1;
+	mapreg.mmc2_4_latch1 = 1;
+	mapreg.mmc2_4_latch1low = 0;
+	mapreg.mmc2_4_latch1hi = 0;
+	mapreg.mmc2_4_latch2 = 1;
+	mapreg.mmc2_4_latch2low = 0;
+	mapreg.mmc2_4_latch2hi = 0;
+	mapreg.mmc2_4_init = 1;
 }
 
 static void
@@ -719,41 +797,41 @@ init_mmc4(void)
 	MapRom(PAGE_8000, 0, SIZE_16K);
 	MapRom(PAGE_C000, LAST_PAGE * 16384, SIZE_16K);
 
-	mmc2_4_latch1 = 1;
-	mmc2_4_latch1low = 0;
-	mmc2_4_latch1hi = 0;
-	mmc2_4_latch2 = 1;
-	mmc2_4_latch2low = 0;
-	mmc2_4_latch2hi = 0;
-	mmc2_4_init = 1;
+	mapreg.mmc2_4_latch1 = 1;
+	mapreg.mmc2_4_latch1low = 0;
+	mapreg.mmc2_4_latch1hi = 0;
+	mapreg.mmc2_4_latch2 = 1;
+	mapreg.mmc2_4_latch2low = 0;
+	mapreg.mmc2_4_latch2hi = 0;
+	mapreg.mmc2_4_init = 1;
 }
 
 void
 mmc2_4_latch(int addr)
 {
-	if (mmc2_4_init == 0)
+	if (mapreg.mmc2_4_init == 0)
 		return;
 	addr = addr & 0xfff;
 	if (addr >= 0xfd0 && addr <= 0xfdf) {
-		mmc2_4_latch1 = 0;
-		memcpy(VRAM + 0x1000, VROM_BASE + (mmc2_4_latch1low * 0x1000), 0x1000);
+		mapreg.mmc2_4_latch1 = 0;
+		chrcopy(0x1000, VROM_BASE + (mapreg.mmc2_4_latch1low * 0x1000), 0x1000);
 	} else if (addr >= 0xfe0 && addr <= 0xfef) {
-		mmc2_4_latch1 = 1;
-		memcpy(VRAM + 0x1000, VROM_BASE + (mmc2_4_latch1hi * 0x1000), 0x1000);
+		mapreg.mmc2_4_latch1 = 1;
+		chrcopy(0x1000, VROM_BASE + (mapreg.mmc2_4_latch1hi * 0x1000), 0x1000);
 	}
 }
 
 void
 mmc2_4_latchspr(int tile)
 {
-	if (mmc2_4_init == 0)
+	if (mapreg.mmc2_4_init == 0)
 		return;
 	if (tile == 0xfd) {
-		mmc2_4_latch2 = 0;
-		memcpy(VRAM, VROM_BASE + (mmc2_4_latch2low * 0x1000), 0x1000);
+		mapreg.mmc2_4_latch2 = 0;
+		chrcopy(0, VROM_BASE + (mapreg.mmc2_4_latch2low * 0x1000), 0x1000);
 	} else if (tile == 0xfe) {
-		mmc2_4_latch2 = 1;
-		memcpy(VRAM, VROM_BASE + (mmc2_4_latch2hi * 0x1000), 0x1000);
+		mapreg.mmc2_4_latch2 = 1;
+		chrcopy(0, VROM_BASE + (mapreg.mmc2_4_latch2hi * 0x1000), 0x1000);
 	}
 }
 
@@ -768,41 +846,38 @@ mmc2(int addr, unsigned char val)
 	}
 	if (addr >= 0xB000 && addr <= 0xBFFF) {
 		/* switch ppu $0000 */
-		mmc2_4_latch2low = val;   /* #1 */
+		mapreg.mmc2_4_latch2low = val;   /* #1 */
 	}
 	if (addr >= 0xC000 && addr <= 0xCFFF) {
 		/* switch ppu $0000 */
-		mmc2_4_latch2hi = val;    /* #2 */
+		mapreg.mmc2_4_latch2hi = val;    /* #2 */
 	}
 	if (addr >= 0xB000 && addr <= 0xCFFF) {
 		/* switch ppu $0000 */
-		if (!mmc2_4_latch2) {
-			memcpy(VRAM, VROM_BASE + (mmc2_4_latch2low * 0x1000), 0x1000);
+		if (!mapreg.mmc2_4_latch2) {
+			chrcopy(0, VROM_BASE + (mapreg.mmc2_4_latch2low * 0x1000), 0x1000);
 		} else {
-			memcpy(VRAM, VROM_BASE + (mmc2_4_latch2hi * 0x1000), 0x1000);
+			chrcopy(0, VROM_BASE + (mapreg.mmc2_4_latch2hi * 0x1000), 0x1000);
 		}
 	}
 	if (addr >= 0xD000 && addr <= 0xDFFF) {
 		/* switch ppu $1000 */
-		mmc2_4_latch1low = val;   /* #1 */
+		mapreg.mmc2_4_latch1low = val;   /* #1 */
 	}
 	if (addr >= 0xE000 && addr <= 0xEFFF) {
 		/* switch ppu $1000 */
-		mmc2_4_latch1hi = val;    /* #2 */
+		mapreg.mmc2_4_latch1hi = val;    /* #2 */
 	}
 	if (addr >= 0xd000 && addr <= 0xefff) {
-		if (!mmc2_4_latch1) {
-			memcpy(VRAM + 0x1000, VROM_BASE + (mmc2_4_latch1low * 0x1000), 0x1000);
+		if (!mapreg.mmc2_4_latch1) {
+			chrcopy(0x1000, VROM_BASE + (mapreg.mmc2_4_latch1low * 0x1000), 0x1000);
 		} else {
-			memcpy(VRAM + 0x1000, VROM_BASE + (mmc2_4_latch1hi * 0x1000), 0x1000);
+			chrcopy(0x1000, VROM_BASE + (mapreg.mmc2_4_latch1hi * 0x1000), 0x1000);
 		}
 	}
 
 	if (addr >= 0xF000 && addr <= 0xFFFF) {
-		if (val == 0)
-			hvmirror = 0;
-		else
-			hvmirror = 1;
+		mirror_hv(val != 0);
 	}
 }
 
@@ -816,41 +891,38 @@ mmc4(int addr, unsigned char val)
 	}
 	if (addr >= 0xB000 && addr <= 0xBFFF) {
 		/* switch ppu $0000 */
-		mmc2_4_latch2low = val;   /* #1 */
+		mapreg.mmc2_4_latch2low = val;   /* #1 */
 	}
 	if (addr >= 0xC000 && addr <= 0xCFFF) {
 		/* switch ppu $0000 */
-		mmc2_4_latch2hi = val;    /* #2 */
+		mapreg.mmc2_4_latch2hi = val;    /* #2 */
 	}
 	if (addr >= 0xB000 && addr <= 0xCFFF) {
 		/* switch ppu $0000 */
-		if (!mmc2_4_latch2) {
-			memcpy(VRAM, VROM_BASE + (mmc2_4_latch2low * 0x1000), 0x1000);
+		if (!mapreg.mmc2_4_latch2) {
+			chrcopy(0, VROM_BASE + (mapreg.mmc2_4_latch2low * 0x1000), 0x1000);
 		} else {
-			memcpy(VRAM, VROM_BASE + (mmc2_4_latch2hi * 0x1000), 0x1000);
+			chrcopy(0, VROM_BASE + (mapreg.mmc2_4_latch2hi * 0x1000), 0x1000);
 		}
 	}
 	if (addr >= 0xD000 && addr <= 0xDFFF) {
 		/* switch ppu $1000 */
-		mmc2_4_latch1low = val;   /* #1 */
+		mapreg.mmc2_4_latch1low = val;   /* #1 */
 	}
 	if (addr >= 0xE000 && addr <= 0xEFFF) {
 		/* switch ppu $1000 */
-		mmc2_4_latch1hi = val;    /* #2 */
+		mapreg.mmc2_4_latch1hi = val;    /* #2 */
 	}
 	if (addr >= 0xd000 && addr <= 0xefff) {
-		if (!mmc2_4_latch1) {
-			memcpy(VRAM + 0x1000, VROM_BASE + (mmc2_4_latch1low * 0x1000), 0x1000);
+		if (!mapreg.mmc2_4_latch1) {
+			chrcopy(0x1000, VROM_BASE + (mapreg.mmc2_4_latch1low * 0x1000), 0x1000);
 		} else {
-			memcpy(VRAM + 0x1000, VROM_BASE + (mmc2_4_latch1hi * 0x1000), 0x1000);
+			chrcopy(0x1000, VROM_BASE + (mapreg.mmc2_4_latch1hi * 0x1000), 0x1000);
 		}
 	}
 
 	if (addr >= 0xF000 && addr <= 0xFFFF) {
-		if (val == 0)
-			hvmirror = 0;
-		else
-			hvmirror = 1;
+		mirror_hv(val != 0);
 	}
 }
 
@@ -887,7 +959,7 @@ clrdrms(int addr, unsigned char val)
 #endif
 
 	MapRom(PAGE_8000, (val & prgmask) * 32768, SIZE_32K);
-	memcpy(VRAM, VROM_BASE + (((val >> 4) & chrmask) * 8192), 8192);
+	chrcopy(0, VROM_BASE + (((val >> 4) & chrmask) * 8192), 8192);
 }
 
 /****************************************************************************/
@@ -897,7 +969,7 @@ static void
 init_cprom(void)
 {
 	MapRom(PAGE_8000, 0, SIZE_32K);
-	memcpy(VRAM, VROM_BASE, 4096);
+	chrcopy(0, VROM_BASE, 4096);
 }
 
 void
@@ -905,7 +977,7 @@ cprom(int addr, unsigned char val)
 {
 	if (addr & 0x8000) {
 		MapRom(PAGE_8000, (val >> 4) & 0x03, SIZE_32K);
-		memcpy(VRAM, VROM_BASE + (4096 * (val & 0x03)), 4096);
+		chrcopy(0, VROM_BASE + (4096 * (val & 0x03)), 4096);
 	}
 }
 
@@ -919,11 +991,6 @@ init_100in1(void)
 	MapRom(PAGE_8000, 0, SIZE_32K);
 }
 
-static int loc8000;
-static int locA000;
-static int locC000;
-static int locE000;
-
 void
 m100in1(int addr, unsigned char val)
 {
@@ -934,40 +1001,40 @@ m100in1(int addr, unsigned char val)
 	}
 #endif
 	if (addr == 0x8000) {
-		hvmirror = (~val & 0x40) >> 6;
+		mirror_hv((~val & 0x40) >> 6);
 		MapRom(PAGE_8000, 16384 * (val & 0x1F), SIZE_32K);
 
-		loc8000 = 16384 * (val & 0x1F);
-		locA000 = loc8000 + 0x2000;
-		locC000 = locA000 + 0x2000;
-		locE000 = locC000 + 0x2000;
+		mapreg.loc8000 = 16384 * (val & 0x1F);
+		mapreg.locA000 = mapreg.loc8000 + 0x2000;
+		mapreg.locC000 = mapreg.locA000 + 0x2000;
+		mapreg.locE000 = mapreg.locC000 + 0x2000;
 
 /*
 		if (val & 0x80) {
-			MapRom(PAGE_C000, locE000, SIZE_8K);
-			MapRom(PAGE_E000, locC000, SIZE_8K);
-			locswap = locC000;
-			locC000 = locE000;
-			locE000 = locswap;
+			MapRom(PAGE_C000, mapreg.locE000, SIZE_8K);
+			MapRom(PAGE_E000, mapreg.locC000, SIZE_8K);
+			locswap = mapreg.locC000;
+			mapreg.locC000 = mapreg.locE000;
+			mapreg.locE000 = locswap;
 		} else {
-			MapRom(PAGE_8000, locA000, SIZE_8K);
-			MapRom(PAGE_A000, loc8000, SIZE_8K);
-			locswap = loc8000;
-			loc8000 = locA000;
-			locA000 = locswap;
+			MapRom(PAGE_8000, mapreg.locA000, SIZE_8K);
+			MapRom(PAGE_A000, mapreg.loc8000, SIZE_8K);
+			locswap = mapreg.loc8000;
+			mapreg.loc8000 = mapreg.locA000;
+			mapreg.locA000 = locswap;
 		}
 */
 	} else if (addr == 0x8001) {
 		MapRom(PAGE_C000, val & 0x1F, SIZE_16K);
-		locC000 = 16384 * (val & 0x1F);
-		locE000 = locE000 + 0x2000;
+		mapreg.locC000 = 16384 * (val & 0x1F);
+		mapreg.locE000 = mapreg.locE000 + 0x2000;
 /*
 		if (val & 0x80) {
-			MapRom(PAGE_C000, locE000, SIZE_8K);
-			MapRom(PAGE_E000, locC000, SIZE_8K);
-			locswap = locC000;
-			locC000 = locE000;
-			locE000 = locswap;
+			MapRom(PAGE_C000, mapreg.locE000, SIZE_8K);
+			MapRom(PAGE_E000, mapreg.locC000, SIZE_8K);
+			locswap = mapreg.locC000;
+			mapreg.locC000 = mapreg.locE000;
+			mapreg.locE000 = locswap;
 		}
 */
 	} else if (addr == 0x8002) {
@@ -976,17 +1043,17 @@ m100in1(int addr, unsigned char val)
 		MapRom(PAGE_C000, (val & 0x3F) * 16384 + (val >> 7) * 8192, SIZE_8K);
 		MapRom(PAGE_E000, (val & 0x3F) * 16384 + (val >> 7) * 8192, SIZE_8K);
 	} else if (addr == 0x8003) {
-		hvmirror = (~val & 0x40) >> 6;
+		mirror_hv((~val & 0x40) >> 6);
 		MapRom(PAGE_C000, val & 0x1F, SIZE_16K);
-		locC000 = 16384 * (val & 0x1F);
-		locE000 = locE000 + 0x2000;
+		mapreg.locC000 = 16384 * (val & 0x1F);
+		mapreg.locE000 = mapreg.locE000 + 0x2000;
 /*
 		if (val & 0x80) {
-			MapRom(PAGE_C000, locE000, SIZE_8K);
-			MapRom(PAGE_E000, locC000, SIZE_8K);
-			locswap = locC000;
-			locC000 = locE000;
-			locE000 = locswap;
+			MapRom(PAGE_C000, mapreg.locE000, SIZE_8K);
+			MapRom(PAGE_E000, mapreg.locC000, SIZE_8K);
+			locswap = mapreg.locC000;
+			mapreg.locC000 = mapreg.locE000;
+			mapreg.locE000 = locswap;
 		}
 */
 	}
@@ -1008,7 +1075,29 @@ init_namcot106(void)
 
 	MapRom(PAGE_8000, 0, SIZE_16K);
 	MapRom(PAGE_C000, LAST_PAGE * 16384, SIZE_16K);
-	memcpy(VRAM, VROM_BASE + (VROM_PAGES - 1) * 8192, 8192);
+	chrcopy(0, VROM_BASE + (VROM_PAGES - 1) * 8192, 8192);
+}
+
+/*
+   The Namco 163's sound RAM is read and written through $4800, at the
+   address set through $F800, which counts up after each access if bit 7
+   is set.  The sound channels get a copy of every write.
+ */
+static unsigned char *
+n163_access(void)
+{
+	unsigned char *p = &mapreg.n163ram[mapreg.soundreg & 0x7F];
+
+	if (mapreg.soundreg & 0x80)
+		mapreg.soundreg = 0x80 | ((mapreg.soundreg + 1) & 0x7F);
+	return p;
+}
+
+unsigned char
+namcot106_read(int addr)
+{
+	(void)addr;
+	return *n163_access();
 }
 
 void
@@ -1020,6 +1109,13 @@ namcot106(int addr, unsigned char val)
 	}
 #endif
 	switch (addr & 0xF800) {
+	case 0x4800:
+		/* the channels are at $40-$7F, the rest is plain RAM */
+		if ((mapreg.soundreg & 0x7F) >= 0x40)
+			SoundExpansion(&namco163_sound);
+		SoundEvent(0x4800 + (mapreg.soundreg & 0x7F), val);
+		*n163_access() = val;
+		break;
 	case 0x5000:
 		printf("addr = %04X, val = %02X\n", addr, val);
 		break;
@@ -1027,44 +1123,44 @@ namcot106(int addr, unsigned char val)
 		printf("addr = %04X, val = %02X\n", addr, val);
 		break;
 	case 0x8000:
-		memcpy(VRAM + 0x0000, VROM_BASE + (val * 1024), 1024);
+		chrcopy(0x0000, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0x8800:
-		memcpy(VRAM + 0x0400, VROM_BASE + (val * 1024), 1024);
+		chrcopy(0x0400, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0x9000:
-		memcpy(VRAM + 0x0800, VROM_BASE + (val * 1024), 1024);
+		chrcopy(0x0800, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0x9800:
-		memcpy(VRAM + 0x0C00, VROM_BASE + (val * 1024), 1024);
+		chrcopy(0x0C00, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0xA000:
-		memcpy(VRAM + 0x1000, VROM_BASE + (val * 1024), 1024);
+		chrcopy(0x1000, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0xA800:
-		memcpy(VRAM + 0x1400, VROM_BASE + (val * 1024), 1024);
+		chrcopy(0x1400, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0xB000:
-		memcpy(VRAM + 0x1800, VROM_BASE + (val * 1024), 1024);
+		chrcopy(0x1800, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0xB800:
-		memcpy(VRAM + 0x1C00, VROM_BASE + (val * 1024), 1024);
+		chrcopy(0x1C00, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0xC000:
 		if (val < 0xE0)
-			memcpy(VRAM + 0x2000, VROM_BASE + (val * 1024), 1024);
+			chrcopy(0x2000, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0xC800:
 		if (val < 0xE0)
-			memcpy(VRAM + 0x2400, VROM_BASE + (val * 1024), 1024);
+			chrcopy(0x2400, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0xD000:
 		if (val < 0xE0)
-			memcpy(VRAM + 0x2800, VROM_BASE + (val * 1024), 1024);
+			chrcopy(0x2800, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0xD800:
 		if (val < 0xE0)
-			memcpy(VRAM + 0x2C00, VROM_BASE + (val * 1024), 1024);
+			chrcopy(0x2C00, VROM_BASE + (val * 1024), 1024);
 		break;
 	case 0xE000:
 		MapRom(PAGE_8000, (val & prgmask) * 8192, SIZE_8K);
@@ -1075,6 +1171,9 @@ namcot106(int addr, unsigned char val)
 	case 0xF000:
 		MapRom(PAGE_C000, (val & prgmask) * 8192, SIZE_8K);
 		break;
+	case 0xF800:
+		mapreg.soundreg = val;
+		break;
 	}
 }
 
@@ -1086,22 +1185,13 @@ init_vrc2_a(void)
 {
 	MapRom(PAGE_8000, 0, SIZE_16K);
 	MapRom(PAGE_C000, LAST_PAGE * 16384, SIZE_16K);
-/*	memcpy(VRAM, VROM_BASE, 8192); */
+/*	chrcopy(0, VROM_BASE, 8192); */
 	mapmirror = 0;
 }
 
 void
 vrc2_a(int addr, unsigned char val)
 {
-	static int reg0000;
-	static int reg0400;
-	static int reg0800;
-	static int reg0C00;
-	static int reg1000;
-	static int reg1400;
-	static int reg1800;
-	static int reg1C00;
-
 #ifdef DEBUG_MAPPER
 	if (verbose) {
 		printf("addr = %04X, val = %02X\n", addr, val);
@@ -1114,16 +1204,16 @@ vrc2_a(int addr, unsigned char val)
 	case 0x9000:
 		switch (val & 0x03) {
 		case 0:
-			hvmirror = 1;
+			mirror_hv(1);
 			break;
 		case 1:
-			hvmirror = 0;
+			mirror_hv(0);
 			break;
 		case 2:
-			mapmirror = 0;
+			ntmirror(MIRROR_ONESCREEN);
 			break;
 		case 3:
-			mapmirror = 1;
+			ntmirror(MIRROR_ONESCREEN_HI);
 			break;
 		}
 		break;
@@ -1132,90 +1222,90 @@ vrc2_a(int addr, unsigned char val)
 		break;
 
 	case 0xB000:
-		reg0000 = val & 0x0F;
+		mapreg.reg0000 = val & 0x0F;
 		break;
 	case 0xB002:
-		reg0000 |= val << 4;
-		memcpy(VRAM + 0x0000, VROM_BASE + (reg0000 >> 1) * 1024, 1024);
+		mapreg.reg0000 |= val << 4;
+		chrcopy(0x0000, VROM_BASE + (mapreg.reg0000 >> 1) * 1024, 1024);
 #ifdef DEBUG_MAPPER
-		printf("VROM page 0x%02X loaded at 0x0000\n", reg0000 >> 1);
+		printf("VROM page 0x%02X loaded at 0x0000\n", mapreg.reg0000 >> 1);
 #endif
 		break;
 
 	case 0xB001:
-		reg0400 = val & 0x0F;
+		mapreg.reg0400 = val & 0x0F;
 		break;
 	case 0xB003:
-		reg0400 |= val << 4;
-		memcpy(VRAM + 0x0400, VROM_BASE + (reg0400 >> 1) * 1024, 1024);
+		mapreg.reg0400 |= val << 4;
+		chrcopy(0x0400, VROM_BASE + (mapreg.reg0400 >> 1) * 1024, 1024);
 #ifdef DEBUG_MAPPER
-		printf("VROM page 0x%02X loaded at 0x0400\n", reg0400 >> 1);
+		printf("VROM page 0x%02X loaded at 0x0400\n", mapreg.reg0400 >> 1);
 #endif
 		break;
 
 	case 0xC000:
-		reg0800 = val & 0x0F;
+		mapreg.reg0800 = val & 0x0F;
 		break;
 	case 0xC002:
-		reg0800 |= val << 4;
-		memcpy(VRAM + 0x0800, VROM_BASE + (reg0800 >> 1) * 1024, 1024);
+		mapreg.reg0800 |= val << 4;
+		chrcopy(0x0800, VROM_BASE + (mapreg.reg0800 >> 1) * 1024, 1024);
 #ifdef DEBUG_MAPPER
-		printf("VROM page 0x%02X loaded at 0x0800\n", reg0800 >> 1);
+		printf("VROM page 0x%02X loaded at 0x0800\n", mapreg.reg0800 >> 1);
 #endif
 		break;
 
 	case 0xC001:
-		reg0C00 = val & 0x0F;
+		mapreg.reg0C00 = val & 0x0F;
 		break;
 	case 0xC003:
-		reg0C00 |= val << 4;
-		memcpy(VRAM + 0x0C00, VROM_BASE + (reg0C00 >> 1) * 1024, 1024);
+		mapreg.reg0C00 |= val << 4;
+		chrcopy(0x0C00, VROM_BASE + (mapreg.reg0C00 >> 1) * 1024, 1024);
 #ifdef DEBUG_MAPPER
-		printf("VROM page 0x%02X loaded at 0x0C00\n", reg0C00 >> 1);
+		printf("VROM page 0x%02X loaded at 0x0C00\n", mapreg.reg0C00 >> 1);
 #endif
 		break;
 
 	case 0xD000:
-		reg1000 = val & 0x0F;
+		mapreg.reg1000 = val & 0x0F;
 		break;
 	case 0xD002:
-		reg1000 |= val << 4;
-		memcpy(VRAM + 0x1000, VROM_BASE + (reg1000 >> 1) * 1024, 1024);
+		mapreg.reg1000 |= val << 4;
+		chrcopy(0x1000, VROM_BASE + (mapreg.reg1000 >> 1) * 1024, 1024);
 #ifdef DEBUG_MAPPER
-		printf("VROM page 0x%02X loaded at 0x1000\n", reg1000 >> 1);
+		printf("VROM page 0x%02X loaded at 0x1000\n", mapreg.reg1000 >> 1);
 #endif
 		break;
 
 	case 0xD001:
-		reg1400 = val & 0x0F;
+		mapreg.reg1400 = val & 0x0F;
 		break;
 	case 0xD003:
-		reg1400 |= val << 4;
-		memcpy(VRAM + 0x1400, VROM_BASE + (reg1400 >> 1) * 1024, 1024);
+		mapreg.reg1400 |= val << 4;
+		chrcopy(0x1400, VROM_BASE + (mapreg.reg1400 >> 1) * 1024, 1024);
 #ifdef DEBUG_MAPPER
-		printf("VROM page 0x%02X loaded at 0x1400\n", reg1400 >> 1);
+		printf("VROM page 0x%02X loaded at 0x1400\n", mapreg.reg1400 >> 1);
 #endif
 		break;
 
 	case 0xE000:
-		reg1800 = val & 0x0F;
+		mapreg.reg1800 = val & 0x0F;
 		break;
 	case 0xE002:
-		reg1800 |= val << 4;
-		memcpy(VRAM + 0x1800, VROM_BASE + (reg1800 >> 1) * 1024, 1024);
+		mapreg.reg1800 |= val << 4;
+		chrcopy(0x1800, VROM_BASE + (mapreg.reg1800 >> 1) * 1024, 1024);
 #ifdef DEBUG_MAPPER
-		printf("VROM page 0x%02X loaded at 0x1800\n", reg1800 >> 1);
+		printf("VROM page 0x%02X loaded at 0x1800\n", mapreg.reg1800 >> 1);
 #endif
 		break;
 
 	case 0xE001:
-		reg1C00 = val & 0x0F;
+		mapreg.reg1C00 = val & 0x0F;
 		break;
 	case 0xE003:
-		reg1C00 |= val << 4;
-		memcpy(VRAM + 0x1C00, VROM_BASE + (reg1C00 >> 1) * 1024, 1024);
+		mapreg.reg1C00 |= val << 4;
+		chrcopy(0x1C00, VROM_BASE + (mapreg.reg1C00 >> 1) * 1024, 1024);
 #ifdef DEBUG_MAPPER
-		printf("VROM page 0x%02X loaded at 0x1C00\n", reg1C00 >> 1);
+		printf("VROM page 0x%02X loaded at 0x1C00\n", mapreg.reg1C00 >> 1);
 #endif
 		break;
 	}
@@ -1235,15 +1325,6 @@ init_vrc2_b(void)
 void
 vrc2_b(int addr, unsigned char val)
 {
-	static int reg0000;
-	static int reg0400;
-	static int reg0800;
-	static int reg0C00;
-	static int reg1000;
-	static int reg1400;
-	static int reg1800;
-	static int reg1C00;
-
 	switch (addr) {
 	case 0x8000:
 		MapRom(PAGE_8000, (val & 0x0F) * 8192, SIZE_8K);
@@ -1251,16 +1332,16 @@ vrc2_b(int addr, unsigned char val)
 	case 0x9000:
 		switch (val & 0x03) {
 		case 0:
-			hvmirror = 1;
+			mirror_hv(1);
 			break;
 		case 1:
-			hvmirror = 0;
+			mirror_hv(0);
 			break;
 		case 2:
-			mapmirror = 0;
+			ntmirror(MIRROR_ONESCREEN);
 			break;
 		case 3:
-			mapmirror = 1;
+			ntmirror(MIRROR_ONESCREEN_HI);
 			break;
 		}
 		break;
@@ -1269,67 +1350,67 @@ vrc2_b(int addr, unsigned char val)
 		break;
 
 	case 0xB000:
-		reg0000 = val & 0x0F;
+		mapreg.reg0000 = val & 0x0F;
 		break;
 	case 0xB001:
-		reg0000 = val << 4;
-		memcpy(VRAM + 0x0000, VROM_BASE + (reg0000 >> 1) * 1024, 1024);
+		mapreg.reg0000 = val << 4;
+		chrcopy(0x0000, VROM_BASE + (mapreg.reg0000 >> 1) * 1024, 1024);
 		break;
 
 	case 0xB002:
-		reg0400 = val & 0x0F;
+		mapreg.reg0400 = val & 0x0F;
 		break;
 	case 0xB003:
-		reg0400 |= val << 4;
-		memcpy(VRAM + 0x0400, VROM_BASE + (reg0400 >> 1) * 1024, 1024);
+		mapreg.reg0400 |= val << 4;
+		chrcopy(0x0400, VROM_BASE + (mapreg.reg0400 >> 1) * 1024, 1024);
 		break;
 
 	case 0xC000:
-		reg0800 = val & 0x0F;
+		mapreg.reg0800 = val & 0x0F;
 		break;
 	case 0xC001:
-		reg0800 |= val << 4;
-		memcpy(VRAM + 0x0800, VROM_BASE + (reg0800 >> 1) * 1024, 1024);
+		mapreg.reg0800 |= val << 4;
+		chrcopy(0x0800, VROM_BASE + (mapreg.reg0800 >> 1) * 1024, 1024);
 		break;
 
 	case 0xC002:
-		reg0C00 = val & 0x0F;
+		mapreg.reg0C00 = val & 0x0F;
 		break;
 	case 0xC003:
-		reg0C00 |= val << 4;
-		memcpy(VRAM + 0x0C00, VROM_BASE + (reg0C00 >> 1) * 1024, 1024);
+		mapreg.reg0C00 |= val << 4;
+		chrcopy(0x0C00, VROM_BASE + (mapreg.reg0C00 >> 1) * 1024, 1024);
 		break;
 
 	case 0xD000:
-		reg1000 = val & 0x0F;
+		mapreg.reg1000 = val & 0x0F;
 		break;
 	case 0xD001:
-		reg1000 |= val << 4;
-		memcpy(VRAM + 0x1000, VROM_BASE + (reg1000 >> 1) * 1024, 1024);
+		mapreg.reg1000 |= val << 4;
+		chrcopy(0x1000, VROM_BASE + (mapreg.reg1000 >> 1) * 1024, 1024);
 		break;
 
 	case 0xD002:
-		reg1400 = val & 0x0F;
+		mapreg.reg1400 = val & 0x0F;
 		break;
 	case 0xD003:
-		reg1400 |= val << 4;
-		memcpy(VRAM + 0x1400, VROM_BASE + (reg1400 >> 1) * 1024, 1024);
+		mapreg.reg1400 |= val << 4;
+		chrcopy(0x1400, VROM_BASE + (mapreg.reg1400 >> 1) * 1024, 1024);
 		break;
 
 	case 0xE000:
-		reg1800 = val & 0x0F;
+		mapreg.reg1800 = val & 0x0F;
 		break;
 	case 0xE001:
-		reg1800 |= val << 4;
-		memcpy(VRAM + 0x1800, VROM_BASE + (reg1800 >> 1) * 1024, 1024);
+		mapreg.reg1800 |= val << 4;
+		chrcopy(0x1800, VROM_BASE + (mapreg.reg1800 >> 1) * 1024, 1024);
 		break;
 
 	case 0xE002:
-		reg1C00 = val & 0x0F;
+		mapreg.reg1C00 = val & 0x0F;
 		break;
 	case 0xE003:
-		reg1C00 |= val << 4;
-		memcpy(VRAM + 0x1C00, VROM_BASE + (reg1C00 >> 1) * 1024, 1024);
+		mapreg.reg1C00 |= val << 4;
+		chrcopy(0x1C00, VROM_BASE + (mapreg.reg1C00 >> 1) * 1024, 1024);
 		break;
 	}
 }
@@ -1348,46 +1429,44 @@ init_g101(void)
 void
 g101(int addr, unsigned char val)
 {
-	static int switchmode = 0;
-
 	switch (addr) {
 	case 0x8FFF:
-		if (switchmode) {
+		if (mapreg.switchmode) {
 			MapRom(PAGE_C000, val * 8192, SIZE_8K);
 		} else {
 			MapRom(PAGE_8000, val * 8192, SIZE_8K);
 		}
 		break;
 	case 0x9FFF:
-		switchmode = (val & 0x02) >> 1;
-		hvmirror = val * 0x01;
+		mapreg.switchmode = (val & 0x02) >> 1;
+		mirror_hv(val & 0x01);
 		break;
 	case 0xAFFF:
 		MapRom(PAGE_A000, val * 8192, SIZE_8K);
 		break;
 	case 0xBFF0:
-		memcpy(VRAM + 0x0000, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x0000, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xBFF1:
-		memcpy(VRAM + 0x0400, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x0400, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xBFF2:
-		memcpy(VRAM + 0x0800, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x0800, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xBFF3:
-		memcpy(VRAM + 0x0C00, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x0C00, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xBFF4:
-		memcpy(VRAM + 0x1000, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x1000, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xBFF5:
-		memcpy(VRAM + 0x1400, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x1400, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xBFF6:
-		memcpy(VRAM + 0x1800, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x1800, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xBFF7:
-		memcpy(VRAM + 0x1C00, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x1C00, VROM_BASE + val * 1024, 1024);
 		break;
 	}
 }
@@ -1427,22 +1506,22 @@ taito_tc0190(int addr, unsigned char val)
 		MapRom(PAGE_A000, (val & prgmask) * 8192, SIZE_8K);
 		break;
 	case 0x8002:
-		memcpy(VRAM + 0x0000, VROM_BASE + val * 2048, 2048);
+		chrcopy(0x0000, VROM_BASE + val * 2048, 2048);
 		break;
 	case 0x8003:
-		memcpy(VRAM + 0x0800, VROM_BASE + val * 2048, 2048);
+		chrcopy(0x0800, VROM_BASE + val * 2048, 2048);
 		break;
 	case 0xA000:
-		memcpy(VRAM + 0x1000, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x1000, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xA001:
-		memcpy(VRAM + 0x1400, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x1400, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xA002:
-		memcpy(VRAM + 0x1800, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x1800, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xA003:
-		memcpy(VRAM + 0x1C00, VROM_BASE + val * 1024, 1024);
+		chrcopy(0x1C00, VROM_BASE + val * 1024, 1024);
 		break;
 	case 0xC000:
 		/* unknown */
@@ -1468,7 +1547,7 @@ init_tengen_rambo1(void)
 	MapRom(PAGE_E000, (ROM_PAGES - 1) * 16384 + 8192, SIZE_8K);
 
 	if (VROM_PAGES) {
-		memcpy(VRAM, VROM_BASE, 8192);
+		chrcopy(0, VROM_BASE, 8192);
 	}
 
 	mapmirror = 0;
@@ -1483,49 +1562,49 @@ tengen_rambo1(int addr, unsigned char val)
 	}
 #endif
 	if (addr == 0x8000) {
-		commandregister = val;
+		mapreg.commandregister = val;
 	} else if (addr == 0x8001) {
-		switch (commandregister & 0x0F) {
+		switch (mapreg.commandregister & 0x0F) {
 		case 0:
-			memcpy(VRAM + (0x0000 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 2048);
+			chrcopy((0x0000 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 2048);
 			break;
 		case 1:
-			memcpy(VRAM + (0x0800 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 2048);
+			chrcopy((0x0800 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 2048);
 			break;
 		case 2:
-			memcpy(VRAM + (0x1000 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 1024);
+			chrcopy((0x1000 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 1024);
 			break;
 		case 3:
-			memcpy(VRAM + (0x1400 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 1024);
+			chrcopy((0x1400 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 1024);
 			break;
 		case 4:
-			memcpy(VRAM + (0x1800 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 1024);
+			chrcopy((0x1800 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 1024);
 			break;
 		case 5:
-			memcpy(VRAM + (0x1C00 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 1024);
+			chrcopy((0x1C00 ^ (val & 0x80 << 5)), VROM_BASE + val * 1024, 1024);
 			break;
 		case 6:
-			if (commandregister & 0x40) {
+			if (mapreg.commandregister & 0x40) {
 				MapRom(PAGE_A000, val * 8192, SIZE_8K);
 			} else {
 				MapRom(PAGE_8000, val * 8192, SIZE_8K);
 			}
 			break;
 		case 7:
-			if (commandregister & 0x40) {
+			if (mapreg.commandregister & 0x40) {
 				MapRom(PAGE_C000, val * 8192, SIZE_8K);
 			} else {
 				MapRom(PAGE_A000, val * 8192, SIZE_8K);
 			}
 			break;
 		case 8:
-			memcpy(VRAM + 0x0400, VROM_BASE + val * 1024, 1024);
+			chrcopy(0x0400, VROM_BASE + val * 1024, 1024);
 			break;
 		case 9:
-			memcpy(VRAM + 0x0C00, VROM_BASE + val * 1024, 1024);
+			chrcopy(0x0C00, VROM_BASE + val * 1024, 1024);
 			break;
 		case 15:
-			if (commandregister & 0x40) {
+			if (mapreg.commandregister & 0x40) {
 				MapRom(PAGE_8000, val * 8192, SIZE_8K);
 			} else {
 				MapRom(PAGE_C000, val * 8192, SIZE_8K);
@@ -1535,7 +1614,7 @@ tengen_rambo1(int addr, unsigned char val)
 			break;
 		}
 	} else if (addr == 0xA000) {
-		hvmirror = val & 0x01;
+		mirror_hv(val & 0x01);
 	}
 }
 
@@ -1546,7 +1625,7 @@ static void
 init_gnrom(void)
 {
 	MapRom(PAGE_8000, 0, SIZE_32K);
-	memcpy(VRAM, VROM_BASE, 8192);
+	chrcopy(0, VROM_BASE, 8192);
 	mapmirror = 0;
 }
 
@@ -1555,7 +1634,7 @@ gnrom(int addr, unsigned char val)
 {
 	if (addr > 0x8000) {
 		MapRom(PAGE_8000, (val >> 4 & 0x03) * 32768, SIZE_32K);
-		memcpy(VRAM, VROM_BASE + (val & 0x03) * 8192, 8192);
+		chrcopy(0, VROM_BASE + (val & 0x03) * 8192, 8192);
 	}
 }
 
@@ -1581,34 +1660,30 @@ sunsoft4(int addr, unsigned char val)
 
 	switch (addr) {
 	case 0x8000:
-		memcpy(VRAM + 0x0000, VROM_BASE + (val * 2048), 8192);
+		chrcopy(0x0000, VROM_BASE + (val * 2048), 8192);
 		break;
 	case 0x9000:
-		memcpy(VRAM + 0x0800, VROM_BASE + (val * 2048), 8192);
+		chrcopy(0x0800, VROM_BASE + (val * 2048), 8192);
 		break;
 	case 0xA000:
-		memcpy(VRAM + 0x1000, VROM_BASE + (val * 2048), 8192);
+		chrcopy(0x1000, VROM_BASE + (val * 2048), 8192);
 		break;
 	case 0xB000:
-		memcpy(VRAM + 0x1800, VROM_BASE + (val * 2048), 8192);
+		chrcopy(0x1800, VROM_BASE + (val * 2048), 8192);
 		break;
 	case 0xE000:
 		switch (val & 0x03) {
 		case 0:
-			osmirror = 0;
-			hvmirror = 0;
+			mirror_hv(0);
 			break;
 		case 1:
-			osmirror = 0;
-			hvmirror = 1;
+			mirror_hv(1);
 			break;
 		case 2:
-			osmirror = 1;
-			/* osmirrorpage = 0x2000; */
+			ntmirror(MIRROR_ONESCREEN);
 			break;
 		case 3:
-			osmirror = 1;
-			/* osmirrorpage = 0x2400; */
+			ntmirror(MIRROR_ONESCREEN_HI);
 			break;
 		}
 		break;
@@ -1638,32 +1713,32 @@ void
 fme7(int addr, unsigned char val)
 {
 	if (addr == 0x8000) {
-		commandregister = val;
+		mapreg.commandregister = val;
 	} else if (addr == 0xA000) {
-		switch (commandregister) {
+		switch (mapreg.commandregister) {
 		case 0:
-			memcpy(VRAM + 0x0000, VROM_BASE + val * 1024, 1024);
+			chrcopy(0x0000, VROM_BASE + val * 1024, 1024);
 			break;
 		case 1:
-			memcpy(VRAM + 0x0400, VROM_BASE + val * 1024, 1024);
+			chrcopy(0x0400, VROM_BASE + val * 1024, 1024);
 			break;
 		case 2:
-			memcpy(VRAM + 0x0800, VROM_BASE + val * 1024, 1024);
+			chrcopy(0x0800, VROM_BASE + val * 1024, 1024);
 			break;
 		case 3:
-			memcpy(VRAM + 0x0C00, VROM_BASE + val * 1024, 1024);
+			chrcopy(0x0C00, VROM_BASE + val * 1024, 1024);
 			break;
 		case 4:
-			memcpy(VRAM + 0x1000, VROM_BASE + val * 1024, 1024);
+			chrcopy(0x1000, VROM_BASE + val * 1024, 1024);
 			break;
 		case 5:
-			memcpy(VRAM + 0x1400, VROM_BASE + val * 1024, 1024);
+			chrcopy(0x1400, VROM_BASE + val * 1024, 1024);
 			break;
 		case 6:
-			memcpy(VRAM + 0x1800, VROM_BASE + val * 1024, 1024);
+			chrcopy(0x1800, VROM_BASE + val * 1024, 1024);
 			break;
 		case 7:
-			memcpy(VRAM + 0x1C00, VROM_BASE + val * 1024, 1024);
+			chrcopy(0x1C00, VROM_BASE + val * 1024, 1024);
 			break;
 		case 8:
 			break;
@@ -1685,6 +1760,13 @@ fme7(int addr, unsigned char val)
 		case 15:
 			break;
 		}
+	} else if ((addr & 0xE000) == 0xC000) {
+		/* Sunsoft 5B sound */
+		SoundExpansion(&sunsoft5b_sound);
+		mapreg.soundreg = val & 0x0F;
+	} else if ((addr & 0xE000) == 0xE000) {
+		SoundExpansion(&sunsoft5b_sound);
+		SoundEvent(0xE000 + mapreg.soundreg, val);
 	}
 }
 
@@ -1727,7 +1809,7 @@ init_irem_74hc161_32(void)
 
 	MapRom(PAGE_8000, 0, SIZE_16K);
 	MapRom(PAGE_C000, LAST_PAGE * 16384, SIZE_16K);
-	memcpy(VRAM, VROM_BASE, 8192);
+	chrcopy(0, VROM_BASE, 8192);
 	mapmirror = 0;
 }
 
@@ -1742,7 +1824,7 @@ irem_74hc161_32(int addr, unsigned char val)
 
 	if (addr & 0x8000) {
 		MapRom(PAGE_8000, (val & prgmask) * 16384, SIZE_16K);
-		memcpy(VRAM, VROM_BASE + (val >> 4) * 8192, 8192);
+		chrcopy(0, VROM_BASE + (val >> 4) * 8192, 8192);
 	}
 }
 
@@ -1750,13 +1832,11 @@ irem_74hc161_32(int addr, unsigned char val)
 
 /* VS UniSystem */
 
-static int vsreg = 0;
-
 static void
 init_vs(void)
 {
 	MapRom(PAGE_8000, 0, SIZE_32K);
-	memcpy(VRAM, VROM_BASE, 8192);
+	chrcopy(0, VROM_BASE, 8192);
 	nomirror = 1;
 	mapmirror = 1;
 }
@@ -1765,12 +1845,12 @@ void
 vs(int addr, unsigned char val)
 {
 	if (addr == 0x4016) {
-		if (vsreg != (val & 0x04)) {
-			if (vsreg)
-				memcpy(VRAM, VROM_BASE, 8192);
+		if (mapreg.vsreg != (val & 0x04)) {
+			if (mapreg.vsreg)
+				chrcopy(0, VROM_BASE, 8192);
 			else
-				memcpy(VRAM, VROM_BASE + 8192, 8192);
-			vsreg = val & 0x04;
+				chrcopy(0, VROM_BASE + 8192, 8192);
+			mapreg.vsreg = val & 0x04;
 		}
 	}
 }
@@ -1783,7 +1863,7 @@ init_supervision(void)
 {
 	/* on power-up, mapper acts as if $8000 has been written */
 	MapRom(PAGE_8000, 0, SIZE_32K);
-	memcpy(VRAM, VROM_BASE, 8192);
+	chrcopy(0, VROM_BASE, 8192);
 	mapmirror = 0;
 }
 
@@ -1798,7 +1878,7 @@ supervision(int addr, unsigned char val)
 
 	if (addr & 0x8000) {
 		/* take care of the mirroring */
-		hvmirror = (addr & 0x2000) > 13;
+		mirror_hv((addr & 0x2000) > 13);
 
 		/* take care of the PRG switching */
 		if (addr & 0x1000) {
@@ -1811,7 +1891,7 @@ supervision(int addr, unsigned char val)
 		}
 
 		/* take care of the CHR switching */
-		memcpy(VRAM, VROM_BASE + (addr & 0x003F) * 8192, 8192);
+		chrcopy(0, VROM_BASE + (addr & 0x003F) * 8192, 8192);
 	}
 }
 
@@ -1837,7 +1917,7 @@ nina7(int addr, unsigned char val)
 	if (addr & 0x8000) {
 		MapRom(PAGE_8000, ((val & 0x03) | ((val & 0x80) >> 5)) * 32768, SIZE_32K);
 		if (VROM_PAGES) {
-			memcpy(VRAM, VROM_BASE + ((val & 0x70) >> 4) * 8192, 8192);
+			chrcopy(0, VROM_BASE + ((val & 0x70) >> 4) * 8192, 8192);
 		}
 	}
 }
@@ -0,0 +1,182 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Input movies. While recording, the controller bytes
+ * latched by every write to the $4016 strobe are saved along with the
+ * number of the frame they were latched in; on playback the recorded
+ * bytes are latched instead of the live keyboard and joystick state, so
+ * the game runs exactly as it did when the movie was made.
+ *
+ * The file starts with a 16-byte header: the magic "TuxNESmv", then
+ * 32-bit little-endian hashes of the ROM image and of the battery RAM
+ * the game started with. It is followed by one 8-byte record per strobe:
+ * the frame number (32 bits, little-endian), the two controller bytes,
+ * and the VS UniSystem coin slot and dipswitch settings.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "controller.h"
+#include "globals.h"
+#include "movie.h"
+
+#define MOVIE_MAGIC     "TuxNESmv"
+
+const char *movie_record_file = NULL;
+const char *movie_play_file = NULL;
+
+static FILE *movie;
+static int recording, playing;
+static uint32_t frame = 0;
+static unsigned char next[8];   /* next record to play */
+static int desynced = 0;
+
+extern unsigned int     ROM_PAGES;
+extern unsigned int     VROM_PAGES;
+
+/* FNV-1a */
+static uint32_t
+hash(const unsigned char *p, size_t len)
+{
+	uint32_t h = 2166136261U;
+
+	while (len--)
+		h = (h ^ *p++) * 16777619U;
+	return h;
+}
+
+/* Hash of the ROM image, to tell games apart */
+uint32_t
+rom_hash(void)
+{
+	return hash(ROM_BASE, ROM_PAGES * 16384 + VROM_PAGES * 8192);
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+movie_close(void)
+{
+	if (movie && fclose(movie))
+		perror(recording ? movie_record_file : movie_play_file);
+	movie = NULL;
+	recording = playing = 0;
+}
+
+/* Read the next record; stop playing at the end of the movie */
+static void
+movie_next(void)
+{
+	if (fread(next, sizeof next, 1, movie) != 1) {
+		if (ferror(movie))
+			perror(movie_play_file);
+		else if (verbose)
+			fprintf(stderr, "Movie %s ended at frame %lu\n",
+			        movie_play_file, (unsigned long)frame);
+		movie_close();
+	}
+}
+
+/* Open the movie given on the command line; called once the game is loaded */
+void
+movie_start(void)
+{
+	unsigned char header[16];
+	uint32_t romhash = rom_hash();
+	uint32_t ramhash = hash(NVRAM, 8192);
+
+	if (movie_play_file) {
+		if (!(movie = fopen(movie_play_file, "rb"))) {
+			perror(movie_play_file);
+			exit(EXIT_FAILURE);
+		}
+		if (fread(header, sizeof header, 1, movie) != 1
+		 || memcmp(header, MOVIE_MAGIC, 8)) {
+			fprintf(stderr, "%s: not a " PACKAGE_NAME " movie\n",
+			        movie_play_file);
+			exit(EXIT_FAILURE);
+		}
+		if (get32(header + 8) != romhash)
+			fprintf(stderr, "%s: warning: movie was made with a different ROM\n",
+			        movie_play_file);
+		if (get32(header + 12) != ramhash)
+			fprintf(stderr, "%s: warning: movie was made with different battery RAM contents\n",
+			        movie_play_file);
+		playing = 1;
+		atexit(movie_close);
+		movie_next();
+	} else if (movie_record_file) {
+		if (!(movie = fopen(movie_record_file, "wb"))) {
+			perror(movie_record_file);
+			exit(EXIT_FAILURE);
+		}
+		memcpy(header, MOVIE_MAGIC, 8);
+		put32(header + 8, romhash);
+		put32(header + 12, ramhash);
+		fwrite(header, sizeof header, 1, movie);
+		recording = 1;
+		atexit(movie_close);
+	}
+}
+
+/* Called at every vertical blank */
+void
+movie_frame(void)
+{
+	frame++;
+}
+
+/*
+ * Called at the $4016 strobe with the live controller bytes; records
+ * them, or replaces them with the recorded ones
+ */
+void
+movie_latch(unsigned int *pad)
+{
+	if (recording) {
+		unsigned char rec[8];
+
+		put32(rec, frame);
+		rec[4] = pad[0];
+		rec[5] = pad[1];
+		rec[6] = coinslot;
+		rec[7] = dipswitches;
+		if (fwrite(rec, sizeof rec, 1, movie) != 1) {
+			perror(movie_record_file);
+			movie_close();
+		}
+	} else if (playing) {
+		if (get32(next) != frame && !desynced) {
+			fprintf(stderr, "%s: warning: movie out of sync at frame %lu (recorded at %lu)\n",
+			        movie_play_file, (unsigned long)frame,
+			        (unsigned long)get32(next));
+			desynced = 1;
+		}
+		pad[0] = next[4];
+		pad[1] = next[5];
+		coinslot = next[6];
+		dipswitches = next[7];
+		movie_next();
+	}
+}
@@ -0,0 +1,17 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+
+extern const char *movie_record_file;
+extern const char *movie_play_file;
+
+void movie_start(void);
+void movie_frame(void);
+void movie_latch(unsigned int *);
+uint32_t rom_hash(void);
+
+#endif
@@ -59,32 +59,18 @@
 void
 DRAW_IMAGE(int endclock)
 {
-	static unsigned int lastclock = 0;
-	static unsigned int curhscroll = 0;
-	static unsigned int scanpage = 0;
 	unsigned int curclock = lastclock;
-	unsigned int baseaddr = ((RAM[0x2000] & 0x10) << 8);  /* 0 or 0x1000 */
+	unsigned int baseaddr = ((ppu.ctrl & 0x10) << 8);  /* 0 or 0x1000 */
 	unsigned int currentline = lastclock / HCYCLES;
 	unsigned int hposition = lastclock % HCYCLES;
 	unsigned int x;
-	int spritebase = (RAM[0x2000] & 0x08) << 9;   /* 0x0 or 0x1000 */
-	int spritesize = 8 << ((RAM[0x2000] & 0x20) >> 5);    /* 8 or 16 */
+	int spritebase = (ppu.ctrl & 0x08) << 9;   /* 0x0 or 0x1000 */
+	int spritesize = 8 << ((ppu.ctrl & 0x20) >> 5);    /* 8 or 16 */
 	unsigned char bgmask[256];
-	static int bit;
-	static unsigned char byte1, byte2;
-#if (BPP==24)
-	static unsigned int curpal[4];
-#else
-	static pixel_t curpal[4];
-#endif
-	static unsigned char tilecolor;
-	static pixel_t *rptr, *rptr0;
-	static pixel_t *ptr, *ptr0;
-#if (BPP==1) || (BPP==4)
-	static pixel_t pix_mask;
-#endif
+	pixel_t *rptr = (pixel_t *)drawrptr, *rptr0 = (pixel_t *)drawrptr0;
+	pixel_t *ptr = (pixel_t *)drawptr, *ptr0 = (pixel_t *)drawptr0;
 
-	if (frameskip) {
+	if (ppu.frameskip) {
 		return;
 	}
 
@@ -101,18 +87,12 @@ DRAW_IMAGE(int endclock)
 		return;
 	if (curclock == 0) {
 		/* Begin new frame */
-		vline = vscrollreg >> 3;
-		vscan = vscrollreg & 7;
-		vwrap = 0;
-		if (osmirror)
-			scanpage = 0x2000;
-		else if (nomirror)
-			scanpage = 0x2000 + ((RAM[0x2000] & 3) << 10);
-		else if (hvmirror == 0)
-			scanpage = 0x2000 + ((RAM[0x2000] & 1) << 10);  /* v-mirror, h-layout */
-		else if (hvmirror == 1)
-			scanpage = 0x2000 + ((RAM[0x2000] & 2) << 9);   /* h-mirror, v-layout */
-		curpal[0] = endian_fix(palette[24]);
+		ppu.vline = ppu.vscroll >> 3;
+		ppu.vscan = ppu.vscroll & 7;
+		ppu.vwrap = 0;
+		scannt = ppu.ctrl & 3;
+		scanpage = ppu.ntpage[scannt];
+		curpal[0] = endian_fix(ppu.palette[24]);
 		rptr0 = rptr = (pixel_t *)rfb;
 		ptr0 = ptr = (pixel_t *)fb;
 #if (BPP==1)
@@ -148,27 +128,27 @@ DRAW_IMAGE(int endclock)
 		x = hposition - 85 + curhscroll;
 	} else {
 		/* In hblank */
-		curhscroll = hscrollreg;
+		curhscroll = ppu.hscroll;
 		x = curhscroll;
-		unsigned int tile = VRAM[scanpage + ((x & 255) >> 3) + (vline << 5)];
-		mmc2_4_latch(baseaddr + (tile << 4) + vscan);
-		mmc2_4_latch(baseaddr + (tile << 4) + vscan + 8);
-		byte1 = VRAM[baseaddr + (tile << 4) + vscan] << (x & 7);
-		byte2 = VRAM[baseaddr + (tile << 4) + vscan + 8] << (x & 7);
+		unsigned int tile = ppu.vram[scanpage + ((x & 255) >> 3) + (ppu.vline << 5)];
+		mmc2_4_latch(baseaddr + (tile << 4) + ppu.vscan);
+		mmc2_4_latch(baseaddr + (tile << 4) + ppu.vscan + 8);
+		byte1 = ppu.vram[baseaddr + (tile << 4) + ppu.vscan] << (x & 7);
+		byte2 = ppu.vram[baseaddr + (tile << 4) + ppu.vscan + 8] << (x & 7);
 		bit = (~x) & 7;
 		curclock += 85 - hposition;
 		hposition = 85;
-		tilecolor = VRAM[scanpage + 0x3C0 + ((x & 255) >> 5) + ((vline & 28) << 1)] >> ((vline & 2) << 1);
+		tilecolor = ppu.vram[scanpage + 0x3C0 + ((x & 255) >> 5) + ((ppu.vline & 28) << 1)] >> ((ppu.vline & 2) << 1);
 		if (x & 16)
 			tilecolor >>= 2;
-		curpal[1] = endian_fix(palette[3 * (tilecolor & 3)]);
-		curpal[2] = endian_fix(palette[3 * (tilecolor & 3) + 1]);
-		curpal[3] = endian_fix(palette[3 * (tilecolor & 3) + 2]);
+		curpal[1] = endian_fix(ppu.palette[3 * (tilecolor & 3)]);
+		curpal[2] = endian_fix(ppu.palette[3 * (tilecolor & 3) + 1]);
+		curpal[3] = endian_fix(ppu.palette[3 * (tilecolor & 3) + 2]);
 	}
 
 	while (curclock < endclock) {
 		while (hposition < HCYCLES && curclock < endclock) {
-			if (RAM[0x2001] & 8) {
+			if (ppu.mask & 8) {
 				bit--;
 #if (BPP==1)
 				*ptr = (*rptr & ~pix_mask)
@@ -242,90 +222,89 @@ DRAW_IMAGE(int endclock)
 			hposition++;
 			curclock++;
 			if (x == 256)
-				if ((!osmirror) && (nomirror || !hvmirror))
-					scanpage ^= 0x400;        /* bit 8 of x -> bit 10 of addr */
+				scanpage = ppu.ntpage[scannt ^= 1];   /* bit 8 of x -> bit 0 of nametable */
 			if (bit < 0) {
-				unsigned int tile = VRAM[scanpage + ((x & 255) >> 3) + (vline << 5)];
-				mmc2_4_latch(baseaddr + (tile << 4) + vscan);
-				mmc2_4_latch(baseaddr + (tile << 4) + vscan + 8);
-				byte1 = VRAM[baseaddr + (tile << 4) + vscan];
-				byte2 = VRAM[baseaddr + (tile << 4) + vscan + 8];
+				unsigned int tile = ppu.vram[scanpage + ((x & 255) >> 3) + (ppu.vline << 5)];
+				mmc2_4_latch(baseaddr + (tile << 4) + ppu.vscan);
+				mmc2_4_latch(baseaddr + (tile << 4) + ppu.vscan + 8);
+				byte1 = ppu.vram[baseaddr + (tile << 4) + ppu.vscan];
+				byte2 = ppu.vram[baseaddr + (tile << 4) + ppu.vscan + 8];
 				bit = 7;
 				if ((x & 0xf) == 0) {
 					if ((x & 0x1f) == 0)
-						tilecolor = VRAM[scanpage + 0x3C0 + ((x & 255) >> 5) + ((vline & 28) << 1)] >> ((vline & 2) << 1);
+						tilecolor = ppu.vram[scanpage + 0x3C0 + ((x & 255) >> 5) + ((ppu.vline & 28) << 1)] >> ((ppu.vline & 2) << 1);
 					else
 						tilecolor >>= 2;
-					curpal[1] = endian_fix(palette[3 * (tilecolor & 3)]);
-					curpal[2] = endian_fix(palette[3 * (tilecolor & 3) + 1]);
-					curpal[3] = endian_fix(palette[3 * (tilecolor & 3) + 2]);
+					curpal[1] = endian_fix(ppu.palette[3 * (tilecolor & 3)]);
+					curpal[2] = endian_fix(ppu.palette[3 * (tilecolor & 3) + 1]);
+					curpal[3] = endian_fix(ppu.palette[3 * (tilecolor & 3) + 2]);
 				}
 			}
 		}
 
 		if (hposition == HCYCLES) {
-			if (RAM[0x2001] & 16) {
+			if (ppu.mask & 16) {
 				/* Draw sprites */
 				unsigned char linebuffer[256];
 				memset(linebuffer, 0, 256);      /* Clear buffer for this scanline */
 				int s;
 				for (s = 0; s < 64; s++) {
-					if (spriteram[s * 4] < currentline
-					 && spriteram[s * 4] < 240
-					 && spriteram[s * 4 + 3] < 249
-					 && (spriteram[s * 4] + spritesize >= currentline)) {
-						int spritetile = spriteram[s * 4 + 1];
+					if (ppu.oam[s * 4] < currentline
+					 && ppu.oam[s * 4] < 240
+					 && ppu.oam[s * 4 + 3] < 249
+					 && (ppu.oam[s * 4] + spritesize >= currentline)) {
+						int spritetile = ppu.oam[s * 4 + 1];
 						if ((spritetile == 0xfd) || (spritetile == 0xfe)) {
 							mmc2_4_latchspr(spritetile);
 						}
 					}
 				}
 				for (s = 63; s >= 0; s--) {
-					if (spriteram[s * 4] < currentline
-					 && spriteram[s * 4] < 240
-					 && spriteram[s * 4 + 3] < 249) {
-						if (spriteram[s * 4] + spritesize >= currentline) {
-							int spritetile = spriteram[s * 4 + 1];
+					if (ppu.oam[s * 4] < currentline
+					 && ppu.oam[s * 4] < 240
+					 && ppu.oam[s * 4 + 3] < 249) {
+						if (ppu.oam[s * 4] + spritesize >= currentline) {
+							int spritetile = ppu.oam[s * 4 + 1];
 							if (spritesize == 16)
 								spritebase = (spritetile & 1) << 12;
-							int behind = spriteram[s * 4 + 2] & 0x20;
-							int hflip = spriteram[s * 4 + 2] & 0x40;
-							int vflip = spriteram[s * 4 + 2] & 0x80;
+							int behind = ppu.oam[s * 4 + 2] & 0x20;
+							int hflip = ppu.oam[s * 4 + 2] & 0x40;
+							int vflip = ppu.oam[s * 4 + 2] & 0x80;
 
 							/* This finds the memory location of the tiles, taking into account
 							   that vertically flipped sprites are in reverse order. */
 							int d1, d2;
 							if (vflip) {
-								if (spriteram[s << 2] >= ((signed int)currentline) - 8) {
+								if (ppu.oam[s << 2] >= ((signed int)currentline) - 8) {
 									/* 8x8 sprites and first half of 8x16 sprites */
-									d1 = VRAM[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + spritesize * 2 - 8 - currentline + spriteram[s * 4]];
-									d2 = VRAM[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + spritesize * 2 - currentline + spriteram[s * 4]];
+									d1 = ppu.vram[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + spritesize * 2 - 8 - currentline + ppu.oam[s * 4]];
+									d2 = ppu.vram[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + spritesize * 2 - currentline + ppu.oam[s * 4]];
 								} else {
 									/* Do second half of 8x16 sprites */
-									d1 = VRAM[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + spritesize * 2 - 16 - currentline + spriteram[s * 4]];
-									d2 = VRAM[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + spritesize * 2 - 8 - currentline + spriteram[s * 4]];
+									d1 = ppu.vram[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + spritesize * 2 - 16 - currentline + ppu.oam[s * 4]];
+									d2 = ppu.vram[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + spritesize * 2 - 8 - currentline + ppu.oam[s * 4]];
 								}
 							} else {
-								if (spriteram[s << 2] >= ((signed int)currentline) - 8) {
+								if (ppu.oam[s << 2] >= ((signed int)currentline) - 8) {
 									/* 8x8 sprites and first half of 8x16 sprites */
-									d1 = VRAM[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + currentline - 1 - spriteram[s * 4]];
-									d2 = VRAM[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + currentline + 7 - spriteram[s * 4]];
+									d1 = ppu.vram[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + currentline - 1 - ppu.oam[s * 4]];
+									d2 = ppu.vram[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + currentline + 7 - ppu.oam[s * 4]];
 								} else {
 									/* Do second half of 8x16 sprites */
-									d1 = VRAM[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + currentline + 7 - spriteram[s * 4]];
-									d2 = VRAM[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + currentline + 15 - spriteram[s * 4]];
+									d1 = ppu.vram[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + currentline + 7 - ppu.oam[s * 4]];
+									d2 = ppu.vram[spritebase + ((spritetile & (~(spritesize >> 4))) << 4) + currentline + 15 - ppu.oam[s * 4]];
 								}
 							}
 							for (x = 7 * (!hflip); x < 8 && x >= 0; x += 1 - ((!hflip) << 1)) {
 								if (d1 & d2 & 1)
-									linebuffer[spriteram[s * 4 + 3] + x] = 12 + 2 + ((spriteram[s * 4 + 2] & 3) * 3);
+									linebuffer[ppu.oam[s * 4 + 3] + x] = 12 + 2 + ((ppu.oam[s * 4 + 2] & 3) * 3);
 								else if (d1 & 1)
-									linebuffer[spriteram[s * 4 + 3] + x] = 12 + ((spriteram[s * 4 + 2] & 3) * 3);
+									linebuffer[ppu.oam[s * 4 + 3] + x] = 12 + ((ppu.oam[s * 4 + 2] & 3) * 3);
 								else if (d2 & 1)
-									linebuffer[spriteram[s * 4 + 3] + x] = 12 + 1 + ((spriteram[s * 4 + 2] & 3) * 3);
+									linebuffer[ppu.oam[s * 4 + 3] + x] = 12 + 1 + ((ppu.oam[s * 4 + 2] & 3) * 3);
 								if (behind && (d1 | d2))
-									if (bgmask[spriteram[s * 4 + 3] + x])
-										linebuffer[spriteram[s * 4 + 3] + x] = 0;     /* Sprite hidden behind background */
+									if (bgmask[ppu.oam[s * 4 + 3] + x])
+										linebuffer[ppu.oam[s * 4 + 3] + x] = 0;     /* Sprite hidden behind background */
 								d1 >>= 1;
 								d2 >>= 1;
 							}
@@ -336,7 +315,7 @@ DRAW_IMAGE(int endclock)
 				for (x = 0; x < 256; x++) {
 					if (linebuffer[x]) {
 #if (BPP==1)
-						unsigned int offset = spriteram[s * 4 + 3] + x;
+						unsigned int offset = ppu.oam[s * 4 + 3] + x;
 						unsigned char mask;
 
 						if (lsb_first)
@@ -345,9 +324,9 @@ DRAW_IMAGE(int endclock)
 							mask = 0x80 >> (offset & 7);
 						offset = (offset >> 3);
 						ptr0[offset] = (rptr0[offset] & ~mask)
-						             | endian_fix(palette[linebuffer[x]] ? mask : 0);
+						             | endian_fix(ppu.palette[linebuffer[x]] ? mask : 0);
 #elif (BPP==4)
-						unsigned int offset = spriteram[s * 4 + 3] + x;
+						unsigned int offset = ppu.oam[s * 4 + 3] + x;
 						unsigned char mask;
 
 						if (lsb_first)
@@ -356,13 +335,13 @@ DRAW_IMAGE(int endclock)
 							mask = 0xf0 >> ((offset & 1) << 2);
 						offset = (offset >> 1);
 						ptr0[offset] = (rptr0[offset] & ~mask)
-						             | endian_fix(palette[linebuffer[x]] & mask);
+						             | endian_fix(ppu.palette[linebuffer[x]] & mask);
 #elif (BPP==24)
 						for (int pix_byte = 0; pix_byte < 3; pix_byte++) {
-							ptr0[(spriteram[s * 4 + 3] + x) * 3 + pix_byte] = endian_fix(palette[linebuffer[x]]) >> (8 * pix_byte);
+							ptr0[(ppu.oam[s * 4 + 3] + x) * 3 + pix_byte] = endian_fix(ppu.palette[linebuffer[x]]) >> (8 * pix_byte);
 						}
 #else /* (BPP != 1) && (BPP != 24) */
-						ptr0[spriteram[s * 4 + 3] + x] = endian_fix(palette[linebuffer[x]]);
+						ptr0[ppu.oam[s * 4 + 3] + x] = endian_fix(ppu.palette[linebuffer[x]]);
 #endif
 					}
 				}
@@ -374,43 +353,41 @@ DRAW_IMAGE(int endclock)
 			rptr0 = rptr;
 			ptr0 = ptr;
 			currentline++;
-			curhscroll = hscrollreg;
+			curhscroll = ppu.hscroll;
 			x = curhscroll;
-			vscan++;
-			if (vscan >= 8) {
-				vscan = 0;
-				vline++;
-				vline &= 31;
-				if (vline == 30) {
-					vline = 0;
-					vwrap ^= 1;
+			ppu.vscan++;
+			if (ppu.vscan >= 8) {
+				ppu.vscan = 0;
+				ppu.vline++;
+				ppu.vline &= 31;
+				if (ppu.vline == 30) {
+					ppu.vline = 0;
+					ppu.vwrap ^= 1;
 				}
 			}
-			if (osmirror)
-				scanpage = 0x2000;
-			else if (nomirror)
-				scanpage = 0x2000 + (((RAM[0x2000] & 3) << 10) ^ (vwrap << 11));
-			else if (hvmirror == 0)
-				scanpage = 0x2000 + ((RAM[0x2000] & 1) << 10);      /* v-mirror, h-layout */
-			else if (hvmirror == 1)
-				scanpage = 0x2000 + (((RAM[0x2000] & 2) << 9) ^ (vwrap << 10));     /* h-mirror, v-layout */
-			unsigned int tile = VRAM[scanpage + ((x & 255) >> 3) + (vline << 5)];
-			mmc2_4_latch(baseaddr + (tile << 4) + vscan);
-			mmc2_4_latch(baseaddr + (tile << 4) + vscan + 8);
-			byte1 = VRAM[baseaddr + (tile << 4) + vscan] << (x & 7);
-			byte2 = VRAM[baseaddr + (tile << 4) + vscan + 8] << (x & 7);
+			scannt = (ppu.ctrl & 3) ^ (ppu.vwrap << 1);
+			scanpage = ppu.ntpage[scannt];
+			unsigned int tile = ppu.vram[scanpage + ((x & 255) >> 3) + (ppu.vline << 5)];
+			mmc2_4_latch(baseaddr + (tile << 4) + ppu.vscan);
+			mmc2_4_latch(baseaddr + (tile << 4) + ppu.vscan + 8);
+			byte1 = ppu.vram[baseaddr + (tile << 4) + ppu.vscan] << (x & 7);
+			byte2 = ppu.vram[baseaddr + (tile << 4) + ppu.vscan + 8] << (x & 7);
 			bit = (~x) & 7;
-			tilecolor = VRAM[scanpage + 0x3C0 + ((x & 255) >> 5) + ((vline & 28) << 1)] >> ((vline & 2) << 1);
+			tilecolor = ppu.vram[scanpage + 0x3C0 + ((x & 255) >> 5) + ((ppu.vline & 28) << 1)] >> ((ppu.vline & 2) << 1);
 			if (x & 16)
 				tilecolor >>= 2;
-			curpal[1] = endian_fix(palette[3 * (tilecolor & 3)]);
-			curpal[2] = endian_fix(palette[3 * (tilecolor & 3) + 1]);
-			curpal[3] = endian_fix(palette[3 * (tilecolor & 3) + 2]);
+			curpal[1] = endian_fix(ppu.palette[3 * (tilecolor & 3)]);
+			curpal[2] = endian_fix(ppu.palette[3 * (tilecolor & 3) + 1]);
+			curpal[3] = endian_fix(ppu.palette[3 * (tilecolor & 3) + 2]);
 			hposition = 85;
 			curclock += 85;
 		}
 	}
 
+	drawrptr = (char *)rptr;
+	drawrptr0 = (char *)rptr0;
+	drawptr = (char *)ptr;
+	drawptr0 = (char *)ptr0;
 	if ((lastclock = endclock) >= PBL)
 		lastclock = 0;
 }
@@ -0,0 +1,481 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Log of PPU events passed from the CPU emulation to the
+ * renderer.
+ *
+ * The I/O code reports every change the renderer depends on (register
+ * writes, VRAM and OAM updates, palette changes) through the ppu_*
+ * functions. Register changes are stamped with the PPU clock, so
+ * applying one first draws the frame up to that point; a write costs
+ * O(1) however many scanlines it affects. Normally changes are applied
+ * straight away and drawimage() runs inline. With --ppu-thread they are
+ * appended to a lock-free ring instead and replayed in order by a
+ * render thread working on its own copy of VRAM, OAM and the palette,
+ * so frame N is drawn while the CPU is already running frame N+1.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "consts.h"
+#include "globals.h"
+#include "ppulog.h"
+#include "renderer.h"
+#include "stats.h"
+
+struct PPUState ppu = {
+	.vram = vram,
+	.oam = spriteram,
+};
+
+/* drawimage, timed for --benchmark */
+static void
+draw(int part, int clock)
+{
+	if (stats_enabled) {
+		uint64_t t = stats_now();
+
+		drawimage(clock);
+		stats_add(part, stats_now() - t);
+	} else {
+		drawimage(clock);
+	}
+}
+
+static unsigned int skip_sent = 0;
+static unsigned int regs[PPU_NT0 + 4];  /* the registers as last set, for saved states */
+static uint32_t palette_dirty = 0;      /* palette RAM written since UpdateColors() */
+
+static void
+ppu_apply(int reg, unsigned int val)
+{
+	switch (reg) {
+	case PPU_CTRL:
+		ppu.ctrl = val;
+		break;
+	case PPU_MASK:
+		ppu.mask = val;
+		break;
+	case PPU_HSCROLL:
+		ppu.hscroll = val;
+		break;
+	case PPU_VSCROLL:
+		ppu.vscroll = val;
+		break;
+	case PPU_VLINE:
+		ppu.vline = val;
+		break;
+	case PPU_VSCAN:
+		ppu.vscan = val;
+		break;
+	case PPU_VWRAP:
+		ppu.vwrap = val;
+		break;
+	case PPU_VWRAP_XOR:
+		ppu.vwrap ^= val;
+		break;
+	case PPU_SKIP:
+		ppu.frameskip = val;
+		break;
+	case PPU_NT0:
+	case PPU_NT0 + 1:
+	case PPU_NT0 + 2:
+	case PPU_NT0 + 3:
+		ppu.ntpage[reg - PPU_NT0] = val;
+		break;
+	}
+}
+
+#ifdef HAVE_PTHREAD
+
+#define RING_SIZE       (1 << 20)       /* bytes, a power of two */
+
+static int      threaded = 0;
+
+/* event types */
+#define EV_WRAP         0               /* continue at the start of the ring */
+#define EV_DRAW         1
+#define EV_SET          2
+#define EV_VRAM         3
+#define EV_OAM          4
+#define EV_PALETTE      5
+#define EV_FRAME        6
+
+/* Each event is a header followed by len bytes of data, padded to 16 */
+struct event {
+	uint16_t        type;
+	uint16_t        arg;            /* register or address */
+	int32_t         clock;          /* PPU clock, or -1 for none */
+	uint32_t        val;
+	uint32_t        len;
+};
+
+#define EV_SIZE(len)    ((sizeof(struct event) + (len) + 15) & ~15U)
+
+static unsigned char ring[RING_SIZE] __attribute__((aligned(16)));
+static uint32_t head, tail;             /* shared, see ppu_wait() */
+static uint32_t whead;                  /* head including unpublished events */
+static uint32_t frames_sent, frames_done;
+
+/* the render thread's copies of the PPU state */
+static unsigned char rvram[16384];
+static unsigned char roam[256];
+static int      rpalette[25];
+static char    *framebuf[2];
+static unsigned char frame_skipped[2];
+
+static pthread_t render_thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cpu_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+static int      cpu_waiting, render_waiting;
+
+/*
+ * Each side sleeps only after announcing it in *waiting and rechecking
+ * its condition under the lock; the other side updates head, tail or
+ * frames_done first and then signals only if somebody is waiting. All
+ * of these accesses are sequentially consistent, so a wakeup cannot be
+ * missed.
+ */
+static void
+ppu_wait(pthread_cond_t *cond, int *waiting, int (*ready)(uint32_t), uint32_t arg)
+{
+	pthread_mutex_lock(&lock);
+	__atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+	while (!ready(arg))
+		pthread_cond_wait(cond, &lock);
+	__atomic_store_n(waiting, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&lock);
+}
+
+static void
+ppu_wake(pthread_cond_t *cond, int *waiting)
+{
+	if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&lock);
+		pthread_cond_signal(cond);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+static int
+ring_has_space(uint32_t need)
+{
+	return RING_SIZE - (whead - __atomic_load_n(&tail, __ATOMIC_SEQ_CST)) >= need;
+}
+
+static int
+ring_has_events(uint32_t rtail)
+{
+	return __atomic_load_n(&head, __ATOMIC_SEQ_CST) != rtail;
+}
+
+static int
+frame_is_done(uint32_t frame)
+{
+	return (int32_t)(__atomic_load_n(&frames_done, __ATOMIC_SEQ_CST) - frame) >= 0;
+}
+
+/* Append an event with len bytes of data copied from data */
+static void
+ppu_event(uint32_t type, uint32_t arg, int clock, uint32_t val, const void *data, uint32_t len)
+{
+	uint32_t size = EV_SIZE(len);
+	uint32_t pos = whead % RING_SIZE;
+	uint32_t need = size;
+	struct event *ev;
+
+	if (pos + size > RING_SIZE)
+		need += RING_SIZE - pos;
+	if (!ring_has_space(need))
+		ppu_wait(&cpu_cond, &cpu_waiting, ring_has_space, need);
+	if (pos + size > RING_SIZE) {
+		/* no room before the end of the ring */
+		ev = (struct event *)(ring + pos);
+		ev->type = EV_WRAP;
+		whead += RING_SIZE - pos;
+		pos = 0;
+	}
+	ev = (struct event *)(ring + pos);
+	ev->type = type;
+	ev->arg = arg;
+	ev->clock = clock;
+	ev->val = val;
+	ev->len = len;
+	if (len)
+		memcpy(ev + 1, data, len);
+	whead += size;
+	__atomic_store_n(&head, whead, __ATOMIC_SEQ_CST);
+	ppu_wake(&render_cond, &render_waiting);
+}
+
+static void *
+ppu_render(void *arg)
+{
+	uint32_t rtail = 0;
+
+	(void)arg;
+
+	for (;;) {
+		if (!ring_has_events(rtail))
+			ppu_wait(&render_cond, &render_waiting, ring_has_events, rtail);
+		while (ring_has_events(rtail)) {
+			const struct event *ev = (const struct event *)(ring + rtail % RING_SIZE);
+
+			switch (ev->type) {
+			case EV_WRAP:
+				rtail += RING_SIZE - rtail % RING_SIZE;
+				continue;
+			case EV_DRAW:
+				draw(STAT_RENDER, ev->clock);
+				break;
+			case EV_SET:
+				if (ev->clock >= 0)
+					draw(STAT_RENDER, ev->clock);
+				ppu_apply(ev->arg, ev->val);
+				break;
+			case EV_VRAM:
+				memcpy(rvram + ev->arg, ev + 1, ev->len);
+				break;
+			case EV_OAM:
+				memcpy(roam + ev->arg, ev + 1, ev->len);
+				break;
+			case EV_PALETTE:
+				memcpy(rpalette, ev + 1, sizeof(rpalette));
+				break;
+			case EV_FRAME:
+				/* frame n was drawn into framebuf[n & 1] */
+				frame_skipped[frames_done & 1] = ppu.frameskip;
+				rfb = fb = framebuf[(frames_done + 1) & 1];
+				__atomic_store_n(&frames_done, frames_done + 1, __ATOMIC_SEQ_CST);
+				break;
+			}
+			rtail += EV_SIZE(ev->len);
+			__atomic_store_n(&tail, rtail, __ATOMIC_SEQ_CST);
+		}
+		ppu_wake(&cpu_cond, &cpu_waiting);
+	}
+	return NULL;
+}
+
+#endif /* HAVE_PTHREAD */
+
+/* Set up the renderer's view of the PPU; called from fbinit() */
+void
+ppu_init(void)
+{
+	ppu.palette = palette;
+	if (!renderer_config.threaded)
+		return;
+#ifdef HAVE_PTHREAD
+	/* MMC2/MMC4 switch CHR banks from inside drawimage */
+	if (MAPPERNUMBER == 9 || MAPPERNUMBER == 10) {
+		fprintf(stderr,
+		        "[%s] Mapper %d can't be drawn on a separate thread\n",
+		        renderer->name, MAPPERNUMBER);
+		return;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (!(framebuf[i] = malloc(bytes_per_line * 240))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	memcpy(rvram, vram, sizeof(rvram));
+	memcpy(roam, spriteram, sizeof(roam));
+	memcpy(rpalette, palette, sizeof(rpalette));
+	ppu.vram = rvram;
+	ppu.oam = roam;
+	ppu.palette = rpalette;
+	rfb = fb = framebuf[0];
+	threaded = 1;
+	int err = pthread_create(&render_thread, NULL, ppu_render, NULL);
+	if (err) {
+		fprintf(stderr, "[%s] Can't start render thread: %s\n",
+		        renderer->name, strerror(err));
+		exit(EXIT_FAILURE);
+	}
+	if (verbose)
+		fprintf(stderr, "[%s] Drawing on a separate thread\n",
+		        renderer->name);
+#else
+	fprintf(stderr, "[%s] Threads are not supported in this build\n",
+	        renderer->name);
+#endif
+}
+
+/* Have the renderer recompute palette[] after palette RAM writes */
+static void
+ppu_palette_flush(void)
+{
+	if (!palette_dirty)
+		return;
+	palette_dirty = 0;
+	renderer->UpdateColors();
+#ifdef HAVE_PTHREAD
+	if (threaded)
+		ppu_event(EV_PALETTE, 0, -1, 0, palette, 25 * sizeof(*palette));
+#endif
+}
+
+static void     ppu_log(int clock, int reg, unsigned int val);
+
+/* Bring the renderer up to date before it draws anything more */
+static void
+ppu_sync(void)
+{
+	/* truecolour pixels take their colour from palette[] as they are
+	   drawn, so pick up palette writes made since the last flush */
+	if (!renderer_config.indexedcolor)
+		ppu_palette_flush();
+	if (frameskip != skip_sent) {
+		skip_sent = frameskip;
+		ppu_log(-1, PPU_SKIP, frameskip);
+	}
+}
+
+/* Change a register at the given PPU clock, or -1 to not draw first */
+static void
+ppu_log(int clock, int reg, unsigned int val)
+{
+	if (reg == PPU_VWRAP_XOR)
+		regs[PPU_VWRAP] ^= val;
+	else
+		regs[reg] = val;
+	if (clock >= 0)
+		ppu_sync();
+#ifdef HAVE_PTHREAD
+	if (threaded) {
+		ppu_event(EV_SET, reg, clock, val, NULL, 0);
+		return;
+	}
+#endif
+	if (clock >= 0)
+		draw(STAT_DRAW, clock);
+	ppu_apply(reg, val);
+}
+
+/* Draw the frame up to the given PPU clock */
+void
+ppu_draw(int clock)
+{
+	ppu_sync();
+#ifdef HAVE_PTHREAD
+	if (threaded) {
+		ppu_event(EV_DRAW, 0, clock, 0, NULL, 0);
+		return;
+	}
+#endif
+	draw(STAT_DRAW, clock);
+}
+
+/* Change a register now; the frame so far is drawn with the old value */
+void
+ppu_set(int reg, unsigned int val)
+{
+	ppu_log(CLOCK * 3, reg, val);
+}
+
+/* VRAM[addr] to VRAM[addr + len - 1] have changed */
+void
+ppu_vram(unsigned int addr, unsigned int len)
+{
+#ifdef HAVE_PTHREAD
+	if (threaded)
+		ppu_event(EV_VRAM, addr, CLOCK * 3, 0, VRAM + addr, len);
+#else
+	(void)addr;
+	(void)len;
+#endif
+}
+
+/* spriteram[addr] to spriteram[addr + len - 1] have changed */
+void
+ppu_oam(unsigned int addr, unsigned int len)
+{
+#ifdef HAVE_PTHREAD
+	if (threaded)
+		ppu_event(EV_OAM, addr, CLOCK * 3, 0, spriteram + addr, len);
+#else
+	(void)addr;
+	(void)len;
+#endif
+}
+
+/*
+ * Palette RAM at $3F00 + index is about to be written. Games usually
+ * upload a whole palette at once, so rather than recomputing all the
+ * colours for every byte this only notes the write. The first write of
+ * a batch draws the frame up to here with the old colours; the new ones
+ * take effect at the next ppu_draw(), or at the end of the frame for
+ * indexed colour, where the colormap applies to the whole frame anyway.
+ */
+void
+ppu_palette(unsigned int index)
+{
+	if (!palette_dirty && !renderer_config.indexedcolor)
+		ppu_draw(CLOCK * 3);
+	palette_dirty |= 1U << index;
+}
+
+/* The registers as last set, for saved states */
+void *
+ppu_state(unsigned int *size)
+{
+	*size = sizeof(regs);
+	return regs;
+}
+
+/*
+ * A saved state was loaded into VRAM, spriteram and ppu_state(): send
+ * the renderer all of it. Called between frames.
+ */
+void
+ppu_restore(void)
+{
+	for (int reg = 0; reg < PPU_NT0 + 4; reg++)
+		if (reg != PPU_VWRAP_XOR && reg != PPU_SKIP)
+			ppu_log(-1, reg, regs[reg]);
+	ppu_vram(0, 16384);
+	ppu_oam(0, 256);
+	palette_dirty = ~0U;
+	ppu_palette_flush();
+}
+
+/*
+ * Finish the frame. Returns the most recent completed frame to display,
+ * or NULL if that frame was skipped. When drawing on a separate thread
+ * this is the previous frame, as the current one is still being drawn.
+ */
+char *
+ppu_endframe(void)
+{
+	ppu_draw(PBL);
+	ppu_palette_flush();
+#ifdef HAVE_PTHREAD
+	if (threaded) {
+		uint32_t frame = frames_sent++;
+
+		ppu_event(EV_FRAME, 0, PBL, 0, NULL, 0);
+		if (!frame)
+			return NULL;
+		frame--;
+		if (!frame_is_done(frame + 1))
+			ppu_wait(&cpu_cond, &cpu_waiting, frame_is_done, frame + 1);
+		return frame_skipped[frame & 1] ? NULL : framebuf[frame & 1];
+	}
+#endif
+	return ppu.frameskip ? NULL : fb;
+}
@@ -0,0 +1,54 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Log of PPU events passed from the CPU emulation to the
+ * renderer, which may run on a separate thread.
+ */
+
+#ifndef PPULOG_H
+#define PPULOG_H
+
+/* The PPU state drawimage works from */
+extern struct PPUState {
+	unsigned char   ctrl;           /* $2000 */
+	unsigned char   mask;           /* $2001 */
+	unsigned char   hscroll;        /* horizontal scroll */
+	unsigned char   vscroll;        /* vertical scroll, read at frame start */
+	unsigned int    vline;          /* tile row being drawn */
+	unsigned int    vscan;          /* pixel row within the tile */
+	unsigned int    vwrap;          /* vertical nametable wrap */
+	unsigned int    frameskip;      /* don't draw this frame */
+	unsigned int    ntpage[4];      /* VRAM address of each nametable */
+	unsigned char  *vram;
+	unsigned char  *oam;
+	int            *palette;
+} ppu;
+
+/*
+ * Registers for ppu_set(). Each change is logged with the PPU clock it
+ * happened at (scanline * HCYCLES + cycle), and the renderer draws the
+ * frame up to that point before applying it.
+ */
+#define PPU_CTRL        0
+#define PPU_MASK        1
+#define PPU_HSCROLL     2
+#define PPU_VSCROLL     3
+#define PPU_VLINE       4
+#define PPU_VSCAN       5
+#define PPU_VWRAP       6
+#define PPU_VWRAP_XOR   7
+#define PPU_SKIP        8
+#define PPU_NT0         9       /* to PPU_NT0 + 3, see ntmap() */
+
+extern void     ppu_init(void);
+extern void     ppu_draw(int clock);
+extern void     ppu_set(int reg, unsigned int val);
+extern void     ppu_vram(unsigned int addr, unsigned int len);
+extern void     ppu_oam(unsigned int addr, unsigned int len);
+extern void     ppu_palette(unsigned int index);
+extern char    *ppu_endframe(void);
+extern void    *ppu_state(unsigned int *size);
+extern void     ppu_restore(void);
+
+#endif
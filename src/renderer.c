@@ -2,7 +2,7 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
 /*
- * Description: This file provides the "auto" and "none"
+ * Description: This file provides the "auto", "bench" and "none"
  * pseudo-renderers.
  */
 
@@ -22,22 +22,33 @@
 #include "consts.h"
 #include "globals.h"
 #include "joystick.h"
+#include "ppulog.h"
 #include "renderer.h"
+#include "sound.h"
+#include "stats.h"
 
 #ifdef HAVE_X
 extern int      InitDisplayX11(int argc, char **argv);
 extern void     UpdateColorsX11(void);
 extern void     UpdateDisplayX11(void);
 #endif
+extern int      InitDisplayCapture(int argc, char **argv);
+extern void     UpdateColorsCapture(void);
+extern void     UpdateDisplayCapture(void);
 
 /* exports */
 int     InitDisplayAuto(int argc, char **argv);
+int     InitDisplayBench(int argc, char **argv);
+void    UpdateColorsBench(void);
+void    UpdateDisplayBench(void);
 int     InitDisplayNone(int argc, char **argv);
 void    UpdateColorsNone(void);
 void    UpdateDisplayNone(void);
 
 /* imports */
 extern void     fbinit(void);
+extern void     fbprivate(void);
+extern void     fbcolors(void);
 
 /* globals */
 struct Renderer renderers[] = {
@@ -45,8 +56,12 @@ struct Renderer renderers[] = {
 	{ "x11", "X11 renderer",
 	  InitDisplayX11, UpdateDisplayX11, UpdateColorsX11 },
 #endif /* HAVE_X */
+	{ "capture", "Write raw video to a file (see --display)",
+	  InitDisplayCapture, UpdateDisplayCapture, UpdateColorsCapture },
 	{ "auto", "Choose one automatically",
 	  InitDisplayAuto, 0, 0 },
+	{ "bench", "Run as fast as possible (see --benchmark)",
+	  InitDisplayBench, UpdateDisplayBench, UpdateColorsBench },
 	{ "none", "Don't draw anything",
 	  InitDisplayNone, UpdateDisplayNone, UpdateColorsNone },
 	{ 0, 0, 0, 0, 0 }     /* terminator */
@@ -59,6 +74,7 @@ struct RendererConfig renderer_config = {
 	.indexedcolor = 1,
 	.scaler_magstep = 1,
 	.magstep = 1,
+	.threaded = 0,
 };
 
 /* global renderer data */
@@ -71,6 +87,7 @@ struct RendererData renderer_data = {
 	.needsrefresh = 1,
 	.redrawbackground = 1,
 	.redrawall = 1,
+	.skippedframes = 0,
 };
 
 int
@@ -117,13 +134,26 @@ InitDisplayNone(int argc, char **argv)
 	return 0;
 }
 
+/*
+ * Keep the game at 60 frames a second: set frameskip if it is falling
+ * behind the clock, sleep if it is getting ahead.  While the sound
+ * device keeps the time, see UpdateAudio(), frames are neither skipped
+ * nor held back.
+ */
 void
-UpdateDisplayNone(void)
+PaceDisplay(void)
 {
 	struct timeval time;
 	static unsigned int frame;
 	unsigned int timeframe;
 
+	if (SoundPacing()) {
+		/* the sound device keeps the time, see UpdateAudio() */
+		frameskip = 0;
+		renderer_data.desync = 1;
+		return;
+	}
+
 	/* Check the time.  If we're getting behind, skip next frame to stay in sync. */
 	gettimeofday(&time, NULL);
 	if (renderer_data.desync)
@@ -152,8 +182,12 @@ UpdateDisplayNone(void)
 	if (frame > timeframe + 1) {
 		usleep(16666 * (frame - timeframe - 1));
 	}
+}
 
-	/* Input loop */
+/* Handle pending joystick input; blocks while the display is paused */
+void
+PollJoysticks(void)
+{
 	struct pollfd fds[] = {
 		{ .fd = jsfd[0], .events = POLLIN, },
 		{ .fd = jsfd[1], .events = POLLIN, },
@@ -175,9 +209,47 @@ UpdateDisplayNone(void)
 	} while (nready);
 }
 
+void
+UpdateDisplayNone(void)
+{
+	PaceDisplay();
+	PollJoysticks();
+}
+
 /* Update the colors on the screen if the palette changed */
 void
 UpdateColorsNone(void)
 {
 	/* no-op */
 }
+
+/*
+   With --benchmark=N,nodraw there is no framebuffer and fbinit() picks
+   the no-op drawimage; the nametable pages are still set up by main(),
+   so the emulation itself is the same as with drawing.
+ */
+int
+InitDisplayBench(int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+	if (benchmark_draw)
+		fbprivate();
+	fbinit();
+	return 0;
+}
+
+/* Neither pace nor skip frames: the emulation runs flat out */
+void
+UpdateDisplayBench(void)
+{
+	ppu_endframe();
+	frameskip = 0;
+}
+
+void
+UpdateColorsBench(void)
+{
+	if (benchmark_draw)
+		fbcolors();
+}
@@ -19,6 +19,10 @@ extern int      InitDisplayNone(int argc, char **argv);
 extern void     UpdateColorsNone(void);
 extern void     UpdateDisplayNone(void);
 
+/* frame timing and joystick input for the renderers without a window */
+extern void     PaceDisplay(void);
+extern void     PollJoysticks(void);
+
 struct Renderer {
 	const char *name, *fullname;
 	int (*InitDisplay)(int argc, char **argv);
@@ -40,6 +44,7 @@ extern struct RendererConfig {
 	int        indexedcolor;
 	int        scaler_magstep;         /* HQX scale factor */
 	int        magstep;                /* Final scale factor */
+	int        threaded;               /* Draw on a separate thread */
 } renderer_config;
 
 /* global renderer data */
@@ -52,6 +57,7 @@ extern struct RendererData {
 	int        needsrefresh;           /* Refresh screen display */
 	int        redrawbackground;       /* Redraw tile background */
 	int        redrawall;              /* Redraw all scanlines */
+	unsigned long skippedframes;       /* Unchanged frames not redrawn */
 } renderer_data;
 
 #define maxsize 4
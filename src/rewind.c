@@ -0,0 +1,318 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Rewinding. With --rewind=SECONDS a snapshot of the
+ * machine (see savestate.c) is taken at every vertical blank and kept in
+ * a ring holding the last SECONDS of play; while F6 is held, the game
+ * steps back through the ring one frame per frame.
+ *
+ * Every KEY_INTERVAL-th entry of the ring is a keyframe, and the others
+ * are stored as the XOR of the snapshot with the keyframe before them,
+ * which is mostly zero words. Each entry is packed by squeezing out its
+ * runs of zero words (a keyframe being XORed with zero), into a fixed
+ * arena; when the arena is full, the oldest keyframe and its deltas are
+ * dropped, whatever depth was asked for. The packing is done by a worker
+ * thread, so the emulation only pays for the snapshot copy.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "globals.h"
+#include "rewind.h"
+#include "savestate.h"
+
+#define KEY_INTERVAL    60              /* frames per keyframe */
+#define ARENA_WORDS     (2 << 20)       /* 8 MB of packed entries */
+#define POOL_SIZE       4               /* snapshots waiting to be packed */
+
+int     rewind_seconds = 0;
+
+/* A packed entry in the arena */
+static struct entry {
+	uint32_t        off;            /* in words */
+	uint32_t        len;
+	int             key;
+} *entries;
+
+/* Entries are numbered from the start; number n is entries[n % max_entries] */
+static unsigned long first = 0, next = 0;
+static unsigned long max_entries;
+
+static uint32_t *arena;
+static unsigned int words;              /* in a snapshot */
+static uint32_t *zeroes;
+static uint32_t *keybuf;                /* the snapshot of keyframe keyseq */
+static unsigned long keyseq;
+static int      key_valid = 0;
+static uint32_t *packed;                /* an entry being packed */
+static uint32_t *state;                 /* an entry being unpacked */
+static int      held = 0;
+
+static uint32_t *pool[POOL_SIZE];
+static unsigned int pool_head = 0;      /* next snapshot to take */
+static unsigned int pool_tail = 0;      /* next snapshot to pack */
+
+#ifdef HAVE_PTHREAD
+static pthread_t        packer_thread;
+static pthread_mutex_t  pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   pool_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t   done_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+/*
+ * Pack s XOR ref into out. Each run is a header word, holding the number
+ * of zero words to skip in the top half and the number of literal words
+ * which follow it in the bottom half; at most 2 * words are written.
+ */
+static unsigned int
+pack(const uint32_t *s, const uint32_t *ref, uint32_t *out)
+{
+	unsigned int i = 0, n = 0;
+
+	while (i < words) {
+		uint32_t zeros = 0, literals = 0;
+		uint32_t *header = &out[n++];
+
+		while (i < words && zeros < 0xffff && s[i] == ref[i]) {
+			zeros++;
+			i++;
+		}
+		while (i < words && literals < 0xffff && s[i] != ref[i]) {
+			out[n++] = s[i] ^ ref[i];
+			literals++;
+			i++;
+		}
+		*header = zeros << 16 | literals;
+	}
+	return n;
+}
+
+/* XOR the packed entry e into dst */
+static void
+unpack(const struct entry *e, uint32_t *dst)
+{
+	const uint32_t *p = arena + e->off, *end = p + e->len;
+
+	while (p < end) {
+		uint32_t header = *p++;
+
+		dst += header >> 16;
+		for (uint32_t literals = header & 0xffff; literals; literals--)
+			*dst++ ^= *p++;
+	}
+}
+
+/* Drop the oldest keyframe and its deltas */
+static void
+drop_oldest(void)
+{
+	do
+		first++;
+	while (first < next && !entries[first % max_entries].key);
+}
+
+/* Find room in the arena for len words, dropping old entries as needed */
+static uint32_t
+arena_alloc(uint32_t len)
+{
+	for (;;) {
+		if (first == next)
+			return 0;
+
+		const struct entry *oldest = &entries[first % max_entries];
+		const struct entry *newest = &entries[(next - 1) % max_entries];
+		uint32_t end = newest->off + newest->len;
+
+		if (newest->off >= oldest->off) {
+			/* the entries don't wrap around */
+			if (end + len <= ARENA_WORDS)
+				return end;
+			if (len <= oldest->off)
+				return 0;
+		} else if (end + len <= oldest->off) {
+			return end;
+		}
+		drop_oldest();
+	}
+}
+
+/* Add a snapshot to the ring */
+static void
+store(const uint32_t *s)
+{
+	uint32_t len, off;
+	int key;
+
+	if (next - first == max_entries)
+		drop_oldest();
+	/* keybuf may hold a keyframe which was dropped or rewound past */
+	key = !key_valid || keyseq < first || keyseq >= next
+	   || next - keyseq >= KEY_INTERVAL;
+	len = pack(s, key ? zeroes : keybuf, packed);
+	off = arena_alloc(len);
+	if (!key && keyseq < first) {
+		/* that dropped our keyframe */
+		key = 1;
+		len = pack(s, zeroes, packed);
+		off = arena_alloc(len);
+	}
+	memcpy(arena + off, packed, len * sizeof(*packed));
+
+	struct entry *e = &entries[next % max_entries];
+	e->off = off;
+	e->len = len;
+	e->key = key;
+	if (key) {
+		memcpy(keybuf, s, words * sizeof(*s));
+		keyseq = next;
+		key_valid = 1;
+	}
+	next++;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+packer(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&pool_lock);
+	for (;;) {
+		while (pool_tail == pool_head)
+			pthread_cond_wait(&pool_cond, &pool_lock);
+		const uint32_t *s = pool[pool_tail % POOL_SIZE];
+		pthread_mutex_unlock(&pool_lock);
+		store(s);
+		pthread_mutex_lock(&pool_lock);
+		pool_tail++;
+		pthread_cond_signal(&done_cond);
+	}
+	return NULL;
+}
+#endif
+
+/* Wait until at most n snapshots are waiting to be packed */
+static void
+wait_packer(unsigned int n)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&pool_lock);
+	while (pool_head - pool_tail > n)
+		pthread_cond_wait(&done_cond, &pool_lock);
+	pthread_mutex_unlock(&pool_lock);
+#else
+	(void)n;
+#endif
+}
+
+/* Called once the game is loaded */
+void
+rewind_init(void)
+{
+	if (!rewind_seconds)
+		return;
+
+	words = (savestate_size + 3) / 4;
+	max_entries = rewind_seconds * 60UL;
+	if (!(entries = malloc(max_entries * sizeof(*entries)))
+	 || !(arena = malloc(ARENA_WORDS * sizeof(*arena)))
+	 || !(zeroes = calloc(words, sizeof(*zeroes)))
+	 || !(keybuf = calloc(words, sizeof(*keybuf)))
+	 || !(packed = calloc(2 * words, sizeof(*packed)))
+	 || !(state = calloc(words, sizeof(*state)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < POOL_SIZE; i++)
+		if (!(pool[i] = calloc(words, sizeof(**pool)))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+
+#ifdef HAVE_PTHREAD
+	int err = pthread_create(&packer_thread, NULL, packer, NULL);
+	if (err) {
+		fprintf(stderr, "Can't start rewind thread: %s\n", strerror(err));
+		exit(EXIT_FAILURE);
+	}
+#endif
+	if (verbose)
+		fprintf(stderr, "Keeping up to %d seconds for rewinding\n",
+		        rewind_seconds);
+}
+
+/* The rewind key was pressed or released */
+void
+rewind_hold(int h)
+{
+	held = h;
+}
+
+/* Go back to the newest entry and drop it; the oldest one is kept */
+static void
+step_back(unsigned int *regs)
+{
+	unsigned long n, k;
+	const struct entry *e;
+
+	/* the packer is done with the ring once it has caught up */
+	wait_packer(0);
+	if (first == next)
+		return;
+	n = next - 1;
+	e = &entries[n % max_entries];
+	for (k = n; !entries[k % max_entries].key; k--)
+		;
+	if (e->key) {
+		memset(state, 0, words * sizeof(*state));
+	} else {
+		if (!key_valid || keyseq != k) {
+			/* unpack the keyframe this delta is against */
+			memset(keybuf, 0, words * sizeof(*keybuf));
+			unpack(&entries[k % max_entries], keybuf);
+			keyseq = k;
+			key_valid = 1;
+		}
+		memcpy(state, keybuf, words * sizeof(*state));
+	}
+	unpack(e, state);
+	if (n > first)
+		next = n;
+	savestate_restore((const unsigned char *)state, regs);
+}
+
+/* Called at the end of every vertical blank, see donmi() */
+void
+rewind_frame(unsigned int *regs)
+{
+	if (!rewind_seconds)
+		return;
+	if (held) {
+		step_back(regs);
+		return;
+	}
+
+	/* make room in the pool, then hand the packer a snapshot */
+	wait_packer(POOL_SIZE - 1);
+	savestate_snapshot((unsigned char *)pool[pool_head % POOL_SIZE], regs);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&pool_lock);
+	pool_head++;
+	pthread_cond_signal(&pool_cond);
+	pthread_mutex_unlock(&pool_lock);
+#else
+	store(pool[pool_head++ % POOL_SIZE]);
+	pool_tail = pool_head;
+#endif
+}
@@ -0,0 +1,17 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Rewinding through recent saved states
+ */
+
+#ifndef REWIND_H
+#define REWIND_H
+
+extern int      rewind_seconds;         /* history to keep, 0 for none */
+
+extern void     rewind_init(void);
+extern void     rewind_hold(int held);
+extern void     rewind_frame(unsigned int *regs);
+
+#endif
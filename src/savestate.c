@@ -0,0 +1,243 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Saved states. A snapshot of the whole machine (the 6502
+ * registers, RAM, VRAM and sprite memory, the mapper, I/O and PPU
+ * registers and the sound channels) is taken by copying each of those
+ * into a buffer allocated up front, and restored by copying it all
+ * back; either takes a few microseconds. Both happen at the vertical
+ * blank, in donmi(), where the 6502 registers are at hand.
+ *
+ * A snapshot can be written to ~/.tuxnes/<game>.sta and read back later.
+ * The file is a 16-byte header (the magic "TuxNESst", then a hash of the
+ * ROM image and the size of the snapshot, in host byte order) followed
+ * by the snapshot itself, as laid out in memory; it can only be loaded
+ * by the same build of the emulator.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expsound.h"
+#include "globals.h"
+#include "movie.h"
+#include "ppulog.h"
+#include "savestate.h"
+#include "sound.h"
+
+#define STATE_MAGIC     "TuxNESst"
+
+extern unsigned int     irqflag;
+
+size_t  savestate_size = 0;
+
+/* The parts of the CPU state which aren't in memory */
+static struct CPUState {
+	unsigned int    regs[4];        /* %edx, %ecx, %eax and %edi, see donmi() */
+	unsigned int    vflag;
+	unsigned int    flags;
+	unsigned int    stackptr;
+	unsigned int    clock;
+	int             ctni;
+	unsigned int    irqflag;
+	unsigned int    nomirror;
+	unsigned char   hscrollreg;
+	unsigned char   vscrollreg;
+} cpu;
+
+/* Everything that goes into a snapshot, in order */
+static struct region {
+	void           *ptr;
+	unsigned int    size;
+} regions[10];
+static int      nregions = 0;
+
+static struct header {
+	char            magic[8];
+	uint32_t        romhash;
+	uint32_t        size;
+} header;
+
+static unsigned char *slot;             /* the state saved to the file */
+static char    *statefile;
+static int      request = 0;
+
+static void
+add_region(void *ptr, unsigned int size)
+{
+	regions[nregions].ptr = ptr;
+	regions[nregions].size = size;
+	nregions++;
+	savestate_size += size;
+}
+
+/* Called once the game is loaded */
+void
+savestate_init(void)
+{
+	unsigned int size;
+	void *ptr;
+
+	add_region(&cpu, sizeof(cpu));
+	add_region(RAM, 0x8000);
+	add_region(vram, 16384);
+	add_region(spriteram, 256);
+	/* ROM and RAM are mapped at fixed addresses (see consts.h), so
+	   the mapper table can be saved as it is */
+	add_region(MAPTABLE, 17 * sizeof(*MAPTABLE));
+	ptr = io_state(&size);
+	add_region(ptr, size);
+	ptr = mapper_state(&size);
+	add_region(ptr, size);
+	ptr = ppu_state(&size);
+	add_region(ptr, size);
+	ptr = SoundState(&size);
+	add_region(ptr, size);
+	ptr = ExpansionSoundState(&size);
+	add_region(ptr, size);
+
+	memcpy(header.magic, STATE_MAGIC, 8);
+	header.romhash = rom_hash();
+	header.size = savestate_size;
+
+	if (!(slot = malloc(savestate_size))
+	 || !(statefile = malloc(strlen(tuxnesdir) + strlen(basefilename) + 5))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(statefile, "%s%s.sta", tuxnesdir, basefilename);
+}
+
+/* Copy the machine state into buf; regs are the registers donmi() was given */
+void
+savestate_snapshot(unsigned char *buf, const unsigned int *regs)
+{
+	SoundSync();
+	memcpy(cpu.regs, regs, sizeof(cpu.regs));
+	cpu.vflag = VFLAG;
+	cpu.flags = FLAGS;
+	cpu.stackptr = STACKPTR;
+	cpu.clock = CLOCK;
+	cpu.ctni = CTNI;
+	cpu.irqflag = irqflag;
+	cpu.nomirror = nomirror;
+	cpu.hscrollreg = hscrollreg;
+	cpu.vscrollreg = vscrollreg;
+
+	for (int i = 0; i < nregions; i++) {
+		memcpy(buf, regions[i].ptr, regions[i].size);
+		buf += regions[i].size;
+	}
+}
+
+/* Put the machine back in the state saved in buf */
+void
+savestate_restore(const unsigned char *buf, unsigned int *regs)
+{
+	SoundSync();
+	for (int i = 0; i < nregions; i++) {
+		memcpy(regions[i].ptr, buf, regions[i].size);
+		buf += regions[i].size;
+	}
+
+	memcpy(regs, cpu.regs, sizeof(cpu.regs));
+	VFLAG = cpu.vflag;
+	FLAGS = cpu.flags;
+	STACKPTR = cpu.stackptr;
+	CLOCK = cpu.clock;
+	CTNI = cpu.ctni;
+	irqflag = cpu.irqflag;
+	nomirror = cpu.nomirror;
+	hscrollreg = cpu.hscrollreg;
+	vscrollreg = cpu.vscrollreg;
+
+	/* bring the caches and the renderer up to date */
+	sprite0_invalidate();
+	SoundStateLoaded();
+	ppu_restore();
+}
+
+static void
+save_file(void)
+{
+	FILE *f = fopen(statefile, "wb");
+
+	if (!f
+	 || fwrite(&header, sizeof(header), 1, f) != 1
+	 || fwrite(slot, savestate_size, 1, f) != 1) {
+		perror(statefile);
+		if (f)
+			fclose(f);
+		return;
+	}
+	if (fclose(f)) {
+		perror(statefile);
+		return;
+	}
+	if (verbose)
+		fprintf(stderr, "Saved state to %s\n", statefile);
+}
+
+static int
+load_file(void)
+{
+	struct header h;
+	FILE *f = fopen(statefile, "rb");
+
+	if (!f) {
+		perror(statefile);
+		return -1;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1
+	 || memcmp(h.magic, STATE_MAGIC, 8)) {
+		fprintf(stderr, "%s: not a " PACKAGE_NAME " saved state\n", statefile);
+	} else if (h.romhash != header.romhash) {
+		fprintf(stderr, "%s: state was saved from a different ROM\n", statefile);
+	} else if (h.size != header.size) {
+		fprintf(stderr, "%s: state was saved by a different version of "
+		        PACKAGE_NAME "\n", statefile);
+	} else if (fread(slot, savestate_size, 1, f) != 1) {
+		fprintf(stderr, "%s: state is truncated\n", statefile);
+	} else {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	return -1;
+}
+
+/* Save or load the state file at the next vertical blank */
+void
+savestate_request(int what)
+{
+	request = what;
+}
+
+/*
+ * Called at the end of every vertical blank with the 6502 registers as
+ * the NMI code saved them; see donmi().
+ */
+void
+savestate_frame(unsigned int *regs)
+{
+	int what = request;
+
+	if (!what)
+		return;
+	request = 0;
+	if (what == STATE_SAVE) {
+		savestate_snapshot(slot, regs);
+		save_file();
+	} else if (what == STATE_LOAD && !load_file()) {
+		savestate_restore(slot, regs);
+		if (verbose)
+			fprintf(stderr, "Loaded state from %s\n", statefile);
+	}
+}
@@ -0,0 +1,25 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Saved states of the whole machine
+ */
+
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stddef.h>
+
+/* for savestate_request() */
+#define STATE_SAVE      1               /* write a saved state file */
+#define STATE_LOAD      2               /* read it back */
+
+extern size_t   savestate_size;         /* bytes in a snapshot */
+
+extern void     savestate_init(void);
+extern void     savestate_snapshot(unsigned char *buf, const unsigned int *regs);
+extern void     savestate_restore(const unsigned char *buf, unsigned int *regs);
+extern void     savestate_request(int request);
+extern void     savestate_frame(unsigned int *regs);
+
+#endif
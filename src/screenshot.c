@@ -1,6 +1,15 @@
 // SPDX-FileCopyrightText: Authors of TuxNES
 // SPDX-License-Identifier: GPL-2.0-or-later
 
+/*
+ * Description: Screenshot file naming, and PNG screenshots which work with
+ * any renderer. The renderer hands each finished frame to
+ * screenshot_frame(); when a screenshot has been asked for, the frame is
+ * copied into one of a few spare buffers and a background thread converts
+ * it to RGB, compresses it with zlib and writes the PNG file, so taking a
+ * screenshot (or a burst of them) doesn't stall the emulation.
+ */
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -8,6 +17,10 @@
 #include "globals.h"
 #include "screenshot.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -16,11 +29,53 @@
 #include <dirent.h>
 #include <unistd.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef SCREENSHOT_PNG
+#include <zlib.h>
+#endif
+
+#define SHOT_BUFFERS 4          /* frames waiting to be encoded */
+
 char *screenshotfile;
+int screenshot_burst = 1;       /* screenshots per request */
+int screenshot_every = 1;       /* frames between them */
 
 static const char *screenshotext = "";
 static int screenshotnumber = 0;
 
+#ifdef SCREENSHOT_PNG
+/* A frame waiting to be encoded, as the renderer drew it */
+static struct shot {
+	unsigned char  *raw;
+	unsigned long   pixels[64];     /* framebuffer pixel values... */
+	unsigned int    rgb[64];        /* ...and their 0xRRGGBB colours */
+	int             colors;         /* 0 if the pixels are 0xRRGGBB */
+} shots[SHOT_BUFFERS];
+static unsigned int shot_head = 0;      /* next buffer to fill */
+static int shots_left = 0;              /* of the current burst */
+static int shot_countdown = 0;          /* frames until the next one */
+static volatile sig_atomic_t shot_signalled = 0;
+
+#ifdef HAVE_PTHREAD
+static unsigned int shot_tail = 0;      /* next buffer to encode */
+static pthread_t        shot_thread;
+static pthread_mutex_t  shot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   shot_cond = PTHREAD_COND_INITIALIZER;
+static int      shot_thread_running = 0;
+static int      shot_closing = 0;
+#endif
+
+static void
+screenshot_signal(int signum)
+{
+	(void)signum;
+	shot_signalled = 1;
+}
+#endif /* SCREENSHOT_PNG */
+
 
 void
 screenshot_init(const char *ext)
@@ -34,6 +89,10 @@ screenshot_init(const char *ext)
 		exit(EXIT_FAILURE);
 	}
 	sprintf(screenshotfile, "%s-snap-", basefilename);
+	screenshotext = ext;
+#ifdef SCREENSHOT_PNG
+	signal(SIGUSR1, screenshot_signal);
+#endif
 
 	/* open the screenshot directory */
 	DIR *dir = opendir(tuxnesdir);
@@ -57,25 +116,283 @@ screenshot_init(const char *ext)
 
 	closedir(dir);
 
-	screenshotext = ext;
-
 	if (++screenshotnumber > 9999) {
 		screenshotnumber = 0;
 	}
 }
 
 
+/*
+ * Pick the next free screenshot file name and create the file. O_EXCL
+ * makes sure we don't over-write screenshots written by a concurrent
+ * TuxNES process, without a separate stat() of each candidate.
+ */
+static int
+screenshot_open(void)
+{
+	for (int tries = 0; tries < 10000; tries++) {
+		sprintf(screenshotfile, "%s%s-snap-%04u%s", tuxnesdir, basefilename, screenshotnumber++, screenshotext);
+		if (screenshotnumber > 9999) {
+			screenshotnumber = 0;
+		}
+		int fd = open(screenshotfile, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd >= 0 || errno != EEXIST)
+			return fd;
+	}
+	return -1;
+}
+
+
+/* Set screenshotfile to a new, empty file for the caller to write */
 void
 screenshot_new(void)
 {
-	struct stat buf[1];
+	int fd = screenshot_open();
 
-	/* make sure we don't over-write screenshots written by a concurrent TuxNES process */
-	do {
-		sprintf(screenshotfile, "%s%s-snap-%04u%s", tuxnesdir, basefilename, screenshotnumber++, screenshotext);
-	} while (!stat(screenshotfile, buf) && screenshotnumber <= 9999);
+	if (fd >= 0)
+		close(fd);
+}
 
-	if (screenshotnumber > 9999) {
-		screenshotnumber = 0;
+
+#ifdef SCREENSHOT_PNG
+static unsigned char *
+png_chunk(unsigned char *p, const char *type, const unsigned char *data, uLong len)
+{
+	uLong crc;
+
+	*p++ = len >> 24;
+	*p++ = len >> 16;
+	*p++ = len >> 8;
+	*p++ = len;
+	memcpy(p, type, 4);
+	if (len && data != p + 4)
+		memmove(p + 4, data, len);
+	crc = crc32(0, p, len + 4);
+	p += len + 4;
+	*p++ = crc >> 24;
+	*p++ = crc >> 16;
+	*p++ = crc >> 8;
+	*p++ = crc;
+	return p;
+}
+
+/* Read one framebuffer pixel the way drawimage wrote it */
+static unsigned long
+shot_pixel(const unsigned char *row, int x)
+{
+	unsigned long pixel;
+
+	switch (bpp) {
+	case 8:
+		return row[x];
+	case 16:
+		pixel = ((const uint16_t *)row)[x];
+		return pix_swab ? (pixel >> 8 & 0xff) | (pixel << 8 & 0xff00) : pixel;
+	case 24:
+		row += 3 * x;
+		return pix_swab ? row[0] << 16 | row[1] << 8 | row[2]
+		                : row[2] << 16 | row[1] << 8 | row[0];
+	default:
+		pixel = ((const uint32_t *)row)[x];
+		return pix_swab ? (pixel >> 24 & 0xff) | (pixel >> 8 & 0xff00)
+		                | (pixel << 8 & 0xff0000) | (pixel << 24 & 0xff000000)
+		                : pixel;
+	}
+}
+
+/* Convert a saved frame to RGB, compress it and write the PNG file */
+static void
+shot_write(const struct shot *shot)
+{
+	static unsigned char rows[240 * (1 + 256 * 3)];
+	static unsigned char *png;
+	static uLong pngsize;
+	unsigned long lastpixel = ~0UL;
+	unsigned int lastrgb = 0;
+	unsigned char *p = rows;
+
+	for (int y = 0; y < 240; y++) {
+		const unsigned char *row = shot->raw + y * bytes_per_line;
+
+		*p++ = 0;                       /* filter type None */
+		for (int x = 0; x < 256; x++) {
+			unsigned long pixel = shot_pixel(row, x);
+			unsigned int rgb = pixel;
+
+			if (shot->colors) {
+				/* runs of one colour are the common case */
+				if (pixel == lastpixel) {
+					rgb = lastrgb;
+				} else {
+					rgb = 0;
+					for (int i = 0; i < shot->colors; i++)
+						if (shot->pixels[i] == pixel) {
+							rgb = shot->rgb[i];
+							break;
+						}
+					lastpixel = pixel;
+					lastrgb = rgb;
+				}
+			}
+			*p++ = rgb >> 16;
+			*p++ = rgb >> 8;
+			*p++ = rgb;
+		}
+	}
+
+	/* signature, IHDR, IDAT and IEND */
+	if (!png) {
+		pngsize = 8 + 25 + 12 + compressBound(sizeof rows) + 12;
+		if (!(png = malloc(pngsize))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+	}
+	static const unsigned char ihdr[13] = {
+		0, 0, 1, 0,                     /* width 256 */
+		0, 0, 0, 240,                   /* height 240 */
+		8, 2, 0, 0, 0                   /* 8-bit RGB, not interlaced */
+	};
+	uLongf zlen = pngsize - (8 + 25 + 12 + 12);
+
+	memcpy(png, "\x89PNG\r\n\x1a\n", 8);
+	p = png_chunk(png + 8, "IHDR", ihdr, sizeof ihdr);
+	if (compress2(p + 8, &zlen, rows, sizeof rows, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		fprintf(stderr, "Can't compress screenshot\n");
+		return;
+	}
+	p = png_chunk(p, "IDAT", p + 8, zlen);
+	p = png_chunk(p, "IEND", NULL, 0);
+
+	int fd = screenshot_open();
+	if (fd < 0 || write(fd, png, p - png) != p - png) {
+		perror(screenshotfile);
+	} else if (verbose) {
+		fprintf(stderr, "Wrote screenshot to %s\n", screenshotfile);
+	}
+	if (fd >= 0)
+		close(fd);
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+screenshot_thread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&shot_lock);
+	for (;;) {
+		while (shot_tail == shot_head && !shot_closing)
+			pthread_cond_wait(&shot_cond, &shot_lock);
+		if (shot_tail == shot_head)
+			break;
+		const struct shot *shot = &shots[shot_tail % SHOT_BUFFERS];
+		pthread_mutex_unlock(&shot_lock);
+		shot_write(shot);
+		pthread_mutex_lock(&shot_lock);
+		shot_tail++;
 	}
+	pthread_mutex_unlock(&shot_lock);
+	return NULL;
+}
+
+/* Called at exit: finish the screenshots still queued */
+static void
+screenshot_close(void)
+{
+	pthread_mutex_lock(&shot_lock);
+	shot_closing = 1;
+	pthread_cond_signal(&shot_cond);
+	pthread_mutex_unlock(&shot_lock);
+	pthread_join(shot_thread, NULL);
+}
+#endif /* HAVE_PTHREAD */
+#endif /* SCREENSHOT_PNG */
+
+
+/* Take screenshot_burst screenshots, one every screenshot_every frames */
+void
+screenshot_request(void)
+{
+#ifdef SCREENSHOT_PNG
+	shots_left = screenshot_burst;
+	shot_countdown = 0;
+#else
+	fprintf(stderr,
+	        "cannot capture screenshots; please install zlib and then recompile\n");
+#endif
+}
+
+
+/*
+ * Called by the renderer with every frame it draws. colors pairs of
+ * framebuffer pixel values and 0xRRGGBB colours tell how to convert the
+ * frame back to RGB; if colors is 0, the pixels are 0xRRGGBB already.
+ */
+void
+screenshot_frame(const char *frame, const unsigned long *pixels,
+                 const unsigned int *rgb, int colors)
+{
+#ifdef SCREENSHOT_PNG
+	if (shot_signalled) {
+		shot_signalled = 0;
+		screenshot_request();
+	}
+	if (!shots_left || !frame)
+		return;
+	if (shot_countdown--)
+		return;
+	shot_countdown = screenshot_every - 1;
+	shots_left--;
+	if (bpp < 8) {
+		fprintf(stderr, "cannot capture screenshots at %dbpp\n", bpp);
+		shots_left = 0;
+		return;
+	}
+
+#ifdef HAVE_PTHREAD
+	if (!shot_thread_running) {
+		int err = pthread_create(&shot_thread, NULL, screenshot_thread, NULL);
+		if (err) {
+			fprintf(stderr, "Can't start screenshot thread: %s\n",
+			        strerror(err));
+			exit(EXIT_FAILURE);
+		}
+		shot_thread_running = 1;
+		atexit(screenshot_close);
+	}
+	pthread_mutex_lock(&shot_lock);
+	unsigned int queued = shot_head - shot_tail;
+	pthread_mutex_unlock(&shot_lock);
+	if (queued == SHOT_BUFFERS) {
+		fprintf(stderr, "Screenshot skipped, still writing the last ones\n");
+		return;
+	}
+#endif
+
+	struct shot *shot = &shots[shot_head % SHOT_BUFFERS];
+	if (!shot->raw && !(shot->raw = malloc(bytes_per_line * 240))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(shot->raw, frame, bytes_per_line * 240);
+	shot->colors = colors;
+	for (int i = 0; i < colors; i++) {
+		shot->pixels[i] = pixels[i];
+		shot->rgb[i] = rgb[i];
+	}
+
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&shot_lock);
+	shot_head++;
+	pthread_cond_signal(&shot_cond);
+	pthread_mutex_unlock(&shot_lock);
+#else
+	shot_write(shot);
+#endif
+#else
+	(void)frame;
+	(void)pixels;
+	(void)rgb;
+	(void)colors;
+#endif /* SCREENSHOT_PNG */
 }
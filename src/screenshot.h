@@ -4,9 +4,18 @@
 #ifndef SCREENSHOT_H
 #define SCREENSHOT_H
 
+/* PNG screenshots need zlib */
+#ifdef HAVE_LIBZ
+#define SCREENSHOT_PNG 1
+#endif
+
 extern char *screenshotfile;
+extern int screenshot_burst;
+extern int screenshot_every;
 
 void screenshot_init(const char *);
 void screenshot_new(void);
+void screenshot_request(void);
+void screenshot_frame(const char *, const unsigned long *, const unsigned int *, int);
 
 #endif
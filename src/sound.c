@@ -3,7 +3,8 @@
 
 /*
  * Description: This file is largely responsible for mixing the waveform and
- * pumping it out the audio device.
+ * pumping it out the audio device; with POSIX threads, both are done on an
+ * audio thread fed by a lock-free ring of sound register writes.
  */
 
 /*
@@ -90,7 +91,6 @@
  * * I need to know how to interrupt the cpu
  * * Reverb not yet supported
  * * Half speed is not supported
- * * Stereo is not supported
  * * Format AFMT_MU_LAW is still unsupported/untested
  * * Need *BSD patches.  sound.c does not compile properly under FreeBSD.
  * * DMC pops periodically.
@@ -101,12 +101,18 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
+#include <limits.h>
 #include <math.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #ifdef HAVE_MACHINE_ENDIAN_H
 #include <machine/endian.h>
@@ -122,21 +128,21 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-#ifdef HAVE_LINUX_SOUNDCARD_H
-#include <linux/soundcard.h>
-#endif /* HAVE_LINUX_SOUNDCARD_H */
-
-#ifdef HAVE_SYS_SOUNDCARD_H
-#include <sys/soundcard.h>
-#endif /* HAVE_SYS_SOUNDCARD_H */
-
+#include "audio.h"
 #include "consts.h"
+#include "expsound.h"
 #include "globals.h"
+#include "renderer.h"
 #include "sound.h"
+#include "stats.h"
 
 /* local functions */
 
 static char     shift_register15(unsigned char);
+static void     CloseAudio(void);
+#ifdef HAVE_PTHREAD
+static void     StartAudioThread(void);
+#endif
 
 /* global sound parameters */
 struct SoundConfig sound_config = {
@@ -145,31 +151,9 @@ struct SoundConfig sound_config = {
 	.audiostereo = 0,
 	.max_sound_delay = 0.33,
 	.reverb = 0,
+	.bandlimit = 0,
 };
 
-/* sample format numbers */
-#ifndef AFMT_MU_LAW
-#  define AFMT_MU_LAW 1
-#endif
-#ifndef AFMT_U8
-#  define AFMT_U8 8
-#endif
-#ifndef AFMT_S16_LE
-#  define AFMT_S16_LE 16
-#endif
-#ifndef AFMT_S16_BE
-#  define AFMT_S16_BE 32
-#endif
-#ifndef AFMT_S8
-#  define AFMT_S8 64
-#endif
-#ifndef AFMT_U16_LE
-#  define AFMT_U16_LE 128
-#endif
-#ifndef AFMT_U16_BE
-#  define AFMT_U16_BE 256
-#endif
-
 /* the currently selected sample format */
 const struct SampleFormat *sample_format = NULL;
 
@@ -220,6 +204,14 @@ const struct SampleFormat sample_formats[] = {
 #define SAMPLES_PER_SECOND   44100.0f
 #define STEPS_PER_VSYNC      BASE_FREQ
 #define CYCLES_PER_SAMPLE    41 /* 44100Hz */
+#define SND_FRAME            0  /* address of the event ending a frame */
+#define SND_EXPANSION        1  /* address of the event starting the chip */
+#define FRAME_START          (VBL + 7) /* CLOCK when UpdateAudio() is called */
+#define FRAMES_AHEAD         16 /* frames posted but not yet synthesized */
+#define PCM_FRAMES           64 /* frames of samples the audio thread queues */
+#define TARGET_FRAMES        4  /* frames of samples kept queued when pacing */
+#define PACE_AHEAD           2  /* frames posted ahead of the device when pacing */
+#define RATE_ADJUST          0.005 /* most the output rate is nudged by */
 
 /* dmc values - this is in actual cpu time
  * */
@@ -235,8 +227,12 @@ static const unsigned long squ_duty[0x04] = {
 	0x04000000, 0x08000000, 0x10000000, 0x18000000,
 };
 
-static short triangle_50[0x20] = {
-	0 /* these are calculated */
+/* the triangle's 32 steps */
+static const unsigned char triangle_50[0x20] = {
+	0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x6, 0x7,
+	0x8, 0x9, 0xA, 0xB, 0xC, 0xD, 0xE, 0xF,
+	0xF, 0xE, 0xD, 0xC, 0xB, 0xA, 0x9, 0x8,
+	0x7, 0x6, 0x5, 0x4, 0x3, 0x2, 0x1, 0x0,
 };
 
 /* as in NESSOUND.txt */
@@ -258,127 +254,248 @@ static const unsigned short noi_wavelen[0x10] = {
 /* These are the variables for 60, 120, and 240 hz cycles
  * They trigger statements that effect counters in the channels
  * They will be consistent no matter what the update rate is.
+ * These are the reload values; the counters are in struct APUState.
  * */
-static unsigned short hz_60 = 1;
 static unsigned short hz_60_set;
-static unsigned short hz_120;
 static unsigned short hz_120_set;
-static unsigned short hz_240;
 static unsigned short hz_240_set;
 
-static int audiofd = -1;
-static int buf_size;
+static int audio_on = 0;                /* a backend was opened */
 static int sample_format_number;
-static int bytes_per_sample = 1;
-static int signed_samples   = 0;
+static int bytes_per_sample = 1;        /* in all the channels */
+
+/*
+ * When the device can tell how much it has queued, it keeps the time: the
+ * game is held back whenever more than target_fill bytes are queued (see
+ * UpdateAudio()), and each frame is resampled by up to RATE_ADJUST, more
+ * samples when the queue is short of target_fill and fewer when it's over,
+ * so that the device neither runs dry nor has frames dropped for being
+ * too far behind (over max_fill bytes).
+ */
+static int          rate_control = 0;
+static int          paced = 0;          /* the game waits for the device */
+static unsigned int target_fill, max_fill;
 
+/*
+ * Writes to the sound registers, in a ring with one producer (SoundEvent()
+ * and UpdateAudio(), on the emulation thread) and one consumer
+ * (SynthFrame(), on the audio thread if there is one).  Each side only
+ * writes its own index, so the ring needs no lock.
+ */
 static struct snd_event {
 	unsigned long        addr;                /* address of write */
-	unsigned int         count;                /* cycle count */
+	unsigned int         count;                /* CPU cycle in the frame */
 	unsigned char        value;                /* value of write */
 } snd_event_buf[SND_BUF_SIZE];
 
+/*
+ * Frames are numbered from the start; frame n is synthesized from the
+ * writes before its SND_FRAME event, each one just before the first sample
+ * ending after it, and reads DMC samples from frame_banks[n % FRAMES_AHEAD],
+ * the ROM mapped at $8000-$FFFF when it was posted.  The samples only depend
+ * on the writes and the ROM, not on when the frame is synthesized.
+ */
+static unsigned int    frames_posted = 0;
+static unsigned int    frames_done   = 0;
+static unsigned char  *frame_banks[FRAMES_AHEAD][8];
+
 static float         magic_adjust;      /* 44100 / rate */
-static unsigned int  cycles_per_sample;
 static unsigned int  samples_per_vsync;
 static unsigned char *audio_buffer;
 
-static unsigned int   head       = 0;
-static unsigned int   tail       = 0;
-static unsigned short volume_max = 0x78; /* 120 is max */
-static unsigned short volume_adjust = 0x08;
-/* channel enabled */
-static unsigned char sq1_enabled = 0;
-static unsigned char sq2_enabled = 0;
-static unsigned char tri_enabled = 0;
-static unsigned char noi_enabled = 0;
-static unsigned char dmc_enabled = 0;
-/* current position in precalc waves */
-static unsigned long sq1_index    = 0;
-static unsigned long sq2_index    = 0;
-static unsigned long tri_index    = 0;
-static unsigned long noi_index    = 0;
-static unsigned long dmc_index    = 0;
-static unsigned long dmcs_index   = 0;
-/* current position increment in precalculated waves */
-static unsigned long step_sq1    = 0;
-static unsigned long step_sq2    = 0;
-static unsigned long step_tri    = 0;
-static unsigned long step_noi    = 0;
-static unsigned long step_dmc    = 0;
-static unsigned long step_dmcs   = 0;
-/* new pulse variables */
-/* pulse (square) 1 variables */
-static unsigned long  sq1_duty_cycle      = 0; /* 500 */
-static          short wavelen_sq1         = 0;
-static unsigned short sq1_volume_reg      = 0;
-static unsigned short sq1_env_dec_volume  = 0;
-static unsigned char  sq1_len_counter     = 0;
-static unsigned char  sq1_len_cnt_ld_reg  = 0;
-static unsigned char  sq1_env_dec_cycle   = 0;
-static unsigned char  sq1_env_dec_counter = 0;
-static unsigned char  sq1_env_dec_disable = 0;
-static unsigned char  sq1_lcc_disable     = 0;
-static unsigned char  sq1_right_shift     = 0;
-static unsigned char  sq1_inc_dec_wavelen = 0; /* 0 = increase */
-static unsigned char  sq1_sw_counter      = 0;
-static unsigned char  sq1_sw_update_rate  = 0;
-static unsigned char  sq1_sweep_enabled   = 0;
-static unsigned char  sq1_sw_no_carry     = 1;
-/* pulse (square) 2 variables */
-static unsigned long  sq2_duty_cycle      = 0; /* 500 */
-static          short wavelen_sq2         = 0;
-static unsigned short sq2_volume_reg      = 0;
-static unsigned short sq2_env_dec_volume  = 0;
-static unsigned char  sq2_len_counter     = 0;
-static unsigned char  sq2_len_cnt_ld_reg  = 0;
-static unsigned char  sq2_env_dec_cycle   = 0;
-static unsigned char  sq2_env_dec_counter = 0;
-static unsigned char  sq2_env_dec_disable = 0;
-static unsigned char  sq2_lcc_disable     = 0;
-static unsigned char  sq2_right_shift     = 0;
-static unsigned char  sq2_inc_dec_wavelen = 0; /* 0 = increase */
-static unsigned char  sq2_sw_counter      = 0;
-static unsigned char  sq2_sw_update_rate  = 0;
-static unsigned char  sq2_sweep_enabled   = 0;
-static unsigned char  sq2_sw_no_carry     = 1;
-/* triangle variables */
-static unsigned char  tri_lin_counter     = 0;
-static unsigned char  tri_lin_cnt_ld_reg  = 0;
-static unsigned char  tri_lin_cnt_strt    = 0; /* also length counter disable */
-static unsigned char  tri_len_cnt_ld_reg  = 0;
-static unsigned char  tri_len_counter     = 0;
-static unsigned char  tri_mode_count      = 0;
-static unsigned char  tri_will_count      = 0;
-static          short wavelen_tri         = 0;
-static          int   tri_count_delay     = 0; /* hack inspired by nosefart
-                                                  (pez) */
+/*
+ * The APU mixes the squares, and the triangle, noise and DMC (TND), in two
+ * groups, each through a resistor network whose output isn't linear in
+ * its inputs.  The channels add their levels to mix[MIX_PULSE] and, with
+ * the triangle's tripled and the noise's doubled, to mix[MIX_TND]; those
+ * are looked up in the tables to make a frame of 16-bit signed samples,
+ * which is then converted to the output format.  The expansion chip's
+ * channels are added to mix[CH_EXP], which is already in 16-bit samples.
+ *
+ * In stereo, or once a channel is panned, scaled, muted or soloed, each
+ * channel has a buffer of its own instead, and the groups are mixed for
+ * each side with the channels' gains, see MixApart(); route[] tells which
+ * buffer each channel goes to.
+ */
+#define CH_SQ1               0
+#define CH_SQ2               1
+#define CH_TRI               2
+#define CH_NOI               3
+#define CH_DMC               4
+#define CH_EXP               5          /* and on, the chip's channels */
+#define CH_APU               5          /* the APU's channels */
+#define MIX_PULSE            CH_SQ1
+#define MIX_TND              CH_TRI
+#define PULSE_MAX            30         /* 15 + 15 */
+#define TND_MAX              202        /* 3 * 15 + 2 * 15 + 127 */
+#define GAIN_BITS            8          /* the gains are in 1/256 */
+static int           *mix[SOUND_CHANNELS]; /* a frame of levels being mixed */
+static unsigned char  route[SOUND_CHANNELS]; /* buffer in mix[] by channel */
+static int            apart = 0;        /* route[] gives each its own */
+static int            gain[2][SOUND_CHANNELS]; /* left (or mono) and right */
+static int            custom_mix = 0;   /* some gain isn't 1 on either side */
+static unsigned int   muted = 0, soloed = 0; /* channels, by bit */
+static unsigned int   mix_muted = 0, mix_soloed = 0; /* as gain[] has them */
+static int            selected = 0;     /* channel for SoundChannelControl() */
+static int            audio_channels = 1; /* 2 for stereo */
+static short          pulse_table[PULSE_MAX + 1];
+static short          tnd_table[TND_MAX + 1];
+static short         *mixed;            /* a frame of 16-bit samples, after
+                                           the last 3 of the frame before;
+                                           in stereo, left and right */
+static short         *resampled;        /* mixed, at the adjusted rate */
+static const struct ExpansionSound *expansion = NULL; /* the mapper's chip */
+static const struct ExpansionSound *expansion_chip = NULL; /* as posted */
+static int           *expansion_out[SOUND_CHANNELS - CH_EXP]; /* its mix[] */
+static unsigned char *mulaw_table;      /* by 16-bit sample >> 2 */
+
+const char *const sound_channels[] = {
+	"sq1", "sq2", "tri", "noise", "dmc",
+	"exp1", "exp2", "exp3", "exp4", "exp5", "exp6", "exp7", "exp8",
+	0
+};
+
+/* band-limited synthesis, see BlepStep() */
+#define BLEP_PHASES          32 /* times a step can be at between samples */
+#define BLEP_WIDTH           16 /* samples a step is spread over */
+#define BLEP_BITS            12 /* each phase of the kernel adds up to this */
+static short         blep_kernel[BLEP_PHASES][BLEP_WIDTH];
+static int          *blep[CH_APU];      /* the steps in a frame, and after */
+static int           blep_sum[CH_APU];  /* integral of the steps so far */
+static int           blep_level[CH_APU]; /* output of each channel */
+
+static unsigned int   head       = 0;      /* next event to play */
+static unsigned int   tail       = 0;      /* next free slot */
 static          int   tri_count_delay_max = 0;
-/* noise variables */
-static unsigned char  noi_sample_rate     = 0;
-static unsigned char  noi_number_type     = 0;
-static unsigned char  noi_len_counter     = 0;
-static unsigned char  noi_env_dec_cycle   = 0;
-static unsigned char  noi_env_dec_counter = 0;
-static unsigned short noi_env_dec_volume;
-static unsigned short noi_volume_reg      = 0;
-static unsigned char  noi_env_dec_disable = 0;
-static unsigned char  noi_lcc_disable     = 0;
-static unsigned char  noi_len_cnt_ld_reg  = 0;
-static unsigned char  noi_state_reg       = 1;
-/* DMC variables */
 #define DMC_INTERRUPT_FALSE               0x00
 #define DMC_INTERRUPT_TRUE                0x07
-static unsigned short dmc_load_register = 0;
-static unsigned short dmc_dta_ftch_addr = 0;
-static unsigned short dmc_len_freq      = 0;
-static unsigned short dmc_len_counter   = 0;
-static unsigned short dmc_clk_register  = 0;
-static unsigned short dmc_clk_for_fetch = 0;
-static unsigned short dmc_delta         = 0;
-static unsigned char  dmc_interrupt     = DMC_INTERRUPT_FALSE;
-static unsigned char  dmc_gen_interrupt = 0;
-static unsigned char  dmc_loop_sample   = 0;
+
+
+#ifdef HAVE_PTHREAD
+/*
+ * The audio thread synthesizes each frame as soon as UpdateAudio() posts
+ * it, or when pacing, as soon as the device has played down to
+ * target_fill, and queues the samples for the device, which is written to
+ * without blocking whenever it has room.
+ */
+static pthread_t       audio_thread;
+static int             audio_running = 0;
+static int             wakefd[2];           /* UpdateAudio() wakes the thread */
+static pthread_mutex_t frame_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  frame_cond = PTHREAD_COND_INITIALIZER;
+static unsigned char  *pcm;                 /* samples queued for the device */
+static unsigned int    pcm_size, pcm_start, pcm_len;
+#endif
+
+/*
+ * State of the sound channels.  It is all kept in one structure so that
+ * a saved state can copy it in one go, see SoundState().
+ */
+static struct APUState {
+	/* frame counter */
+	unsigned short hz_60;
+	unsigned short hz_120;
+	unsigned short hz_240;
+	/* channel enabled */
+	unsigned char  sq1_enabled;
+	unsigned char  sq2_enabled;
+	unsigned char  tri_enabled;
+	unsigned char  noi_enabled;
+	unsigned char  dmc_enabled;
+	/* current position in precalc waves */
+	unsigned long  sq1_index;
+	unsigned long  sq2_index;
+	unsigned long  tri_index;
+	unsigned long  noi_index;
+	unsigned long  dmc_index;
+	unsigned long  dmcs_index;
+	/* current position increment in precalculated waves */
+	unsigned long  step_sq1;
+	unsigned long  step_sq2;
+	unsigned long  step_tri;
+	unsigned long  step_noi;
+	unsigned long  step_dmc;
+	unsigned long  step_dmcs;
+	/* new pulse variables */
+	/* pulse (square) 1 variables */
+	unsigned long  sq1_duty_cycle; /* 500 */
+	short          wavelen_sq1;
+	unsigned short sq1_volume_reg;
+	unsigned short sq1_env_dec_volume;
+	unsigned char  sq1_len_counter;
+	unsigned char  sq1_len_cnt_ld_reg;
+	unsigned char  sq1_env_dec_cycle;
+	unsigned char  sq1_env_dec_counter;
+	unsigned char  sq1_env_dec_disable;
+	unsigned char  sq1_lcc_disable;
+	unsigned char  sq1_right_shift;
+	unsigned char  sq1_inc_dec_wavelen; /* 0 = increase */
+	unsigned char  sq1_sw_counter;
+	unsigned char  sq1_sw_update_rate;
+	unsigned char  sq1_sweep_enabled;
+	unsigned char  sq1_sw_no_carry;
+	/* pulse (square) 2 variables */
+	unsigned long  sq2_duty_cycle; /* 500 */
+	short          wavelen_sq2;
+	unsigned short sq2_volume_reg;
+	unsigned short sq2_env_dec_volume;
+	unsigned char  sq2_len_counter;
+	unsigned char  sq2_len_cnt_ld_reg;
+	unsigned char  sq2_env_dec_cycle;
+	unsigned char  sq2_env_dec_counter;
+	unsigned char  sq2_env_dec_disable;
+	unsigned char  sq2_lcc_disable;
+	unsigned char  sq2_right_shift;
+	unsigned char  sq2_inc_dec_wavelen; /* 0 = increase */
+	unsigned char  sq2_sw_counter;
+	unsigned char  sq2_sw_update_rate;
+	unsigned char  sq2_sweep_enabled;
+	unsigned char  sq2_sw_no_carry;
+	/* triangle variables */
+	unsigned char  tri_lin_counter;
+	unsigned char  tri_lin_cnt_ld_reg;
+	unsigned char  tri_lin_cnt_strt; /* also length counter disable */
+	unsigned char  tri_len_cnt_ld_reg;
+	unsigned char  tri_len_counter;
+	unsigned char  tri_mode_count;
+	unsigned char  tri_will_count;
+	short          wavelen_tri;
+	int            tri_count_delay; /* hack inspired by nosefart (pez) */
+	/* noise variables */
+	unsigned char  noi_sample_rate;
+	unsigned char  noi_number_type;
+	unsigned char  noi_len_counter;
+	unsigned char  noi_env_dec_cycle;
+	unsigned char  noi_env_dec_counter;
+	unsigned short noi_env_dec_volume;
+	unsigned short noi_volume_reg;
+	unsigned char  noi_env_dec_disable;
+	unsigned char  noi_lcc_disable;
+	unsigned char  noi_len_cnt_ld_reg;
+	unsigned char  noi_state_reg;
+	/* DMC variables */
+	unsigned short dmc_load_register;
+	unsigned short dmc_dta_ftch_addr;
+	unsigned short dmc_len_freq;
+	unsigned short dmc_len_counter;
+	unsigned short dmc_clk_register;
+	unsigned short dmc_clk_for_fetch;
+	unsigned short dmc_delta;
+	unsigned char  dmc_interrupt;
+	unsigned char  dmc_gen_interrupt;
+	unsigned char  dmc_loop_sample;
+	unsigned char  dmc_shiftcnt;
+	unsigned int   noi_shift_reg;  /* see shift_register15() */
+} apu = {
+	.hz_60 = 1,
+	.sq1_sw_no_carry = 1,
+	.sq2_sw_no_carry = 1,
+	.noi_state_reg = 1,
+	.noi_shift_reg = 0x4000,
+	.dmc_load_register = 0xc000, /* as if $4012 were 0 */
+	.dmc_dta_ftch_addr = 0xc000,
+};
+
 /* buffers for frequency calculations.  Total footprint: 2K 32B */
 static unsigned long freq_buffer_squ[2048];
 static unsigned long freq_buffer_tri[2048];
@@ -390,156 +507,268 @@ static unsigned long freq_buffer_dmc[16];
 #define MAGIC_dmc ((unsigned long)0x1FFFFF)
 #define MAGIC_noi ((unsigned long long)0xFFFFFFF)
 
+#ifdef HAVE_LIBM
+/*
+ * The kernel a step is spread over: for each phase, a Blackman-windowed
+ * sinc cutting off a little below the Nyquist frequency, centered
+ * BLEP_WIDTH / 2 - 1 samples after the step and scaled to add up to
+ * exactly 1 << BLEP_BITS, so that the integral settles on the new level.
+ */
+static void
+InitBlep(void)
+{
+	for (int p = 0; p < BLEP_PHASES; p++) {
+		double tap[BLEP_WIDTH], sum = 0;
+		int total = 0, peak = 0;
+
+		for (int i = 0; i < BLEP_WIDTH; i++) {
+			double x = i + 1 - BLEP_WIDTH / 2 - (double)p / BLEP_PHASES;
+			double w = 0.42 + 0.5 * cos(M_PI * x / (BLEP_WIDTH / 2))
+			         + 0.08 * cos(2 * M_PI * x / (BLEP_WIDTH / 2));
+
+			tap[i] = w * (x == 0 ? 1 : sin(0.9 * M_PI * x) / (0.9 * M_PI * x));
+			sum += tap[i];
+		}
+		for (int i = 0; i < BLEP_WIDTH; i++) {
+			blep_kernel[p][i] = lround(tap[i] / sum * (1 << BLEP_BITS));
+			total += blep_kernel[p][i];
+			if (blep_kernel[p][i] > blep_kernel[p][peak])
+				peak = i;
+		}
+		blep_kernel[p][peak] += (1 << BLEP_BITS) - total;
+	}
+}
+#endif /* HAVE_LIBM */
+
+/*
+ * The usual approximation of the APU's mixer (see the NESdev wiki), scaled
+ * so that every channel at its loudest makes peak.
+ */
+static void
+InitMixer(int peak)
+{
+	double scale = peak / (95.52 / (8128.0 / PULSE_MAX + 100)
+	                       + 163.67 / (24329.0 / TND_MAX + 100));
+
+	for (int n = 1; n <= PULSE_MAX; n++)
+		pulse_table[n] = 95.52 / (8128.0 / n + 100) * scale + 0.5;
+	for (int n = 1; n <= TND_MAX; n++)
+		tnd_table[n] = 163.67 / (24329.0 / n + 100) * scale + 0.5;
+
+	/* G.711 mu-law, from the top 14 bits of a sample */
+	if (mulaw_table) {
+		for (int i = 0; i < 0x4000; i++) {
+			int x = (i ^ 0x2000) - 0x2000;  /* sign-extend */
+			int sign = x < 0 ? 0x80 : 0, exp = 7;
+
+			if (x < 0)
+				x = -x;
+			x += 33;
+			if (x > 0x1FFF)
+				x = 0x1FFF;
+			while (exp && !(x & (0x1000 >> (7 - exp))))
+				exp--;
+			mulaw_table[i] = ~(sign | exp << 4 | (x >> (exp + 1) & 0x0F));
+		}
+	}
+}
+
+/*
+ * Work out each channel's gain on either side, from --gain and --pan and
+ * the channels muted and soloed.  A channel is panned by turning the other
+ * side down, so that in the middle it plays as loud as in mono.
+ */
+static void
+SetGains(void)
+{
+	custom_mix = 0;
+	for (int c = 0; c < SOUND_CHANNELS; c++) {
+		float g = sound_config.gain[c];
+		float pan = audio_channels == 2 ? sound_config.pan[c] : 0.0f;
+
+		if ((mix_muted >> c & 1) || (mix_soloed && !(mix_soloed >> c & 1)))
+			g = 0.0f;
+		gain[0][c] = g * (pan > 0.0f ? 1.0f - pan : 1.0f) * (1 << GAIN_BITS) + 0.5f;
+		gain[1][c] = g * (pan < 0.0f ? 1.0f + pan : 1.0f) * (1 << GAIN_BITS) + 0.5f;
+		if (gain[0][c] != 1 << GAIN_BITS || gain[1][c] != 1 << GAIN_BITS)
+			custom_mix = 1;
+	}
+}
+
+/*
+ * Give each channel a buffer of its own, or mix them in groups again.
+ * With --bandlimit, the steps yet to be integrated stay where they are,
+ * and each channel split off starts from the level it is settling on.
+ */
+static void
+Route(int to_apart)
+{
+	static const unsigned char group[CH_APU] = {
+		MIX_PULSE, MIX_PULSE, MIX_TND, MIX_TND, MIX_TND
+	};
+
+	for (int c = 0; c < SOUND_CHANNELS; c++) {
+		int g = c < CH_APU ? group[c] : CH_EXP;
+
+		route[c] = to_apart ? c : g;
+		if (!sound_config.bandlimit || c >= CH_APU || c == g)
+			continue;
+		if (to_apart) {
+			blep_sum[c] = blep_level[c] << BLEP_BITS;
+			blep_sum[g] -= blep_sum[c];
+		} else {
+			blep_sum[g] += blep_sum[c];
+			blep_sum[c] = 0;
+			for (int i = 0; i < BLEP_WIDTH; i++)
+				blep[g][i] += blep[c][i];
+			memset(blep[c], 0, BLEP_WIDTH * sizeof(*blep[c]));
+		}
+	}
+	for (int c = 0; c < SOUND_CHANNELS - CH_EXP; c++)
+		expansion_out[c] = mix[route[CH_EXP + c]];
+	apart = to_apart;
+}
+
+/*
+ * The runtime channel controls: select the next channel, or mute or solo
+ * the selected one.  The synthesis picks up the change at its next frame.
+ */
+void
+SoundChannelControl(int what)
+{
+	int channels = CH_APU + (expansion_chip ? expansion_chip->channels : 0);
+	unsigned int bit;
+
+	if (!audio_on)
+		return;
+	if (what == SOUND_SELECT)
+		selected = (selected + 1) % channels;
+	bit = 1U << selected;
+	if (what == SOUND_MUTE)
+		__atomic_store_n(&muted, muted ^ bit, __ATOMIC_RELAXED);
+	else if (what == SOUND_SOLO)
+		__atomic_store_n(&soloed, soloed ^ bit, __ATOMIC_RELAXED);
+	fprintf(stderr, "Sound: %s%s%s\n", sound_channels[selected],
+	        muted & bit ? ", muted" : "",
+	        soloed & bit ? ", soloed" : "");
+}
+
 int
 InitAudio(void)
 {
+	unsigned int samples;
+	int failed = 0;
+
 	/* Open an audio stream */
 	if (sound_config.audiofile) {
-		if ((audiofd = open(sound_config.audiofile, O_WRONLY | O_APPEND)) < 0) {
-			perror(sound_config.audiofile);
-			return 1;
-		} else {
-			int desired_fragmentsize = 0;
-#ifdef SNDCTL_DSP_RESET
-			if (!ioctl(audiofd, SNDCTL_DSP_RESET)) {
-				const struct SampleFormat *desired_sample_format = sample_format;
-
-				int desired_audiorate = sound_config.audiorate;
-				if (ioctl(audiofd, SNDCTL_DSP_SPEED, &sound_config.audiorate))
-					perror(sound_config.audiofile);
+		const struct SampleFormat *desired_sample_format = sample_format;
 
+		sample_format_number = sample_format->number;
+		if (audio_backend->init(sound_config.audiofile, &sound_config.audiorate,
+		                        &sample_format_number))
+			return 1;
+		audio_on = 1;
 
-				if (sound_config.audiorate != desired_audiorate) {
-					fprintf(stderr, "%s: wanted %d Hz, got %d Hz\n",
-					        sound_config.audiofile,
-					        desired_audiorate,
-					        sound_config.audiorate);
-				}
-				int desired_audiostereo = sound_config.audiostereo;
-				if (desired_audiostereo == 1) {
-					fprintf(stderr, "Stereo desired, but unsupported.  Mono forced. - pez\n");
-					desired_audiostereo = 0;
-				}
-				if (ioctl(audiofd, SNDCTL_DSP_STEREO, &sound_config.audiostereo))
-					perror(sound_config.audiofile);
-				if (sound_config.audiostereo != desired_audiostereo)
-					fprintf(stderr, "%s: wanted %s, got %s (expect failure)\n", sound_config.audiofile,
-					        desired_audiostereo ? "stereo" : "monaural",
-					        sound_config.audiostereo ? "stereo" : "monaural");
-				sample_format_number = sample_format->number;
-				if (ioctl(audiofd, SNDCTL_DSP_SAMPLESIZE, &sample_format_number))
-					perror(sound_config.audiofile);
-
-				/* set bytes_per_sample */
-				if (sample_format_number == AFMT_U16_LE
-				 || sample_format_number == AFMT_U16_BE
-				 || sample_format_number == AFMT_S16_LE
-				 || sample_format_number == AFMT_S16_BE)
-					bytes_per_sample = 2;
-				/* set signed */
-				if (sample_format_number == AFMT_S8
-				 || sample_format_number == AFMT_S16_LE
-				 || sample_format_number == AFMT_S16_BE)
-					signed_samples = 1;
-
-				if (sample_format_number != sample_format->number) {
-					for (sample_format = sample_formats; sample_format->name; sample_format++) {
-						if (sample_format->number == sample_format_number)
-							break;
-					}
-					fprintf(stderr, "%s: wanted %s samples [%d], got %s samples [%d]\n",
-					        sound_config.audiofile,
-					        desired_sample_format->fullname
-					        ? desired_sample_format->fullname
-					        : "(unknown sample format)",
-					        desired_sample_format->number,
-					        sample_format->fullname
-					        ? sample_format->fullname
-					        : "(unknown sample format)",
-					        sample_format_number);
-				}
-			}
-#endif /* SNDCTL_DSP_RESET */
-#ifdef SNDCTL_DSP_SETFRAGMENT
-			/* this is necessary to get the sound out fast enough so that
-			 * the sound is in sync with the game
-			 * for performance issues, I believe a < 1/30 second delay is
-			 * very good, this will be tweaked for optimum performance
-			 */
-			/* using samples_per_vsync as a temp */
-			samples_per_vsync = sound_config.audiorate * bytes_per_sample / 30;
-			while (samples_per_vsync) {
-				++desired_fragmentsize;
-				samples_per_vsync >>= 1;
-			}
-#if 0
-			printf("fs: %u\n", desired_fragmentsize);
-#endif
-			if (ioctl(audiofd, SNDCTL_DSP_SETFRAGMENT, &desired_fragmentsize))
-				perror(sound_config.audiofile);
-			if (verbose) {
-				ioctl(audiofd, SNDCTL_DSP_GETBLKSIZE, &buf_size);
-				fprintf(stderr, "BufSize: %u bytes\n",
-				        (1 << desired_fragmentsize));
+		if (sample_format_number != sample_format->number) {
+			for (sample_format = sample_formats; sample_format->name; sample_format++) {
+				if (sample_format->number == sample_format_number)
+					break;
 			}
-#endif /* SNDCTL_DSP_SETFRAGMENT */
-			if (verbose)
-				fprintf(stderr,
-				        "Appending %d Hz %s samples to %s\n",
-				        sound_config.audiorate,
-				        sample_format->fullname
-				        ? sample_format->fullname
-				        : "(unknown sample format)",
-				        sound_config.audiofile);
+			fprintf(stderr, "%s: wanted %s samples [%d], got %s samples [%d]\n",
+			        sound_config.audiofile,
+			        desired_sample_format->fullname
+			        ? desired_sample_format->fullname
+			        : "(unknown sample format)",
+			        desired_sample_format->number,
+			        sample_format->fullname
+			        ? sample_format->fullname
+			        : "(unknown sample format)",
+			        sample_format_number);
 		}
+		/* set bytes_per_sample */
+		if (sample_format_number == AFMT_U16_LE
+		 || sample_format_number == AFMT_U16_BE
+		 || sample_format_number == AFMT_S16_LE
+		 || sample_format_number == AFMT_S16_BE)
+			bytes_per_sample = 2;
+		if (sound_config.audiostereo)
+			audio_channels = 2;
+		bytes_per_sample *= audio_channels;
+		if (verbose)
+			fprintf(stderr,
+			        "[%s] Writing %d Hz %s %s samples to %s\n",
+			        audio_backend->name,
+			        sound_config.audiorate,
+			        audio_channels == 2 ? "stereo" : "mono",
+			        sample_format->fullname
+			        ? sample_format->fullname
+			        : "(unknown sample format)",
+			        sound_config.audiofile);
 	}
 
-
-
 	/* set up sound buffer */
 	magic_adjust = SAMPLES_PER_SECOND / sound_config.audiorate;
-	cycles_per_sample = (STEPS_PER_VSYNC * UPDATE_FREQ)/ sound_config.audiorate;
 	samples_per_vsync = sound_config.audiorate * bytes_per_sample / UPDATE_FREQ;
-	audio_buffer = malloc(samples_per_vsync);
-
-	if (audio_buffer == NULL) {
+	samples = samples_per_vsync / bytes_per_sample;
+	rate_control = audio_on && audio_backend->latency() >= 0;
+	if (rate_control)
+		samples += samples / 64 + 4;    /* room for the resampled frame */
+	audio_buffer = malloc(samples * bytes_per_sample);
+	for (int c = 0; c < SOUND_CHANNELS; c++) {
+		if (!(mix[c] = malloc(samples_per_vsync / bytes_per_sample
+		                      * sizeof(*mix[c]))))
+			failed = 1;
+	}
+	for (int c = 0; c < CH_APU; c++) {
+		if (!(blep[c] = calloc(samples_per_vsync / bytes_per_sample + BLEP_WIDTH,
+		                       sizeof(*blep[c]))))
+			failed = 1;
+	}
+	mixed = calloc((samples_per_vsync / bytes_per_sample + 3) * audio_channels,
+	               sizeof(*mixed));
+	resampled = malloc(samples * audio_channels * sizeof(*resampled));
+	if (sample_format_number == AFMT_MU_LAW)
+		mulaw_table = malloc(0x4000);
+
+	if (failed || audio_buffer == NULL || mixed == NULL || resampled == NULL
+	 || (sample_format_number == AFMT_MU_LAW && mulaw_table == NULL)) {
 		fprintf(stderr, "Error allocating sound buffer.");
-		audiofd = -1;
+		if (audio_on)
+			audio_backend->close();
+		audio_on = 0;
 		return 1;
 	}
-	memset(audio_buffer, 0, samples_per_vsync);
-
-	/* set up the triangle precalc
-	 * triangle_50[0] stays 0, don't change it
-	 * */
-	for (int i = 1; i < 32; ++i) {
-		if (i < 16) {
-			triangle_50[i] = (volume_adjust) * i;
-		} else {
-			triangle_50[i] = triangle_50[31 - i];
-		}
-#if 0
-		fprintf(stderr, "Test(0x%X): 0x%X\n", i, triangle_50[i]);
+	memset(audio_buffer, 0, samples * bytes_per_sample);
+	mixed += 3 * audio_channels;
+	InitMixer(32767);
+	SetGains();
+	Route(0);
+	muted = sound_config.mute;
+	soloed = sound_config.solo;
+
+	max_fill = sound_config.max_sound_delay > 0.0
+	         ? sound_config.max_sound_delay * sound_config.audiorate
+	           * bytes_per_sample
+	         : UINT_MAX;
+	target_fill = TARGET_FRAMES * samples_per_vsync;
+	if (target_fill > max_fill / 2)
+		target_fill = max_fill / 2;
+	if (verbose && rate_control)
+		fprintf(stderr, "Pacing the game by the sound device, %.3f sec ahead\n",
+		        target_fill * 1.0 / (sound_config.audiorate * bytes_per_sample));
+#ifdef HAVE_LIBM
+	if (sound_config.bandlimit)
+		InitBlep();
 #endif
-	}
 
-	/* adjust the values if bytes_per_sample != 1 */
-	if (bytes_per_sample != 1) {
-		volume_max    |= (volume_max << 8);
-		volume_adjust |= (volume_adjust << 8);
-		/* adjust the triangle */
-		for (int i = 1; i < 32; ++i) {
-			triangle_50[i] |= (triangle_50[i] << 8);
-		}
-	}
 	/* set up initial values */
-	sq1_duty_cycle = squ_duty[1]; /* 50/50 is the default */
-	sq2_duty_cycle = squ_duty[1];
-	sq1_env_dec_volume =
-	sq2_env_dec_volume =
-	noi_env_dec_volume = volume_max;
+	apu.sq1_duty_cycle = squ_duty[1]; /* 50/50 is the default */
+	apu.sq2_duty_cycle = squ_duty[1];
+	apu.sq1_env_dec_volume =
+	apu.sq2_env_dec_volume =
+	apu.noi_env_dec_volume = 0x0F;
 
-	/* hz_60 is already set
+	/* apu.hz_60 is already set
 	 * these must be set to the default value, +1 so the first decrement
 	 * happens properly
 	 * */
@@ -555,30 +784,299 @@ InitAudio(void)
 
 	/* set up triangle stuff */
 	tri_count_delay_max = (CYCLES_PER_SAMPLE * magic_adjust * samples_per_vsync
-	                         / 2); /* wait a half frame */
+	                         / audio_channels / 2); /* wait a half frame */
 
+	if (audio_on) {
+#ifdef HAVE_PTHREAD
+		StartAudioThread();
+#endif
+		atexit(CloseAudio);
+	}
 	return 0;
 }
 
-
+/*
+ * Called by the mapper before each write to its sound chip's registers,
+ * rather than when it is set up, since most boards with the mapper leave
+ * the chip out (or, like the FME-7, have a version without it).  The
+ * first call posts an event, so that the audio thread starts the chip at
+ * that write, see StartExpansion().
+ */
 void
-SoundEvent(long addr, unsigned char value)
+SoundExpansion(const struct ExpansionSound *chip)
+{
+	if (!audio_on || expansion_chip)
+		return;
+	expansion_chip = chip;
+	SoundEvent(SND_EXPANSION, 0);
+}
+
+/* Start the chip posted by SoundExpansion(); the APU is turned down to
+   leave room for its output */
+static void
+StartExpansion(void)
+{
+	unsigned int samples = samples_per_vsync / bytes_per_sample;
+	const struct ExpansionSound *chip = expansion_chip;
+	int scale = 65536.0 * 32767 / (32767 + chip->peak);
+
+	if (expansion)
+		return;
+	InitMixer(32767LL * scale >> 16);
+	chip->init(CPF * 65536ULL / samples, scale);
+	/* the frame being synthesized didn't clear the chip's buffers */
+	for (int c = CH_EXP; c < CH_EXP + chip->channels; c++) {
+		if (route[c] == c)
+			memset(mix[c], 0, samples * sizeof(*mix[c]));
+	}
+	expansion = chip;
+	if (verbose)
+		fprintf(stderr, "Mixing in the %s sound channels\n", chip->name);
+}
+
+/* The CPU cycle in the frame, counted from FRAME_START */
+static inline unsigned int
+frame_cycle(void)
 {
-	snd_event_buf[tail].count = CLOCK;
+	return CLOCK >= FRAME_START ? CLOCK - FRAME_START : CLOCK + CPF - FRAME_START;
+}
+
+/*
+ * What a $4015 read returns is worked out on the emulation thread, from the
+ * writes as they are made, rather than read from apu, which belongs to the
+ * audio thread and is up to FRAMES_AHEAD frames behind.  It follows the
+ * same rules as the channels: the length counters are clocked once a frame,
+ * and the DMC fetches a byte every dmc_samples_wait[] CPU cycles.
+ */
+static struct {
+	unsigned char  enabled;         /* $4015 bits 0-4 */
+	unsigned char  halt;            /* channels whose length isn't counted */
+	unsigned char  length[4];       /* squares, triangle, noise */
+	unsigned char  dmc_loop;
+	unsigned char  dmc_irq;         /* the sample ends with an interrupt */
+	unsigned char  dmc_interrupt;
+	unsigned int   dmc_len;         /* $4013, in bytes */
+	unsigned int   dmc_left;        /* bytes still to fetch */
+	unsigned int   dmc_wait;        /* CPU cycles per byte, 0 until $4010 */
+	unsigned int   dmc_count;       /* cycle in the frame counted up to */
+	unsigned int   dmc_spent;       /* cycles since the last fetch */
+} status;
+
+/* Count the DMC's fetches up to a cycle in the frame */
+static void
+StatusDMC(unsigned int count)
+{
+	unsigned int cycles = count > status.dmc_count ? count - status.dmc_count : 0;
+
+	status.dmc_count = count;
+	if (!(status.enabled & 0x10) || !status.dmc_left || !status.dmc_wait)
+		return;
+	status.dmc_spent += cycles;
+	while (status.dmc_left && status.dmc_spent >= status.dmc_wait) {
+		status.dmc_spent -= status.dmc_wait;
+		if (--status.dmc_left)
+			continue;
+		if (status.dmc_loop)
+			status.dmc_left = status.dmc_len;
+		else if (status.dmc_irq)
+			status.dmc_interrupt = DMC_INTERRUPT_TRUE;
+	}
+	/* the next sample starts from its first byte */
+	if (!status.dmc_left)
+		status.dmc_spent = 0;
+}
+
+/* A sound register was written */
+static void
+StatusWrite(long addr, unsigned char value)
+{
+	int c = (addr - 0x4000) >> 2;
+
+	StatusDMC(frame_cycle());
+	switch (addr) {
+		case 0x4000: case 0x4004: case 0x400C:
+			status.halt = (status.halt & ~(1 << c)) | (value & 0x20 ? 1 << c : 0);
+			break;
+		case 0x4008:
+			status.halt = (status.halt & ~(1 << c)) | (value & 0x80 ? 1 << c : 0);
+			break;
+		case 0x4003: case 0x4007: case 0x400B: case 0x400F:
+			status.length[c] = length_precalc[value >> 3];
+			break;
+		case 0x4010:
+			status.dmc_loop = value & 0x40;
+			status.dmc_irq = status.dmc_loop ? 0 : value & 0x80;
+			if (!status.dmc_irq)
+				status.dmc_interrupt = DMC_INTERRUPT_FALSE;
+			status.dmc_wait = dmc_samples_wait[value & 0x0F];
+			break;
+		case 0x4013:
+			status.dmc_left =
+			status.dmc_len  = value << 4;
+			break;
+		case 0x4015:
+			status.enabled = value & 0x1F;
+			for (c = 0; c < 4; c++) {
+				if (!(value & 1 << c))
+					status.length[c] = 0;
+			}
+			status.dmc_interrupt = DMC_INTERRUPT_FALSE;
+			break;
+	}
+}
+
+/* The frame is over: clock the length counters */
+static void
+StatusFrame(void)
+{
+	StatusDMC(CPF);
+	status.dmc_count = 0;
+	for (int c = 0; c < 4; c++) {
+		if (!(status.halt & 1 << c) && status.length[c])
+			--status.length[c];
+	}
+}
+
+static inline unsigned int
+next_event(unsigned int i)
+{
+	return i + 1 == SND_BUF_SIZE ? 0 : i + 1;
+}
+
+/*
+ * Wait for the audio thread to move head on; returns 0 if it won't, because
+ * it has played every frame posted
+ */
+static int
+WaitHead(void)
+{
+#ifdef HAVE_PTHREAD
+	unsigned int h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+	if (!audio_running)
+		return 0;
+	pthread_mutex_lock(&frame_lock);
+	while (__atomic_load_n(&head, __ATOMIC_ACQUIRE) == h
+	    && frames_done != frames_posted)
+		pthread_cond_wait(&frame_cond, &frame_lock);
+	pthread_mutex_unlock(&frame_lock);
+	return __atomic_load_n(&head, __ATOMIC_ACQUIRE) != h;
+#else
+	return 0;
+#endif
+}
+
+/* Add an event to the ring, leaving the last slot for the end of a frame */
+static int
+PostEvent(long addr, unsigned char value)
+{
+	unsigned int n = next_event(tail);
+	unsigned int h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+	if (n == h || (addr != SND_FRAME && next_event(n) == h))
+		return 0;
+	if ((n + SND_BUF_SIZE - h) % SND_BUF_SIZE > audio_stats.events_max)
+		__atomic_store_n(&audio_stats.events_max,
+		                 (n + SND_BUF_SIZE - h) % SND_BUF_SIZE, __ATOMIC_RELAXED);
+	snd_event_buf[tail].count = frame_cycle();
 	snd_event_buf[tail].addr = addr;
 	snd_event_buf[tail].value = value;
-	if (++tail == SND_BUF_SIZE) tail = 0;
+	__atomic_store_n(&tail, n, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void
+SoundEvent(long addr, unsigned char value)
+{
+	StatusWrite(addr, value);
+	if (!audio_on)
+		return;
+	if (PostEvent(addr, value))
+		return;
+	/*
+	 * The ring is full: wait for the audio thread to play frames and free
+	 * their slots.  A write is only dropped if it still doesn't fit once
+	 * the thread has caught up, when the frame being built has filled the
+	 * ring by itself, just as it would without the thread.
+	 */
+	__atomic_fetch_add(&audio_stats.events_full, 1, __ATOMIC_RELAXED);
+	do {
+		if (!WaitHead()) {
+			__atomic_fetch_add(&audio_stats.events_dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while (!PostEvent(addr, value));
+}
+
+/*
+ * Wait until the audio thread has played every frame posted, so that the
+ * channels are as they were at the last vertical blank, and stay so until
+ * the next UpdateAudio().
+ */
+void
+SoundSync(void)
+{
+#ifdef HAVE_PTHREAD
+	if (!audio_running)
+		return;
+	pthread_mutex_lock(&frame_lock);
+	while (frames_done != frames_posted)
+		pthread_cond_wait(&frame_cond, &frame_lock);
+	pthread_mutex_unlock(&frame_lock);
+#endif
+}
+
+/* The state of the sound channels, for saved states */
+void *
+SoundState(unsigned int *size)
+{
+	*size = sizeof(apu);
+	return &apu;
+}
+
+/* A saved state was loaded (after SoundSync()): forget the writes not
+   played yet, and take the $4015 status from the channels */
+void
+SoundStateLoaded(void)
+{
+	__atomic_store_n(&head, tail, __ATOMIC_RELEASE);
+	if (expansion_chip)
+		PostEvent(SND_EXPANSION, 0);    /* in case it was forgotten */
+	status.enabled = (apu.sq1_enabled ? 0x01 : 0x00)
+	               | (apu.sq2_enabled ? 0x02 : 0x00)
+	               | (apu.tri_enabled ? 0x04 : 0x00)
+	               | (apu.noi_enabled ? 0x08 : 0x00)
+	               | (apu.dmc_enabled ? 0x10 : 0x00);
+	status.halt = (apu.sq1_lcc_disable  ? 0x01 : 0x00)
+	            | (apu.sq2_lcc_disable  ? 0x02 : 0x00)
+	            | (apu.tri_lin_cnt_strt ? 0x04 : 0x00)
+	            | (apu.noi_lcc_disable  ? 0x08 : 0x00);
+	status.length[0] = apu.sq1_len_counter;
+	status.length[1] = apu.sq2_len_counter;
+	status.length[2] = apu.tri_len_counter;
+	status.length[3] = apu.noi_len_counter;
+	status.dmc_loop = apu.dmc_loop_sample;
+	status.dmc_irq = apu.dmc_gen_interrupt;
+	status.dmc_interrupt = apu.dmc_interrupt;
+	status.dmc_len = apu.dmc_len_freq;
+	status.dmc_left = apu.dmc_len_counter;
+	status.dmc_wait = apu.dmc_clk_register;
+	status.dmc_count = frame_cycle();
+	status.dmc_spent = 0;
 }
 
 unsigned char
 SoundGetLengthReg(void)
 {
-	return (sq1_enabled && sq1_len_counter ? 0x01 : 0x00)
-	     | (sq2_enabled && sq2_len_counter ? 0x02 : 0x00)
-	     | (tri_enabled && tri_len_counter ? 0x04 : 0x00)
-	     | (noi_enabled && noi_len_counter ? 0x08 : 0x00)
-	     | (dmc_len_counter ? 0x10 : 0x00)
-	     |  dmc_interrupt;
+	unsigned char val;
+
+	StatusDMC(frame_cycle());
+	val = status.dmc_interrupt;
+	for (int c = 0; c < 4; c++) {
+		if (status.enabled & 1 << c && status.length[c])
+			val |= 1 << c;
+	}
+	return val | (status.dmc_left ? 0x10 : 0x00);
 }
 
 
@@ -591,112 +1089,884 @@ SoundGetLengthReg(void)
 static inline char
 shift_register15(unsigned char xor_tap)
 {
-	static unsigned int sreg = 0x4000;
 	int bit0, tap, bit14;
-	bit0 = sreg & 1;
-	tap = (sreg & xor_tap) ? 1 : 0;
+	bit0 = apu.noi_shift_reg & 1;
+	tap = (apu.noi_shift_reg & xor_tap) ? 1 : 0;
 	bit14 = (bit0 ^ tap);
-	sreg >>= 1;
-	sreg |= (bit14 << 14);
+	apu.noi_shift_reg >>= 1;
+	apu.noi_shift_reg |= (bit14 << 14);
 	return bit0 ^ 1;
 }
 
-void
-UpdateAudio(void) /* called freq times a sec */
-{
-	/* #define is faster than assigning to a var */
+/* #define is faster than assigning to a var */
 #define CUR_EVENT snd_event_buf[head]
-	         long  samp_temp;
-	unsigned int   count = 0;
-	unsigned int   sample = 0;
-	unsigned char  dmc_shift = 0;
-	static   unsigned char dmc_shiftcnt = 0;
-	static   unsigned char skip_count = 0;
 
-	if (audiofd < 0)
+/* Apply the write at the head of the event ring to the channels */
+static void
+ApplyEvent(void)
+{
+	switch (CUR_EVENT.addr) {
+		/* pulse one */
+		case 0x4000:
+			apu.sq1_env_dec_disable = (CUR_EVENT.value & 0x10);
+			apu.sq1_lcc_disable = (CUR_EVENT.value & 0x20);
+			apu.sq1_duty_cycle = squ_duty[(CUR_EVENT.value >> 6)];
+			if (apu.sq1_env_dec_disable) {
+				apu.sq1_env_dec_volume =
+				apu.sq1_volume_reg = CUR_EVENT.value & 0x0F;
+			} else {
+				apu.sq1_env_dec_counter =
+				apu.sq1_env_dec_cycle = (CUR_EVENT.value & 0x0F) + 1;
+			}
+			break;
+
+		case 0x4001:
+			apu.sq1_right_shift = (CUR_EVENT.value & 0x07);
+			apu.sq1_inc_dec_wavelen = (CUR_EVENT.value & 0x08);
+			apu.sq1_sw_counter =
+			apu.sq1_sw_update_rate  = ((CUR_EVENT.value >> 4) & 0x07) + 1;
+			apu.sq1_sweep_enabled   = (CUR_EVENT.value & 0x80);
+			apu.sq1_sw_no_carry = 1;
+			break;
+
+		case 0x4002:
+			apu.wavelen_sq1 = ((apu.wavelen_sq1 & 0x0700) | CUR_EVENT.value);
+			apu.sq1_sw_no_carry = 1;
+			apu.step_sq1 = freq_buffer_squ[apu.wavelen_sq1];
+			break;
+
+		case 0x4003:
+			apu.wavelen_sq1 = ((apu.wavelen_sq1 & 0x00FF) | ((CUR_EVENT.value & 0x07) << 8));
+			apu.sq1_sw_no_carry = 1;
+			apu.sq1_len_cnt_ld_reg = (CUR_EVENT.value >> 3);
+			apu.sq1_len_counter = length_precalc[ apu.sq1_len_cnt_ld_reg ];
+			apu.sq1_env_dec_volume = 0x0F;
+			apu.step_sq1 = freq_buffer_squ[apu.wavelen_sq1];
+			break;
+
+		/* pulse two */
+		case 0x4004:
+			apu.sq2_env_dec_disable = (CUR_EVENT.value & 0x10);
+			apu.sq2_lcc_disable = (CUR_EVENT.value & 0x20);
+			apu.sq2_duty_cycle  = squ_duty[(CUR_EVENT.value >> 6)];
+			if (apu.sq2_env_dec_disable) {
+				apu.sq2_env_dec_volume =
+				apu.sq2_volume_reg = CUR_EVENT.value & 0x0F;
+			} else {
+				apu.sq2_env_dec_counter =
+				apu.sq2_env_dec_cycle = (CUR_EVENT.value & 0x0F) + 1;
+			}
+			break;
+
+		case 0x4005:
+			apu.sq2_right_shift = (CUR_EVENT.value & 0x07);
+			apu.sq2_inc_dec_wavelen = (CUR_EVENT.value & 0x08);
+			apu.sq2_sw_counter =
+			apu.sq2_sw_update_rate  = ((CUR_EVENT.value >> 4) & 0x07) + 1;
+			apu.sq2_sweep_enabled   = (CUR_EVENT.value & 0x80);
+			apu.sq2_sw_no_carry = 1;
+			break;
+
+		case 0x4006:
+			apu.wavelen_sq2 = ((apu.wavelen_sq2 & 0x0700) | CUR_EVENT.value);
+			apu.sq2_sw_no_carry = 1;
+			apu.step_sq2 = freq_buffer_squ[apu.wavelen_sq2];
+			break;
+
+		case 0x4007:
+			apu.wavelen_sq2 = ((apu.wavelen_sq2 & 0x00FF) | ((CUR_EVENT.value & 0x07) << 8));
+			apu.sq2_len_cnt_ld_reg = (CUR_EVENT.value >> 3);
+			apu.sq2_len_counter = length_precalc[ apu.sq2_len_cnt_ld_reg ];
+			apu.sq2_env_dec_volume = 0x0F;
+			apu.sq2_sw_no_carry = 1;
+			apu.step_sq2 = freq_buffer_squ[apu.wavelen_sq2];
+			break;
+
+		/* triangle channel */
+		case 0x4008:
+			apu.tri_lin_cnt_ld_reg = (CUR_EVENT.value & 0x7F);
+			if (!apu.tri_mode_count) {
+				apu.tri_lin_counter = apu.tri_lin_cnt_ld_reg;
+			}
+
+			if (apu.tri_lin_cnt_strt == 0) {
+				apu.tri_mode_count = 1;
+				apu.tri_will_count = /* save a write later */
+				apu.tri_count_delay = 0;
+
+			} else {
+				if (!(CUR_EVENT.value & 0x80)) {
+					apu.tri_will_count = 1;
+					apu.tri_count_delay = tri_count_delay_max;
+				} else {
+					apu.tri_will_count =
+					apu.tri_count_delay = 0;
+				}
+			}
+			apu.tri_lin_cnt_strt = (CUR_EVENT.value & 0x80);
+			break;
+		case 0x4009: /* unused, don't waste cycles on it */
+			break;
+		case 0x400A:
+			apu.wavelen_tri = ((apu.wavelen_tri & 0x0700) | CUR_EVENT.value);
+			apu.step_tri = freq_buffer_tri[apu.wavelen_tri];
+			break;
+		case 0x400B:
+			apu.wavelen_tri = ((apu.wavelen_tri & 0x00FF) | ((CUR_EVENT.value & 0x07) << 8));
+			apu.tri_len_cnt_ld_reg = CUR_EVENT.value >> 3;
+			apu.tri_len_counter = length_precalc[ apu.tri_len_cnt_ld_reg ];
+
+			if (apu.tri_lin_cnt_strt) {
+				apu.tri_will_count =
+				apu.tri_count_delay = 0;
+			} else {
+				apu.tri_will_count = 1;
+				apu.tri_count_delay = tri_count_delay_max;
+			}
+			apu.tri_mode_count = 0;
+			apu.tri_lin_counter = apu.tri_lin_cnt_ld_reg;
+			apu.step_tri = freq_buffer_tri[apu.wavelen_tri];
+			break;
+
+		/* Noise Channel */
+		case 0x400C:
+			apu.noi_env_dec_disable = (CUR_EVENT.value & 0x10);
+			apu.noi_lcc_disable = (CUR_EVENT.value & 0x20);
+			if (apu.noi_env_dec_disable) {
+				apu.noi_env_dec_volume =
+				apu.noi_volume_reg = CUR_EVENT.value & 0x0F;
+			} else {
+				apu.noi_env_dec_counter =
+				apu.noi_env_dec_cycle = (CUR_EVENT.value & 0x0F) + 1;
+			}
+			break;
+		case 0x400D:
+			/* unused, don't waste cycles */
+			break;
+		case 0x400E:
+			apu.noi_sample_rate = (CUR_EVENT.value & 0x0F);
+			apu.noi_number_type = (CUR_EVENT.value & 0x80);
+			if (freq_buffer_noi[apu.noi_sample_rate] == 0) {
+				freq_buffer_noi[apu.noi_sample_rate] =
+				    (MAGIC_noi * CYCLES_PER_SAMPLE * magic_adjust) /
+				    noi_wavelen[apu.noi_sample_rate];
+			}
+			apu.step_noi = freq_buffer_noi[apu.noi_sample_rate];
+			break;
+		case 0x400F:
+			apu.noi_len_cnt_ld_reg = (CUR_EVENT.value >> 3);
+			apu.noi_len_counter = length_precalc[ apu.noi_len_cnt_ld_reg ];
+			apu.noi_env_dec_volume = 0x0F;
+			break;
+
+		/* DMC channel */
+		case 0x4010:
+			apu.dmc_loop_sample   = (CUR_EVENT.value & 0x40);
+			apu.dmc_gen_interrupt = (apu.dmc_loop_sample ? 0 : CUR_EVENT.value & 0x80);
+			if (!apu.dmc_gen_interrupt)
+				apu.dmc_interrupt = DMC_INTERRUPT_FALSE;
+
+			apu.dmc_clk_for_fetch = 1;
+			apu.dmc_clk_register  = dmc_samples_wait[(CUR_EVENT.value & 0x0F)];
+			if (freq_buffer_dmc[(CUR_EVENT.value & 0x0F)] == 0) {
+				freq_buffer_dmc[(CUR_EVENT.value & 0x0F)] =
+				    (MAGIC_dmc * CYCLES_PER_SAMPLE * magic_adjust) /
+				    dmc_samples_wait[(CUR_EVENT.value & 0x0F)];
+			}
+			apu.step_dmc = freq_buffer_dmc[(CUR_EVENT.value & 0x0F)];
+			apu.step_dmcs = apu.step_dmc << 3; /* shift count is 8x freq */
+			break;
+		case 0x4011:
+			apu.dmc_delta = ((CUR_EVENT.value & 0x7E) >> 1);
+			break;
+		case 0x4012:
+			apu.dmc_dta_ftch_addr =
+			apu.dmc_load_register = (CUR_EVENT.value << 6) | 0xc000;
+			break;
+		case 0x4013: /* length is in bytes */
+			apu.dmc_len_counter =
+			apu.dmc_len_freq    = (CUR_EVENT.value << 4);
+			break;
+		case 0x4015: /* write = channel enable */
+			apu.sq1_enabled = CUR_EVENT.value & 0x01;
+			apu.sq2_enabled = CUR_EVENT.value & 0x02;
+			apu.tri_enabled = CUR_EVENT.value & 0x04;
+			apu.noi_enabled = CUR_EVENT.value & 0x08;
+			apu.dmc_enabled = CUR_EVENT.value & 0x10;
+			if (!apu.sq1_enabled) {
+				apu.sq1_len_counter = 0;
+			}
+
+			if (!apu.sq2_enabled) {
+				apu.sq2_len_counter = 0;
+			}
+
+			if (!apu.tri_enabled) {
+				apu.tri_len_counter = 0;
+			}
+
+			if (!apu.noi_enabled) {
+				apu.noi_len_counter = 0;
+			}
+			apu.dmc_interrupt = DMC_INTERRUPT_FALSE;
+			break;
+		case SND_EXPANSION:
+			StartExpansion();
+			break;
+		/* default = the expansion chip's */
+		default:
+			if (expansion)
+				expansion->write(CUR_EVENT.addr, CUR_EVENT.value);
+			else if (verbose)
+				fprintf(stderr, "Sound Write: 0x%lX (0x%X)\n",
+				        CUR_EVENT.addr, CUR_EVENT.value);
+	}
+}
+
+/* The sample of a frame of samples before which a write at count is made */
+static inline unsigned int
+event_sample(unsigned int count, unsigned int samples)
+{
+	unsigned int i = count * samples / CPF;
+
+	while ((i + 1) * CPF / samples <= count)
+		++i;
+	return i;
+}
+
+/*
+ * The channels are rendered a span of samples at a time, between the
+ * writes and the ticks of the 60/120/240 Hz counters, during which their
+ * registers don't change.  Each channel either adds its level for samples
+ * start to start + n - 1 to its group in mix[], or, with --bandlimit,
+ * records each change of its level in the group's blep[] as a band-limited
+ * step at the exact time of the change, see BlepStep().
+ */
+
+/* Add a step of delta at t, in 1/BLEP_PHASES of a sample into the frame */
+static inline void
+BlepStep(int *buf, unsigned long long t, int delta)
+{
+	const short *kernel = blep_kernel[t % BLEP_PHASES];
+	int *out = buf + t / BLEP_PHASES;
+
+	for (int i = 0; i < BLEP_WIDTH; i++)
+		out[i] += delta * kernel[i];
+}
+
+/* Channel ch outputs level from t on */
+static inline void
+BlepLevel(int ch, unsigned long long t, int level)
+{
+	if (level != blep_level[ch]) {
+		BlepStep(blep[route[ch]], t, level - blep_level[ch]);
+		blep_level[ch] = level;
+	}
+}
+
+/*
+ * The time, from the start of the span, at which an index going up by step
+ * a sample has gone up by e.  Sample i of the span is taken after it has
+ * gone up by (i + 1) * step, at time i + 1.
+ */
+#define BLEP_TIME(start, e, step) \
+	((unsigned long long)(start) * BLEP_PHASES + (e) * BLEP_PHASES / (step))
+
+/*
+ * A square channel; on is whether it is sounding, returns the new index.
+ * Once it is turned off, it finishes its current cycle.
+ */
+static unsigned long
+RenderSquare(int ch, unsigned int start, unsigned int n, int on,
+             unsigned long index, unsigned long step, unsigned long duty,
+             int volume)
+{
+	unsigned int i = 0;
+
+	if (sound_config.bandlimit) {
+		unsigned long long span = (unsigned long long)n * step, e = 0;
+		unsigned long first = index;
+
+		if (!on && index <= step) {
+			BlepLevel(ch, (unsigned long long)start * BLEP_PHASES, 0);
+			return index;
+		}
+		BlepLevel(ch, (unsigned long long)start * BLEP_PHASES,
+		          index <= duty ? volume : 0);
+		/* step from edge to edge */
+		for (;;) {
+			unsigned long long d = index <= duty ? duty + 1 - index
+			                                     : 0x20000000 - index;
+
+			if (e + d > span)
+				break;
+			e += d;
+			if (index <= duty) {
+				index = duty + 1;
+				BlepLevel(ch, BLEP_TIME(start, e, step), 0);
+			} else if (on) {
+				index = 0;
+				BlepLevel(ch, BLEP_TIME(start, e, step), volume);
+			} else {
+				BlepLevel(ch, BLEP_TIME(start, e, step), 0);
+				/* stop at the first sample of the next cycle */
+				return (first + (e + step - 1) / step * step) & 0x1FFFFFFF;
+			}
+		}
+		return (first + span) & 0x1FFFFFFF;
+	}
+
+	int *out = mix[route[ch]] + start;
+	if (!on) {
+		/* finish the current cycle */
+		for (; i < n && index > step; i++) {
+			index = (index + step) & 0x1FFFFFFF; /* fast modulus of a power of 2 */
+			out[i] += index <= duty ? volume : 0;
+		}
+		return index;
+	}
+	for (; i < n; i++) {
+		index = (index + step) & 0x1FFFFFFF;
+		out[i] += index <= duty ? volume : 0;
+	}
+	return index;
+}
+
+/* A run of the triangle channel, during which its counters don't change */
+static unsigned long
+RenderTriangleRun(unsigned int start, unsigned int n, int on,
+                  unsigned long index, unsigned long step)
+{
+	unsigned int i = 0;
+
+	if (sound_config.bandlimit && step < 1 << 26) {
+		unsigned long long span = (unsigned long long)n * step, e = 0;
+		unsigned long first = index;
+
+		if (!on && index <= step) {
+			BlepLevel(CH_TRI, (unsigned long long)start * BLEP_PHASES, 0);
+			return index;
+		}
+		BlepLevel(CH_TRI, (unsigned long long)start * BLEP_PHASES,
+		          3 * triangle_50[index >> 24]);
+		/* step from stair to stair */
+		for (;;) {
+			unsigned long long d = (1 << 24) - (index & ((1 << 24) - 1));
+
+			if (e + d > span)
+				break;
+			e += d;
+			index = (index + d) & 0x1FFFFFFF;
+			BlepLevel(CH_TRI, BLEP_TIME(start, e, step),
+			          3 * triangle_50[index >> 24]);
+			if (!on && !index)
+				return (first + (e + step - 1) / step * step) & 0x1FFFFFFF;
+		}
+		return (first + span) & 0x1FFFFFFF;
+	} else if (sound_config.bandlimit) {
+		/* more than four stairs a sample: just band-limit the samples */
+		for (; i < n && (on || index > step); i++) {
+			index = (index + step) & 0x1FFFFFFF;
+			BlepLevel(CH_TRI, (start + i + 1ULL) * BLEP_PHASES,
+			          3 * triangle_50[index >> 24]);
+		}
+		if (i < n)
+			BlepLevel(CH_TRI, (start + i + 1ULL) * BLEP_PHASES, 0);
+		return index;
+	}
+
+	int *out = mix[MIX_TND] + start;
+	if (on) {
+		for (; i < n; i++) {
+			index = (index + step) & 0x1FFFFFFF;
+			out[i] += 3 * triangle_50[index >> 24];
+		}
+	} else {
+		/* finish the current cycle */
+		for (; i < n && index > step; i++) {
+			index = (index + step) & 0x1FFFFFFF;
+			out[i] += 3 * triangle_50[index >> 24];
+		}
+	}
+	return index;
+}
+
+static void
+RenderTriangle(unsigned int start, unsigned int n)
+{
+	while (n) {
+		unsigned int run = 0;
+
+		/* the linear counter starts a while after it is loaded */
+		if (apu.tri_count_delay > 0) {
+			do {
+				apu.tri_count_delay -= CYCLES_PER_SAMPLE * magic_adjust;
+				++run;
+			} while (run < n && apu.tri_count_delay > 0);
+		} else {
+			if (apu.tri_will_count) {
+				apu.tri_mode_count = 1;
+				apu.tri_will_count = 0;
+			}
+			run = n;
+		}
+		if (apu.tri_mode_count == 0) {
+			apu.tri_lin_counter = apu.tri_lin_cnt_ld_reg;
+		}
+
+		apu.tri_index = RenderTriangleRun(start, run,
+		                                  apu.tri_enabled
+		                                  && apu.tri_len_counter
+		                                  && apu.tri_lin_counter,
+		                                  apu.tri_index, apu.step_tri);
+		start += run;
+		n -= run;
+	}
+}
+
+static void
+RenderNoise(unsigned int start, unsigned int n)
+{
+	int volume;
+	unsigned int i = 0;
+
+	if (!apu.noi_enabled) {
+		if (sound_config.bandlimit)
+			BlepLevel(CH_NOI, (unsigned long long)start * BLEP_PHASES, 0);
+		return;
+	}
+	/* doubled, for the TND mixer */
+	volume = 2 * (apu.noi_env_dec_disable ? apu.noi_volume_reg : apu.noi_env_dec_volume);
+	if (!apu.noi_len_counter)
+		volume = 0;
+
+	if (sound_config.bandlimit) {
+		BlepLevel(CH_NOI, (unsigned long long)start * BLEP_PHASES,
+		          apu.noi_state_reg ? volume : 0);
+		while (i < n) {
+			/* the samples before the shift register is next clocked */
+			unsigned long run = n - i;
+
+			if (apu.step_noi
+			 && (0x1FFFFFFF - apu.noi_index) / apu.step_noi < run)
+				run = (0x1FFFFFFF - apu.noi_index) / apu.step_noi;
+			apu.noi_index += run * apu.step_noi;
+			i += run;
+
+			if (i < n) {
+				unsigned long long e = 0x20000000 - apu.noi_index;
+
+				apu.noi_index += apu.step_noi;
+				if (apu.noi_index > 0x1FFFFFFF) {
+					apu.noi_state_reg = shift_register15(apu.noi_number_type ? 0x40 : 0x02);
+					apu.noi_index &= 0x1FFFFFFF;
+					if ((apu.noi_state_reg ? volume : 0) != blep_level[CH_NOI])
+						BlepLevel(CH_NOI, BLEP_TIME(start + i, e, apu.step_noi),
+						          apu.noi_state_reg ? volume : 0);
+				}
+				++i;
+			}
+		}
+		return;
+	}
+
+	int *out = mix[route[CH_NOI]] + start;
+	if (apu.step_noi > 0x1FFFFFFF / 8) {
+		/* clocked every few samples, so there are no long runs */
+		for (; i < n; i++) {
+			apu.noi_index += apu.step_noi;
+			if (apu.noi_index > 0x1FFFFFFF) {
+				apu.noi_state_reg = shift_register15(apu.noi_number_type ? 0x40 : 0x02);
+				apu.noi_index &= 0x1FFFFFFF;
+			}
+			out[i] += apu.noi_state_reg ? volume : 0;
+		}
 		return;
+	}
+	while (i < n) {
+		/* the samples before the shift register is next clocked */
+		unsigned long run = n - i;
+
+		if (apu.step_noi
+		 && (0x1FFFFFFF - apu.noi_index) / apu.step_noi < run)
+			run = (0x1FFFFFFF - apu.noi_index) / apu.step_noi;
+		apu.noi_index += run * apu.step_noi;
+		for (int level = apu.noi_state_reg ? volume : 0; run; run--)
+			out[i++] += level;
+
+		if (i < n) {
+			apu.noi_index += apu.step_noi;
+			if (apu.noi_index > 0x1FFFFFFF) {
+				apu.noi_state_reg = shift_register15(apu.noi_number_type ? 0x40 : 0x02);
+				apu.noi_index &= 0x1FFFFFFF;
+			}
+			out[i++] += apu.noi_state_reg ? volume : 0;
+		}
+	}
+}
+
+/* The DMC; dmc_shift holds the sample byte being played */
+static void
+RenderDMC(int *out, unsigned int n, unsigned char **banks,
+          unsigned char *dmc_shift)
+{
+	for (unsigned int i = 0; i < n; i++) {
+		if (!(apu.dmc_enabled && /*apu.dmc_clk_for_fetch &&*/ apu.dmc_len_counter))
+			return;
+		if (apu.dmc_index >= MAGIC_dmc) {
+			*dmc_shift = banks[(apu.dmc_dta_ftch_addr >> 12) - 8][apu.dmc_dta_ftch_addr];
+			/* the address is 16 bits: past $FFFF it wraps to $8000 */
+			if (++apu.dmc_dta_ftch_addr == 0)
+				apu.dmc_dta_ftch_addr = 0x8000;
+
+			apu.dmc_index &= MAGIC_dmc;
+			apu.dmcs_index = 0;
+			apu.dmc_shiftcnt = 8;
+			--apu.dmc_len_counter;
+		}
+		apu.dmc_index  += apu.step_dmc;
+		apu.dmcs_index += apu.step_dmcs;
+
+		if (apu.dmc_len_counter == 0) {
+			if (apu.dmc_loop_sample) {
+				apu.dmc_len_counter = apu.dmc_len_freq;
+				apu.dmc_dta_ftch_addr = apu.dmc_load_register;
+			} else if (apu.dmc_gen_interrupt) {
+				apu.dmc_interrupt = DMC_INTERRUPT_TRUE;
+			}
+		}
+
+		while (apu.dmc_shiftcnt > 0
+		    && (apu.dmcs_index >= MAGIC_dmc
+		     || apu.dmc_index >= MAGIC_dmc)) {
+			if (*dmc_shift & 1) {
+				if (apu.dmc_delta != 0x3F) {
+					++apu.dmc_delta;
+				}
+			} else if (apu.dmc_delta) {
+				--apu.dmc_delta;
+			}
+			*dmc_shift >>= 1;
+			apu.dmcs_index -= MAGIC_dmc;
+			--apu.dmc_shiftcnt;
+		}
+
+		out[i] += apu.dmc_delta << 1;       /* the top 6 of its 7 bits */
+	}
+}
 
+/*
+ * Look up a band-limited level, in 1 / (1 << BLEP_BITS), in a mixer table,
+ * in between its entries, and past its ends where the steps overshoot.
+ */
+static inline int
+MixLevel(const short *table, int max, int level)
+{
+	int n = level >> BLEP_BITS;
+
+	if (n < 0)
+		n = 0;
+	else if (n > max - 1)
+		n = max - 1;
+	return table[n] + ((table[n + 1] - table[n]) * (level - (n << BLEP_BITS))
+	                   >> BLEP_BITS);
+}
+
+/*
+ * Convert a frame of 16-bit signed samples to the output format.  Each
+ * format has a loop of its own, simple enough for the compiler to vectorize.
+ */
+static void
+ConvertFrame(unsigned char *restrict out, const short *restrict in,
+             unsigned int samples)
+{
+	unsigned short *out16 = (unsigned short *)out;
+	int swap = sample_format_number == AFMT_S16_BE
+	        || sample_format_number == AFMT_U16_BE;
+	int flip = sample_format_number == AFMT_U16_LE
+	        || sample_format_number == AFMT_U16_BE ? 0x8000 : 0;
+	unsigned int i;
+
+#if BYTE_ORDER == BIG_ENDIAN
+	swap = !swap;
+#endif
+	switch (sample_format_number) {
+	case AFMT_MU_LAW:
+		for (i = 0; i < samples; i++)
+			out[i] = mulaw_table[(unsigned short)in[i] >> 2];
+		break;
+	case AFMT_S8:
+		for (i = 0; i < samples; i++)
+			out[i] = in[i] >> 8;
+		break;
+	case AFMT_S16_LE:
+	case AFMT_S16_BE:
+	case AFMT_U16_LE:
+	case AFMT_U16_BE:
+		if (swap) {
+			for (i = 0; i < samples; i++) {
+				unsigned short x = in[i] ^ flip;
+
+				out16[i] = x << 8 | x >> 8;
+			}
+		} else {
+			for (i = 0; i < samples; i++)
+				out16[i] = in[i] ^ flip;
+		}
+		break;
+	default:        /* AFMT_U8 */
+		for (i = 0; i < samples; i++)
+			out[i] = (in[i] >> 8) ^ 0x80;
+		break;
+	}
+}
+
+/* The backend's latency(), counted for --benchmark */
+static int
+Latency(void)
+{
+	int odelay = audio_backend->latency();
+
+	if (stats_enabled && odelay >= 0)
+		stats_count(&audio_stats.delays, &audio_stats.delay_us,
+		            &audio_stats.delay_max_us,
+		            odelay * 1000000ULL
+		            / (sound_config.audiorate * bytes_per_sample));
+	return odelay;
+}
+
+/* The backend's write(), timed for --benchmark */
+static ssize_t
+WriteAudio(const void *buf, size_t len)
+{
+	uint64_t t;
+	ssize_t n;
+
+	if (!stats_enabled)
+		return audio_backend->write(buf, len);
+	t = stats_now();
+	n = audio_backend->write(buf, len);
+	stats_count(&audio_stats.writes, &audio_stats.write_ns,
+	            &audio_stats.write_max_ns, stats_now() - t);
+	return n;
+}
+
+/* Bytes written to the device and not played yet */
+static unsigned int
+QueuedBytes(void)
+{
+	int odelay = Latency();
+	unsigned int fill = odelay > 0 ? odelay : 0;
+
+#ifdef HAVE_PTHREAD
+	fill += pcm_len;
+#endif
+	return fill;
+}
+
+/* Before a write: count an underrun if the device has run dry */
+static void
+CheckUnderrun(void)
+{
+	static int started = 0;
+
+	if (started && Latency() == 0)
+		__atomic_fetch_add(&audio_stats.underruns, 1, __ATOMIC_RELAXED);
+	started = 1;
+}
+
+/* The sample t of the way from x[0] to x[s], every s-th being a channel's */
+static inline short
+Interpolate(const short *x, int s, float t)
+{
+	float y = x[0] + 0.5f * t * (x[s] - x[-s]
+	                 + t * (2 * x[-s] - 5 * x[0] + 4 * x[s] - x[2 * s]
+	                 + t * (3 * (x[0] - x[s]) + x[2 * s] - x[-s])));
+
+	return y < -32768.0f ? -32768 : y > 32767.0f ? 32767
+	     : (int)(y + (y < 0.0f ? -0.5f : 0.5f));
+}
+
+/*
+ * Resample the frame in mixed into resampled, at a rate a little above
+ * or below the output rate as fill, the bytes queued, is short of or over
+ * target_fill; returns the number of samples.  Each one is interpolated
+ * from the four around it (a Catmull-Rom spline), which lags by two
+ * samples, so the last three of the frame are kept in front of the next.
+ */
+static unsigned int
+Resample(unsigned int samples, unsigned int fill)
+{
+	static double pos = -2.0;       /* of the next sample, in mixed */
+	static float  average = -1.0f;  /* of fill, over the last few frames */
+	float adjust;
+	unsigned int n = 0;
+
+	if (average < 0.0f)
+		average = target_fill;
+	average += (fill - average) / 8;
+	adjust = RATE_ADJUST * (target_fill - average) / target_fill;
+	if (adjust > RATE_ADJUST)
+		adjust = RATE_ADJUST;
+	else if (adjust < -RATE_ADJUST)
+		adjust = -RATE_ADJUST;
+
+	for (; pos < samples - 2; pos += 1.0 / (1.0 + adjust)) {
+		int i = (int)(pos + 3.0) - 3;
+		float t = pos - i;
+
+		if (audio_channels == 1) {
+			resampled[n++] = Interpolate(mixed + i, 1, t);
+		} else {
+			resampled[2 * n] = Interpolate(mixed + 2 * i, 2, t);
+			resampled[2 * n + 1] = Interpolate(mixed + 2 * i + 1, 2, t);
+			n++;
+		}
+	}
+	pos -= samples;
+	memcpy(mixed - 3 * audio_channels, mixed + (samples - 3) * audio_channels,
+	       3 * audio_channels * sizeof(*mixed));
+	return n;
+}
+
+/*
+ * Mix the channels, each in its own buffer, into each side with its gain
+ * there; the levels in the groups are in 1 / (1 << BLEP_BITS), as with
+ * --bandlimit, so that they can be looked up in between the entries.
+ */
+static void
+MixApart(unsigned int samples)
+{
+	int unit = sound_config.bandlimit ? 1 : 1 << BLEP_BITS;
+	int chip = CH_EXP + (expansion ? expansion->channels : 0);
+
+	for (int side = 0; side < audio_channels; side++) {
+		const int *g = gain[side];
+		short *out = mixed + side;
+
+		for (unsigned int i = 0; i < samples; i++) {
+			int pulse = (mix[CH_SQ1][i] * g[CH_SQ1] + mix[CH_SQ2][i] * g[CH_SQ2])
+			            * unit >> GAIN_BITS;
+			int tnd = (mix[CH_TRI][i] * g[CH_TRI] + mix[CH_NOI][i] * g[CH_NOI]
+			           + mix[CH_DMC][i] * g[CH_DMC]) * unit >> GAIN_BITS;
+			int x = MixLevel(pulse_table, PULSE_MAX, pulse)
+			      + MixLevel(tnd_table, TND_MAX, tnd);
+
+			for (int c = CH_EXP; c < chip; c++)
+				x += mix[c][i] * g[c] >> GAIN_BITS;
+			out[i * audio_channels] = x < -32768 ? -32768 : x > 32767 ? 32767 : x;
+		}
+	}
+}
+
+/* Synthesize one frame of samples into audio_buffer; returns its length */
+static unsigned int
+SynthFrame(void)
+{
+	unsigned int   count;
+	unsigned int   i = 0, n;
+	unsigned int   samples = samples_per_vsync / bytes_per_sample;
+	unsigned char  dmc_shift = 0;
+	unsigned char **banks = frame_banks[frames_done % FRAMES_AHEAD];
+
+	unsigned int   m = __atomic_load_n(&muted, __ATOMIC_RELAXED);
+	unsigned int   so = __atomic_load_n(&soloed, __ATOMIC_RELAXED);
+	uint64_t       start = stats_enabled ? stats_now() : 0;
+
+	if (m != mix_muted || so != mix_soloed) {
+		mix_muted = m;
+		mix_soloed = so;
+		SetGains();
+	}
+	if (apart != (audio_channels == 2 || custom_mix))
+		Route(!apart);
+	for (int c = 0; c < CH_EXP + (expansion ? expansion->channels : 0); c++) {
+		if (route[c] == c)
+			memset(mix[c], 0, samples * sizeof(*mix[c]));
+	}
+	while (i < samples) {
+		/* the CPU cycle this sample ends at */
+		count = (i + 1) * CPF / samples;
 
-	while (sample < samples_per_vsync) {
 		/* do counter checks */
 		/* first, decrement counters */
-		--hz_60; --hz_120; --hz_240;
+		--apu.hz_60; --apu.hz_120; --apu.hz_240;
 
 		/* then, check 60hz */
-		if (hz_60 == 0) {
+		if (apu.hz_60 == 0) {
 #if 0
 			printf("hz_60:  %u\n", sample);
 #endif
-			hz_60  = hz_60_set;
-			hz_120 = 0; /* 120hz hits on 60hz too */
+			apu.hz_60  = hz_60_set;
+			apu.hz_120 = 0; /* 120hz hits on 60hz too */
 
-			if (!sq1_lcc_disable  && sq1_len_counter) --sq1_len_counter;
-			if (!sq2_lcc_disable  && sq2_len_counter) --sq2_len_counter;
-			if (!tri_lin_cnt_strt && tri_len_counter) --tri_len_counter;
-			if (!noi_lcc_disable  && noi_len_counter) --noi_len_counter;
+			if (!apu.sq1_lcc_disable  && apu.sq1_len_counter) --apu.sq1_len_counter;
+			if (!apu.sq2_lcc_disable  && apu.sq2_len_counter) --apu.sq2_len_counter;
+			if (!apu.tri_lin_cnt_strt && apu.tri_len_counter) --apu.tri_len_counter;
+			if (!apu.noi_lcc_disable  && apu.noi_len_counter) --apu.noi_len_counter;
 		}
 
 		/* do 120hz stuff */
-		if (hz_120 == 0) {
+		if (apu.hz_120 == 0) {
 #if 0
 			printf("hz_120: %u\n", sample);
 #endif
-			hz_120 = hz_120_set; /* 240hz hits on 120hz (and on 60hz) */
-			hz_240 = 0;
-			/* frequency sweep sq1 : wavelen_sq1 */
-			if (sq1_sweep_enabled
-			 && sq1_len_counter
-			 && sq1_right_shift
-			 && sq1_sw_no_carry && wavelen_sq1 > 0x07) {
-				--sq1_sw_counter;
-				if (sq1_sw_counter == 0) {
-					sq1_sw_counter = sq1_sw_update_rate;
+			apu.hz_120 = hz_120_set; /* 240hz hits on 120hz (and on 60hz) */
+			apu.hz_240 = 0;
+			/* frequency sweep sq1 : apu.wavelen_sq1 */
+			if (apu.sq1_sweep_enabled
+			 && apu.sq1_len_counter
+			 && apu.sq1_right_shift
+			 && apu.sq1_sw_no_carry && apu.wavelen_sq1 > 0x07) {
+				--apu.sq1_sw_counter;
+				if (apu.sq1_sw_counter == 0) {
+					apu.sq1_sw_counter = apu.sq1_sw_update_rate;
 					/* update the frequency */
-					if (sq1_inc_dec_wavelen) {
-						wavelen_sq1 -= ((wavelen_sq1 >> sq1_right_shift) + 1);
-						if (wavelen_sq1 < 0) wavelen_sq1 = 0;
+					if (apu.sq1_inc_dec_wavelen) {
+						apu.wavelen_sq1 -= ((apu.wavelen_sq1 >> apu.sq1_right_shift) + 1);
+						if (apu.wavelen_sq1 < 0) apu.wavelen_sq1 = 0;
 					} else {
-						short temp_wavelen = wavelen_sq1 + (wavelen_sq1 >> sq1_right_shift);
+						short temp_wavelen = apu.wavelen_sq1 + (apu.wavelen_sq1 >> apu.sq1_right_shift);
 						if (temp_wavelen >= 0x0800) {
-							sq1_sw_no_carry = 0;
+							apu.sq1_sw_no_carry = 0;
 						} else {
-							wavelen_sq1 = temp_wavelen;
+							apu.wavelen_sq1 = temp_wavelen;
 						}
 					}
 
-					step_sq1 = freq_buffer_squ[wavelen_sq1];
+					apu.step_sq1 = freq_buffer_squ[apu.wavelen_sq1];
 				}
 			}
 
-			/* frequency sweep sq2 : wavelen_sq2 */
-			if (sq2_sweep_enabled
-			 && sq2_len_counter
-			 && sq2_right_shift
-			 && sq2_sw_no_carry && wavelen_sq2 > 0x07) {
-				--sq2_sw_counter;
-				if (sq2_sw_counter == 0) {
-					sq2_sw_counter = sq2_sw_update_rate;
+			/* frequency sweep sq2 : apu.wavelen_sq2 */
+			if (apu.sq2_sweep_enabled
+			 && apu.sq2_len_counter
+			 && apu.sq2_right_shift
+			 && apu.sq2_sw_no_carry && apu.wavelen_sq2 > 0x07) {
+				--apu.sq2_sw_counter;
+				if (apu.sq2_sw_counter == 0) {
+					apu.sq2_sw_counter = apu.sq2_sw_update_rate;
 					/* update the frequency */
-					if (sq2_inc_dec_wavelen) {
-						wavelen_sq2 -= (wavelen_sq2 >> sq2_right_shift);
-						if (wavelen_sq2 < 0) wavelen_sq2 = 0;
+					if (apu.sq2_inc_dec_wavelen) {
+						apu.wavelen_sq2 -= (apu.wavelen_sq2 >> apu.sq2_right_shift);
+						if (apu.wavelen_sq2 < 0) apu.wavelen_sq2 = 0;
 					} else {
-						short temp_wavelen = wavelen_sq2 + (wavelen_sq2 >> sq2_right_shift);
+						short temp_wavelen = apu.wavelen_sq2 + (apu.wavelen_sq2 >> apu.sq2_right_shift);
 						if (temp_wavelen >= 0x0800) {
-							sq2_sw_no_carry = 0;
+							apu.sq2_sw_no_carry = 0;
 						} else {
-							wavelen_sq2 = temp_wavelen;
+							apu.wavelen_sq2 = temp_wavelen;
 						}
 					}
 
-					step_sq2 = freq_buffer_squ[wavelen_sq2];
+					apu.step_sq2 = freq_buffer_squ[apu.wavelen_sq2];
 				}
 			}
 
 			/* frequency sweep noi : wavelen_noi */
 #if 0
 			if (noi_sweep_enabled
-			 && noi_len_counter
+			 && apu.noi_len_counter
 			 && noi_right_shift
 			 && noi_sw_no_carry
 			 && wavelen_noi > 0x07) {
@@ -716,460 +1986,401 @@ UpdateAudio(void) /* called freq times a sec */
 						}
 					}
 
-					step_noi = freq_buffer_squ[wavelen_noi];
+					apu.step_noi = freq_buffer_squ[wavelen_noi];
 				}
 			}
 #endif
 		}
 
 		/* now, do 240hz stuff */
-		if (hz_240 == 0) {
+		if (apu.hz_240 == 0) {
 #if 0
 			printf("hz_240: %u\n", sample);
 #endif
-			hz_240 = hz_240_set;
-			if (!sq1_env_dec_disable) --sq1_env_dec_counter;
-			if (!sq2_env_dec_disable) --sq2_env_dec_counter;
-			if (!noi_env_dec_disable) --noi_env_dec_counter;
-
-			if (!sq1_env_dec_counter) {
-				sq1_env_dec_counter = sq1_env_dec_cycle;
-				if (sq1_env_dec_volume) {
-					sq1_env_dec_volume -= volume_adjust;
-				} else if (sq1_lcc_disable) {
-					sq1_env_dec_volume = volume_max;
+			apu.hz_240 = hz_240_set;
+			if (!apu.sq1_env_dec_disable) --apu.sq1_env_dec_counter;
+			if (!apu.sq2_env_dec_disable) --apu.sq2_env_dec_counter;
+			if (!apu.noi_env_dec_disable) --apu.noi_env_dec_counter;
+
+			if (!apu.sq1_env_dec_counter) {
+				apu.sq1_env_dec_counter = apu.sq1_env_dec_cycle;
+				if (apu.sq1_env_dec_volume) {
+					--apu.sq1_env_dec_volume;
+				} else if (apu.sq1_lcc_disable) {
+					apu.sq1_env_dec_volume = 0x0F;
 				}
 			}
-			if (!sq2_env_dec_counter) {
-				sq2_env_dec_counter = sq2_env_dec_cycle;
-				if (sq2_env_dec_volume) {
-					sq2_env_dec_volume -= volume_adjust;
-				} else if (sq2_lcc_disable) {
-					sq2_env_dec_volume = volume_max;
+			if (!apu.sq2_env_dec_counter) {
+				apu.sq2_env_dec_counter = apu.sq2_env_dec_cycle;
+				if (apu.sq2_env_dec_volume) {
+					--apu.sq2_env_dec_volume;
+				} else if (apu.sq2_lcc_disable) {
+					apu.sq2_env_dec_volume = 0x0F;
 				}
 			}
-			if (!noi_env_dec_counter) {
-				noi_env_dec_counter = noi_env_dec_cycle;
-				if (noi_env_dec_volume) {
-					noi_env_dec_volume -= volume_adjust;
-				} else if (noi_lcc_disable) {
-					noi_env_dec_volume = volume_max;
+			if (!apu.noi_env_dec_counter) {
+				apu.noi_env_dec_counter = apu.noi_env_dec_cycle;
+				if (apu.noi_env_dec_volume) {
+					--apu.noi_env_dec_volume;
+				} else if (apu.noi_lcc_disable) {
+					apu.noi_env_dec_volume = 0x0F;
 				}
 			}
 			/* this is optimized from the docs */
-			if (tri_mode_count
-			 && tri_lin_counter
-			 && !tri_lin_cnt_strt)
-				--tri_lin_counter;
+			if (apu.tri_mode_count
+			 && apu.tri_lin_counter
+			 && !apu.tri_lin_cnt_strt)
+				--apu.tri_lin_counter;
 		}
 
 		/* set up audio values for this cycle */
-		while (head != tail && CUR_EVENT.count < count) {
-			switch (CUR_EVENT.addr) {
-				/* pulse one */
-				case 0x4000:
-					sq1_env_dec_disable = (CUR_EVENT.value & 0x10);
-					sq1_lcc_disable = (CUR_EVENT.value & 0x20);
-					sq1_duty_cycle = squ_duty[(CUR_EVENT.value >> 6)];
-					if (sq1_env_dec_disable) {
-						sq1_env_dec_volume =
-						sq1_volume_reg = volume_adjust * (CUR_EVENT.value & 0x0F);
-					} else {
-						sq1_env_dec_counter =
-						sq1_env_dec_cycle = (CUR_EVENT.value & 0x0F) + 1;
-					}
-					break;
-
-				case 0x4001:
-					sq1_right_shift = (CUR_EVENT.value & 0x07);
-					sq1_inc_dec_wavelen = (CUR_EVENT.value & 0x08);
-					sq1_sw_counter =
-					sq1_sw_update_rate  = ((CUR_EVENT.value >> 4) & 0x07) + 1;
-					sq1_sweep_enabled   = (CUR_EVENT.value & 0x80);
-					sq1_sw_no_carry = 1;
-					break;
-
-				case 0x4002:
-					wavelen_sq1 = ((wavelen_sq1 & 0x0700) | CUR_EVENT.value);
-					sq1_sw_no_carry = 1;
-					step_sq1 = freq_buffer_squ[wavelen_sq1];
-					break;
-
-				case 0x4003:
-					wavelen_sq1 = ((wavelen_sq1 & 0x00FF) | ((CUR_EVENT.value & 0x07) << 8));
-					sq1_sw_no_carry = 1;
-					sq1_len_cnt_ld_reg = (CUR_EVENT.value >> 3);
-					sq1_len_counter = length_precalc[ sq1_len_cnt_ld_reg ];
-					sq1_env_dec_volume = volume_max;
-					step_sq1 = freq_buffer_squ[wavelen_sq1];
-					break;
-
-				/* pulse two */
-				case 0x4004:
-					sq2_env_dec_disable = (CUR_EVENT.value & 0x10);
-					sq2_lcc_disable = (CUR_EVENT.value & 0x20);
-					sq2_duty_cycle  = squ_duty[(CUR_EVENT.value >> 6)];
-					if (sq2_env_dec_disable) {
-						sq2_env_dec_volume =
-						sq2_volume_reg = volume_adjust * (CUR_EVENT.value & 0x0F);
-					} else {
-						sq2_env_dec_counter =
-						sq2_env_dec_cycle = (CUR_EVENT.value & 0x0F) + 1;
-					}
-					break;
-
-				case 0x4005:
-					sq2_right_shift = (CUR_EVENT.value & 0x07);
-					sq2_inc_dec_wavelen = (CUR_EVENT.value & 0x08);
-					sq2_sw_counter =
-					sq2_sw_update_rate  = ((CUR_EVENT.value >> 4) & 0x07) + 1;
-					sq2_sweep_enabled   = (CUR_EVENT.value & 0x80);
-					sq2_sw_no_carry = 1;
-					break;
+		while (head != __atomic_load_n(&tail, __ATOMIC_ACQUIRE)
+		    && CUR_EVENT.addr != SND_FRAME
+		    && CUR_EVENT.count < count) {
+			ApplyEvent();
+			__atomic_store_n(&head, next_event(head), __ATOMIC_RELEASE);
+		} /* while head != tail && CUR_EVENT.count <= count */
 
-				case 0x4006:
-					wavelen_sq2 = ((wavelen_sq2 & 0x0700) | CUR_EVENT.value);
-					sq2_sw_no_carry = 1;
-					step_sq2 = freq_buffer_squ[wavelen_sq2];
-					break;
+		/* render up to the next counter tick or the next write */
+		n = samples - i;
+		if (n > apu.hz_60)  n = apu.hz_60;
+		if (n > apu.hz_120) n = apu.hz_120;
+		if (n > apu.hz_240) n = apu.hz_240;
+		if (head != __atomic_load_n(&tail, __ATOMIC_ACQUIRE)
+		 && CUR_EVENT.addr != SND_FRAME) {
+			unsigned int next = event_sample(CUR_EVENT.count, samples);
+
+			if (n > next - i)
+				n = next - i;
+		}
 
-				case 0x4007:
-					wavelen_sq2 = ((wavelen_sq2 & 0x00FF) | ((CUR_EVENT.value & 0x07) << 8));
-					sq2_len_cnt_ld_reg = (CUR_EVENT.value >> 3);
-					sq2_len_counter = length_precalc[ sq2_len_cnt_ld_reg ];
-					sq2_env_dec_volume = volume_max;
-					sq2_sw_no_carry = 1;
-					step_sq2 = freq_buffer_squ[wavelen_sq2];
-					break;
+		/* start with the triangle channel, why? I want to. (pez) */
+		RenderTriangle(i, n);
+		apu.sq1_index = RenderSquare(CH_SQ1, i, n,
+		                             apu.sq1_enabled
+		                             && apu.sq1_len_counter
+		                             && apu.wavelen_sq1 > 0x07
+		                             && apu.sq1_sw_no_carry,
+		                             apu.sq1_index, apu.step_sq1,
+		                             apu.sq1_duty_cycle,
+		                             apu.sq1_env_dec_disable ?
+		                             apu.sq1_volume_reg :
+		                             apu.sq1_env_dec_volume);
+		apu.sq2_index = RenderSquare(CH_SQ2, i, n,
+		                             apu.sq2_enabled
+		                             && apu.sq2_len_counter
+		                             && apu.wavelen_sq2 > 0x07
+		                             && apu.sq2_sw_no_carry,
+		                             apu.sq2_index, apu.step_sq2,
+		                             apu.sq2_duty_cycle,
+		                             apu.sq2_env_dec_disable ?
+		                             apu.sq2_volume_reg :
+		                             apu.sq2_env_dec_volume);
+		RenderNoise(i, n);
+		RenderDMC(mix[route[CH_DMC]] + i, n, banks, &dmc_shift);
+		if (expansion)
+			expansion->render(expansion_out, i, n);
+
+		/* the counters were decremented for the first sample only */
+		apu.hz_60  -= n - 1;
+		apu.hz_120 -= n - 1;
+		apu.hz_240 -= n - 1;
+		i += n;
+	} /* while i < samples */
+
+	/* the rest of this frame's writes, up to the end of the frame */
+	while (head != __atomic_load_n(&tail, __ATOMIC_ACQUIRE)) {
+		int end = CUR_EVENT.addr == SND_FRAME;
+
+		if (!end)
+			ApplyEvent();
+		__atomic_store_n(&head, next_event(head), __ATOMIC_RELEASE);
+		if (end)
+			break;
+	}
 
-				/* triangle channel */
-				case 0x4008:
-					tri_lin_cnt_ld_reg = (CUR_EVENT.value & 0x7F);
-					if (!tri_mode_count) {
-						tri_lin_counter = tri_lin_cnt_ld_reg;
-					}
+	if (sound_config.bandlimit) {
+		/* the DMC was mixed as it is, band-limit its changes too */
+		for (i = 0; i < samples; i++)
+			BlepLevel(CH_DMC, (i + 1ULL) * BLEP_PHASES, mix[route[CH_DMC]][i]);
+		/* integrate the steps, and keep those which spill over */
+		for (int c = 0; c < CH_APU; c++) {
+			if (route[c] != c)
+				continue;
+			for (i = 0; i < samples; i++) {
+				blep_sum[c] += blep[c][i];
+				mix[c][i] = blep_sum[c];
+			}
+			memmove(blep[c], blep[c] + samples, BLEP_WIDTH * sizeof(*blep[c]));
+			memset(blep[c] + BLEP_WIDTH, 0, samples * sizeof(*blep[c]));
+		}
+	}
+	if (apart) {
+		MixApart(samples);
+	} else if (sound_config.bandlimit) {
+		for (i = 0; i < samples; i++) {
+			int x = MixLevel(pulse_table, PULSE_MAX, mix[MIX_PULSE][i])
+			      + MixLevel(tnd_table, TND_MAX, mix[MIX_TND][i]);
+
+			mixed[i] = x < -32768 ? -32768 : x > 32767 ? 32767 : x;
+		}
+	} else {
+		for (i = 0; i < samples; i++)
+			mixed[i] = pulse_table[mix[MIX_PULSE][i]] + tnd_table[mix[MIX_TND][i]];
+	}
+	if (expansion && !apart) {
+		for (i = 0; i < samples; i++) {
+			int x = mixed[i] + mix[CH_EXP][i];
 
-					if (tri_lin_cnt_strt == 0) {
-						tri_mode_count = 1;
-						tri_will_count = /* save a write later */
-						tri_count_delay = 0;
+			mixed[i] = x < -32768 ? -32768 : x > 32767 ? 32767 : x;
+		}
+	}
 
-					} else {
-						if (!(CUR_EVENT.value & 0x80)) {
-							tri_will_count = 1;
-							tri_count_delay = tri_count_delay_max;
-						} else {
-							tri_will_count =
-							tri_count_delay = 0;
-						}
-					}
-					tri_lin_cnt_strt = (CUR_EVENT.value & 0x80);
-					break;
-				case 0x4009: /* unused, don't waste cycles on it */
-					break;
-				case 0x400A:
-					wavelen_tri = ((wavelen_tri & 0x0700) | CUR_EVENT.value);
-					step_tri = freq_buffer_tri[wavelen_tri];
-					break;
-				case 0x400B:
-					wavelen_tri = ((wavelen_tri & 0x00FF) | ((CUR_EVENT.value & 0x07) << 8));
-					tri_len_cnt_ld_reg = CUR_EVENT.value >> 3;
-					tri_len_counter = length_precalc[ tri_len_cnt_ld_reg ];
-
-					if (tri_lin_cnt_strt) {
-						tri_will_count =
-						tri_count_delay = 0;
-					} else {
-						tri_will_count = 1;
-						tri_count_delay = tri_count_delay_max;
-					}
-					tri_mode_count = 0;
-					tri_lin_counter = tri_lin_cnt_ld_reg;
-					step_tri = freq_buffer_tri[wavelen_tri];
-					break;
+	if (rate_control) {
+		samples = Resample(samples, QueuedBytes());
+		ConvertFrame(audio_buffer, resampled, samples * audio_channels);
+	} else {
+		ConvertFrame(audio_buffer, mixed, samples * audio_channels);
+	}
+	if (stats_enabled)
+		stats_count(&audio_stats.frames, &audio_stats.synth_ns,
+		            &audio_stats.synth_max_ns, stats_now() - start);
+	return samples * bytes_per_sample;
+}
+#undef CUR_EVENT
 
-				/* Noise Channel */
-				case 0x400C:
-					noi_env_dec_disable = (CUR_EVENT.value & 0x10);
-					noi_lcc_disable = (CUR_EVENT.value & 0x20);
-					if (noi_env_dec_disable) {
-						noi_env_dec_volume =
-						noi_volume_reg = volume_adjust * (CUR_EVENT.value & 0x0F);
-					} else {
-						noi_env_dec_counter =
-						noi_env_dec_cycle = (CUR_EVENT.value & 0x0F) + 1;
-					}
-					break;
-				case 0x400D:
-					/* unused, don't waste cycles */
-					break;
-				case 0x400E:
-					noi_sample_rate = (CUR_EVENT.value & 0x0F);
-					noi_number_type = (CUR_EVENT.value & 0x80);
-					if (freq_buffer_noi[noi_sample_rate] == 0) {
-						freq_buffer_noi[noi_sample_rate] =
-						    (MAGIC_noi * CYCLES_PER_SAMPLE * magic_adjust) /
-						    noi_wavelen[noi_sample_rate];
-					}
-					step_noi = freq_buffer_noi[noi_sample_rate];
-					break;
-				case 0x400F:
-					noi_len_cnt_ld_reg = (CUR_EVENT.value >> 3);
-					noi_len_counter = length_precalc[ noi_len_cnt_ld_reg ];
-					noi_env_dec_volume = volume_max;
-					break;
+/*
+ * Is the game paced by the sound device?  Not at half or double speed,
+ * when the sound is bound to fall behind or pile up, nor in a benchmark,
+ * which runs flat out.
+ */
+int
+SoundPacing(void)
+{
+	return rate_control && !benchmark_frames
+	    && !renderer_data.halfspeed && !renderer_data.doublespeed;
+}
 
-				/* DMC channel */
-				case 0x4010:
-					dmc_loop_sample   = (CUR_EVENT.value & 0x40);
-					dmc_gen_interrupt = (dmc_loop_sample ? 0 : CUR_EVENT.value & 0x80);
-					if (!dmc_gen_interrupt)
-						dmc_interrupt = DMC_INTERRUPT_FALSE;
-
-					dmc_clk_for_fetch = 1;
-					dmc_clk_register  = dmc_samples_wait[(CUR_EVENT.value & 0x0F)];
-					if (freq_buffer_dmc[(CUR_EVENT.value & 0x0F)] == 0) {
-						freq_buffer_dmc[(CUR_EVENT.value & 0x0F)] =
-						    (MAGIC_dmc * CYCLES_PER_SAMPLE * magic_adjust) /
-						    dmc_samples_wait[(CUR_EVENT.value & 0x0F)];
-					}
-					step_dmc = freq_buffer_dmc[(CUR_EVENT.value & 0x0F)];
-					step_dmcs = step_dmc << 3; /* shift count is 8x freq */
-					break;
-				case 0x4011:
-					dmc_delta = ((CUR_EVENT.value & 0x7E) >> 1);
-					break;
-				case 0x4012:
-					dmc_dta_ftch_addr =
-					dmc_load_register = (CUR_EVENT.value << 6) | 0xc000;
-					break;
-				case 0x4013: /* length is in bytes */
-					dmc_len_counter =
-					dmc_len_freq    = (CUR_EVENT.value << 4);
-					break;
-				case 0x4015: /* write = channel enable */
-					sq1_enabled = CUR_EVENT.value & 0x01;
-					sq2_enabled = CUR_EVENT.value & 0x02;
-					tri_enabled = CUR_EVENT.value & 0x04;
-					noi_enabled = CUR_EVENT.value & 0x08;
-					dmc_enabled = CUR_EVENT.value & 0x10;
-					if (!sq1_enabled) {
-						sq1_len_counter = 0;
-					}
+/* Count a frame which can't be queued without going over max_fill */
+static int
+Overrun(unsigned int fill, unsigned int len)
+{
+	static int resyncing = 0;
 
-					if (!sq2_enabled) {
-						sq2_len_counter = 0;
-					}
+	if (fill + len <= max_fill) {
+		resyncing = 0;
+		return 0;
+	}
+	if (verbose && !resyncing)
+		fprintf(stderr,
+		        "Warning: %.3f sec sound delay, resynchronizing\n",
+		        fill * 1.0 / (sound_config.audiorate * bytes_per_sample));
+	resyncing = 1;
+	__atomic_fetch_add(&audio_stats.overruns, 1, __ATOMIC_RELAXED);
+	return 1;
+}
 
-					if (!tri_enabled) {
-						tri_len_counter = 0;
-					}
+void
+UpdateAudio(void) /* called freq times a sec */
+{
+	unsigned int   sample;
 
-					if (!noi_enabled) {
-						noi_len_counter = 0;
-					}
-					dmc_interrupt = DMC_INTERRUPT_FALSE;
-					break;
-				/* default = break */
-				default:
-					if (verbose)
-						fprintf(stderr, "Sound Write: 0x%lX (0x%X)\n",
-						        CUR_EVENT.addr, CUR_EVENT.value);
-			} /* switch */
-
-			++head;
-			if (head == SND_BUF_SIZE) head = 0;
-		} /* while head != tail && CUR_EVENT.count <= count */
+	StatusFrame();
+	if (!audio_on)
+		return;
+	__atomic_store_n(&paced, SoundPacing(), __ATOMIC_RELAXED);
+#ifdef HAVE_PTHREAD
+	/* don't let the audio thread fall more than FRAMES_AHEAD behind, or,
+	   as it holds the frames back for the device, PACE_AHEAD */
+	unsigned int ahead = paced ? PACE_AHEAD : FRAMES_AHEAD;
+
+	if (audio_running
+	 && frames_posted - __atomic_load_n(&frames_done, __ATOMIC_ACQUIRE) >= ahead) {
+		pthread_mutex_lock(&frame_lock);
+		while (frames_posted - frames_done >= ahead)
+			pthread_cond_wait(&frame_cond, &frame_lock);
+		pthread_mutex_unlock(&frame_lock);
+	}
+#endif
+	/* the last slot of the ring is kept for this, so it can't fail */
+	memcpy(frame_banks[frames_posted % FRAMES_AHEAD], MAPTABLE + 8,
+	       sizeof(*frame_banks));
+	PostEvent(SND_FRAME, 0);
+	__atomic_add_fetch(&frames_posted, 1, __ATOMIC_RELEASE);
+#ifdef HAVE_PTHREAD
+	if (audio_running) {
+		/* if the pipe is full, the thread has been woken already */
+		write(wakefd[1], "", 1);
+		return;
+	}
+#endif
+	sample = SynthFrame();
+	++frames_done;
+
+	if (rate_control) {
+		unsigned int fill = QueuedBytes();
+
+		if (Overrun(fill, sample))
+			return;
+		/* wait for the device to play down to target_fill */
+		if (paced && fill > target_fill)
+			usleep((fill - target_fill) * 1000000.0
+			       / (sound_config.audiorate * bytes_per_sample));
+	}
+	CheckUnderrun();
+	WriteAudio(audio_buffer, sample);
+}
 
-		/* create this sample */
-		/* start with the triangle channel, why? I want to. (pez) */
-		if (tri_count_delay > 0) {
-			tri_count_delay -= CYCLES_PER_SAMPLE * magic_adjust;
-		} else if (tri_will_count) {
-			tri_mode_count = 1;
-			tri_will_count = 0;
-		}
-		if (tri_mode_count == 0) {
-			tri_lin_counter = tri_lin_cnt_ld_reg;
-		}
-		if ((tri_enabled
-		  && tri_len_counter
-		  && tri_lin_counter)
-		 || tri_index > step_tri) {
-			tri_index += step_tri;
-			tri_index &= 0x1FFFFFFF;
-			samp_temp = triangle_50[tri_index >> 24];
-		} else {
-			samp_temp = 0;
-		}
+#ifdef HAVE_PTHREAD
+/* Queue a frame of samples, unless the device is too far behind already */
+static void
+QueueFrame(unsigned int len)
+{
+	if (Overrun(QueuedBytes(), len))
+		return;
+	for (unsigned int i = 0; i < len; ) {
+		unsigned int end = (pcm_start + pcm_len) % pcm_size;
+		unsigned int n = len - i < pcm_size - end ? len - i : pcm_size - end;
 
-		/* next do sq1 */
-		if ((sq1_enabled
-		  && sq1_len_counter
-		  && wavelen_sq1 > 0x07
-		  && sq1_sw_no_carry)
-		 || sq1_index > step_sq1) {
-			sq1_index += step_sq1;
-			sq1_index &= 0x1FFFFFFF; /* fast modulus of a power of 2 */
-
-			if (sq1_index <= sq1_duty_cycle) {
-				samp_temp += (sq1_env_dec_disable ?
-				              sq1_volume_reg :
-				              sq1_env_dec_volume);
-
-			} else if (signed_samples) {
-				samp_temp -= (sq1_env_dec_disable ?
-				              sq1_volume_reg :
-				              sq1_env_dec_volume);
-			}
-		}
+		memcpy(pcm + end, audio_buffer + i, n);
+		pcm_len += n;
+		i += n;
+	}
+}
 
-		/* do sq2 */
-		if ((sq2_enabled
-		  && sq2_len_counter
-		  && wavelen_sq2 > 0x07
-		  && sq2_sw_no_carry)
-		 || sq2_index > step_sq2) {
-			sq2_index += step_sq2;
-			sq2_index &= 0x1FFFFFFF; /* fast modulus of a power of 2 */
-			if (sq2_index <= sq2_duty_cycle) {
-				samp_temp += (sq2_env_dec_disable ?
-				              sq2_volume_reg :
-				              sq2_env_dec_volume);
-			} else if (signed_samples) {
-				samp_temp -= (sq2_env_dec_disable ?
-				              sq2_volume_reg :
-				              sq2_env_dec_volume);
+/* Write as many queued samples as the device takes without blocking */
+static void
+WriteQueued(void)
+{
+	if (!pcm_len)
+		return;
+	CheckUnderrun();
+	while (pcm_len) {
+		unsigned int n = pcm_len < pcm_size - pcm_start
+		               ? pcm_len : pcm_size - pcm_start;
+		ssize_t written = WriteAudio(pcm + pcm_start, n);
+
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN) {
+				perror(sound_config.audiofile);
+				pcm_len = 0;
 			}
+			break;
 		}
+		pcm_start = (pcm_start + written) % pcm_size;
+		pcm_len -= written;
+	}
+}
 
-		/* do noi */
-		if (noi_enabled) {
-			noi_index += step_noi;
-			if (noi_index > 0x1FFFFFFF) {
-				noi_state_reg = shift_register15(noi_number_type ? 0x40 : 0x02);
-				noi_index &= 0x1FFFFFFF;
-			}
-
-
-			if (noi_len_counter) {
-				if (noi_state_reg) {
-					samp_temp +=
-					    (noi_env_dec_disable ?
-					     noi_volume_reg      :
-					     noi_env_dec_volume);
-				} else if (signed_samples) {
-					samp_temp -=
-					    (noi_env_dec_disable ?
-					     noi_volume_reg      :
-					     noi_env_dec_volume);
+static void *
+AudioThreadMain(void *arg)
+{
+	struct pollfd fds[2] = {
+		{ .fd = wakefd[0], .events = POLLIN },
+		{ .fd = audio_backend->fd },  /* ignored if -1 */
+	};
+
+	(void)arg;
+	for (int closing = 0; ; ) {
+		int timeout = -1;
+
+		/* synthesize everything posted so far, or while pacing, as much
+		   as keeps target_fill bytes queued */
+		while (frames_done != __atomic_load_n(&frames_posted, __ATOMIC_ACQUIRE)) {
+			if (!closing && __atomic_load_n(&paced, __ATOMIC_RELAXED)) {
+				unsigned int fill = QueuedBytes();
+
+				if (fill >= target_fill) {
+					/* about when it will have played down to it */
+					timeout = (fill - target_fill) * 1000ULL
+					        / (sound_config.audiorate * bytes_per_sample) + 1;
+					break;
 				}
 			}
+			QueueFrame(SynthFrame());
+			pthread_mutex_lock(&frame_lock);
+			__atomic_store_n(&frames_done, frames_done + 1, __ATOMIC_RELEASE);
+			pthread_cond_broadcast(&frame_cond);
+			pthread_mutex_unlock(&frame_lock);
+			WriteQueued();
 		}
-
-		/* do everything dmc here */
-		if (dmc_enabled && /*dmc_clk_for_fetch &&*/ dmc_len_counter) {
-			if (dmc_index >= MAGIC_dmc) {
-				dmc_shift = MAPTABLE[dmc_dta_ftch_addr >> 12][dmc_dta_ftch_addr];
-				dmc_dta_ftch_addr++;
-				if (dmc_dta_ftch_addr == 0x10000) {
-					dmc_dta_ftch_addr = 0x8000;
-				}
-
-				dmc_index &= MAGIC_dmc;
-				dmcs_index = 0;
-				dmc_shiftcnt = 8;
-				--dmc_len_counter;
-			}
-			dmc_index  += step_dmc;
-			dmcs_index += step_dmcs;
-
-			if (dmc_len_counter == 0) {
-				if (dmc_loop_sample) {
-					dmc_len_counter = dmc_len_freq;
-					dmc_dta_ftch_addr = dmc_load_register;
-				} else if (dmc_gen_interrupt) {
-					dmc_interrupt = DMC_INTERRUPT_TRUE;
-				}
-			}
-
-			while (dmc_shiftcnt > 0
-			    && (dmcs_index >= MAGIC_dmc
-			     || dmc_index >= MAGIC_dmc)) {
-				if (dmc_shift & 1) {
-					if (dmc_delta != 0x3F) {
-						++dmc_delta;
-					}
-				} else if (dmc_delta) {
-					--dmc_delta;
-				}
-				dmc_shift >>= 1;
-				dmcs_index -= MAGIC_dmc;
-				--dmc_shiftcnt;
-			}
-
-			samp_temp += (dmc_delta << (bytes_per_sample == 1 ? 3 : 11));
+		if (closing)
+			break;
+
+		fds[1].events = pcm_len ? POLLOUT : 0;
+		if (poll(fds, 2, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
 		}
-
-
-		if (bytes_per_sample == 2) {
-			*((short *)(audio_buffer + sample)) = (samp_temp / 5);
-#if BYTE_ORDER == BIG_ENDIAN
-			/* swap order */
-			if (sample_format_number == AFMT_U16_BE
-			 || sample_format_number == AFMT_S16_BE) {
-				audio_buffer[sample]     ^= audio_buffer[sample + 1];
-				audio_buffer[sample + 1] ^= audio_buffer[sample];
-				audio_buffer[sample]     ^= audio_buffer[sample + 1];
-			}
-#endif /* BYTE_ORDER == BIG_ENDIAN */
-		} else {
-			audio_buffer[sample] = (samp_temp / 5); /* average the waves */
+		if (fds[1].revents & POLLOUT)
+			WriteQueued();
+		if (fds[0].revents) {
+			char buf[64];
+			ssize_t n;
+
+			while ((n = read(wakefd[0], buf, sizeof buf)) > 0)
+				;
+			if (n == 0) /* CloseAudio(): finish the frames posted */
+				closing = 1;
 		}
+	}
+	return NULL;
+}
 
-		count += cycles_per_sample;
-		sample += bytes_per_sample;
-
-	} /* while sample < samples_per_vsync */
+static void
+StartAudioThread(void)
+{
+	int err, flags;
 
-	/* This is used to check sync every 0x0F frames instead of every frame.
-	 * Checking it every frame really slows the emulator down.
-	 * */
-	if (skip_count) {
-		--skip_count;
+	pcm_size = PCM_FRAMES * samples_per_vsync;
+	if (!(pcm = malloc(pcm_size))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	if (max_fill > pcm_size)
+		max_fill = pcm_size;
+	if (pipe(wakefd)) {
+		perror("pipe");
 		return;
 	}
-#ifdef SNDCTL_DSP_GETODELAY
-	if (sound_config.max_sound_delay > 0.0) {
-		static unsigned long frame_count = 0;
-		static int maxdelay = 0;
-		       int odelay;
-
-		++frame_count;
-
-		if ((frame_count & 0x0F) == 0x0F  /* check it every few frames */
-		 && !ioctl (audiofd, SNDCTL_DSP_GETODELAY, &odelay)) {
-			if (odelay > maxdelay) {
-				maxdelay = odelay;
-			}
-			if (odelay * 1.0 / (sound_config.audiorate * bytes_per_sample) >=
-			    sound_config.max_sound_delay) {
-				skip_count = odelay * UPDATE_FREQ / (sound_config.audiorate * bytes_per_sample) + 1;
-
-				if (verbose) {
-					fprintf(stderr,
-					      "Warning: %.3f sec sound delay, resynchronizing\n",
-					      odelay * 1.0 / (sound_config.audiorate
-					      * bytes_per_sample));
-					fprintf(stderr, "Skipping %u frames.\n", skip_count);
-				}
-				return;
-			}
-		}
+	fcntl(wakefd[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakefd[1], F_SETFL, O_NONBLOCK);
+	if ((flags = fcntl(audio_backend->fd, F_GETFL)) >= 0)
+		fcntl(audio_backend->fd, F_SETFL, flags | O_NONBLOCK);
+
+	err = pthread_create(&audio_thread, NULL, AudioThreadMain, NULL);
+	if (err) {
+		/* synthesize on the emulation thread instead */
+		fprintf(stderr, "Can't start audio thread: %s\n", strerror(err));
+		if (flags >= 0)
+			fcntl(audio_backend->fd, F_SETFL, flags);
+		close(wakefd[0]);
+		close(wakefd[1]);
+		return;
 	}
-#endif /* SNDCTL_DSP_GETODELAY */
-
-	write(audiofd, audio_buffer, sample);
+	audio_running = 1;
+}
+#endif /* HAVE_PTHREAD */
 
-#undef CUR_EVENT
+/* Called at exit */
+static void
+CloseAudio(void)
+{
+#ifdef HAVE_PTHREAD
+	if (audio_running) {
+		close(wakefd[1]);
+		pthread_join(audio_thread, NULL);
+		audio_running = 0;
+	}
+#endif
+	audio_backend->close();
+	if (verbose || audio_stats.underruns || audio_stats.overruns
+	 || audio_stats.events_dropped)
+		fprintf(stderr, "Sound: %lu underruns, %lu frames dropped, "
+		        "%lu writes lost\n", audio_stats.underruns,
+		        audio_stats.overruns, audio_stats.events_dropped);
 }
@@ -5,11 +5,19 @@
  * Description: sound interface
  */
 
+struct ExpansionSound;
+
 /* exports */
 
 extern int              InitAudio(void);
+extern void             SoundChannelControl(int what);
 extern void             SoundEvent(long addr, unsigned char value);
+extern void             SoundExpansion(const struct ExpansionSound *chip);
 extern unsigned char    SoundGetLengthReg(void);
+extern int              SoundPacing(void);
+extern void            *SoundState(unsigned int *size);
+extern void             SoundStateLoaded(void);
+extern void             SoundSync(void);
 extern void             UpdateAudio(void);
 
 struct SampleFormat {
@@ -23,11 +31,27 @@ extern const struct SampleFormat *sample_format;
 /* table of sample formats, terminated by { 0, 0, 0 } */
 extern const struct SampleFormat sample_formats[];
 
+/*
+ * The channels, as named in --pan, --gain, --mute and --solo: the APU's
+ * five, then those of the cartridge's sound chip, if it has one
+ */
+#define SOUND_CHANNELS  13
+extern const char *const sound_channels[];      /* terminated by 0 */
+
+/* what SoundChannelControl() does, to the channel it has selected */
+#define SOUND_SELECT    0       /* select the next channel */
+#define SOUND_MUTE      1       /* mute it, or unmute it */
+#define SOUND_SOLO      2       /* play it alone, with the others soloed */
+
 /* global sound parameters */
 extern struct SoundConfig {
 	const char *audiofile;
 	int        audiorate;
 	int        audiostereo;
+	float      pan[SOUND_CHANNELS];    /* -1 left to 1 right, in stereo */
+	float      gain[SOUND_CHANNELS];   /* 1 as the NES mixes it, see main() */
+	unsigned int mute, solo;           /* channels, by bit, at the start */
 	float      max_sound_delay;
 	int        reverb;
+	int        bandlimit;   /* band-limited synthesis */
 } sound_config;
@@ -0,0 +1,316 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Frame timing statistics for --benchmark. The wall time of
+ * every frame (from one vertical blank to the next) is recorded, along
+ * with the time spent drawing, synthesizing audio and updating the
+ * display; whatever is left is the CPU emulation. At the end the results
+ * are printed as JSON so they can be compared from build to build.
+ *
+ * The sound pipeline's counters (see struct AudioStats) are reported with
+ * them: in total, and for every second or so of frames, with the longest
+ * frame in it, so that sound which breaks up can be matched up with the
+ * frames which took too long.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "globals.h"
+#include "renderer.h"
+#include "stats.h"
+
+int     stats_enabled = 0;
+unsigned int benchmark_frames = 0;
+int     benchmark_draw = 1;
+
+static uint64_t *frametime;     /* wall time of each frame */
+static unsigned int frames = 0;
+static uint64_t start, last_frame;
+static uint64_t part_total[STAT_PARTS];
+static uint64_t render_total;   /* drawimage on the render thread */
+
+static const char *part_name[STAT_PARTS] = {
+	"drawimage", "audio", "display",
+};
+
+struct AudioStats audio_stats;
+
+#define WINDOW  60              /* frames in a line of the timeline */
+
+/* The timeline, a line every WINDOW frames */
+static struct window {
+	uint64_t        frame_max;      /* the longest frame */
+	struct AudioStats audio;        /* the counters at its end, and the
+	                                   maxima in it */
+} *windows;
+static unsigned int nwindows = 0;
+static struct AudioStats audio_start;   /* the counters at the start */
+
+void
+stats_init(unsigned int n)
+{
+	if (!(frametime = malloc(n * sizeof *frametime))
+	 || !(windows = calloc(n / WINDOW + 1, sizeof *windows))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	benchmark_frames = n;
+	stats_enabled = 1;
+}
+
+/* Monotonic time in nanoseconds */
+uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Add time spent in part */
+void
+stats_add(int part, uint64_t ns)
+{
+	if (part == STAT_RENDER)
+		__atomic_fetch_add(&render_total, ns, __ATOMIC_RELAXED);
+	else
+		part_total[part] += ns;
+}
+
+/*
+ * Count x, a time or a delay, into its total and its maximum; called only
+ * on the thread which keeps them
+ */
+void
+stats_count(unsigned long *n, uint64_t *total, uint64_t *max, uint64_t x)
+{
+	__atomic_store_n(n, *n + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(total, *total + x, __ATOMIC_RELAXED);
+	if (x > __atomic_load_n(max, __ATOMIC_RELAXED))
+		__atomic_store_n(max, x, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copy the sound pipeline's counters, as they are now, and take its
+ * maxima, starting them over
+ */
+static void
+audio_snapshot(struct AudioStats *to)
+{
+	struct AudioStats *from = &audio_stats;
+
+	to->underruns = __atomic_load_n(&from->underruns, __ATOMIC_RELAXED);
+	to->overruns = __atomic_load_n(&from->overruns, __ATOMIC_RELAXED);
+	to->events_full = __atomic_load_n(&from->events_full, __ATOMIC_RELAXED);
+	to->events_dropped = __atomic_load_n(&from->events_dropped, __ATOMIC_RELAXED);
+	to->events_max = __atomic_exchange_n(&from->events_max, 0, __ATOMIC_RELAXED);
+	to->frames = __atomic_load_n(&from->frames, __ATOMIC_RELAXED);
+	to->synth_ns = __atomic_load_n(&from->synth_ns, __ATOMIC_RELAXED);
+	to->synth_max_ns = __atomic_exchange_n(&from->synth_max_ns, 0, __ATOMIC_RELAXED);
+	to->writes = __atomic_load_n(&from->writes, __ATOMIC_RELAXED);
+	to->write_ns = __atomic_load_n(&from->write_ns, __ATOMIC_RELAXED);
+	to->write_max_ns = __atomic_exchange_n(&from->write_max_ns, 0, __ATOMIC_RELAXED);
+	to->delays = __atomic_load_n(&from->delays, __ATOMIC_RELAXED);
+	to->delay_us = __atomic_load_n(&from->delay_us, __ATOMIC_RELAXED);
+	to->delay_max_us = __atomic_exchange_n(&from->delay_max_us, 0, __ATOMIC_RELAXED);
+}
+
+/* Call fn, counting its time (less any drawing it does) against part */
+void
+stats_time(int part, void (*fn)(void))
+{
+	if (!stats_enabled) {
+		fn();
+		return;
+	}
+
+	uint64_t t = stats_now();
+	uint64_t drawn = part_total[STAT_DRAW];
+
+	fn();
+	part_total[part] += stats_now() - t - (part_total[STAT_DRAW] - drawn);
+}
+
+/* Called at every vertical blank; returns nonzero once the run is over */
+int
+stats_frame(void)
+{
+	if (!stats_enabled)
+		return 0;
+
+	uint64_t now = stats_now();
+	if (last_frame) {
+		uint64_t t = now - last_frame;
+
+		frametime[frames++] = t;
+		if (t > windows[nwindows].frame_max)
+			windows[nwindows].frame_max = t;
+		if (frames % WINDOW == 0 || frames == benchmark_frames)
+			audio_snapshot(&windows[nwindows++].audio);
+	} else {
+		/* only time whole frames */
+		start = now;
+		memset(part_total, 0, sizeof part_total);
+		__atomic_store_n(&render_total, 0, __ATOMIC_RELAXED);
+		audio_snapshot(&audio_start);
+	}
+	last_frame = now;
+	return frames >= benchmark_frames;
+}
+
+static int
+compare_times(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+#define MS(ns)  ((double)(ns) / 1e6)
+
+/* The mean of the times or delays counted from a to b, or 0 if there are none */
+static double
+mean(uint64_t a, uint64_t b, unsigned long n)
+{
+	return n ? (double)(b - a) / n : 0.0;
+}
+
+/* The sound pipeline, from the start of the timed frames to the end */
+static void
+report_audio(FILE *out)
+{
+	const struct AudioStats *a = &audio_start, *b;
+	struct AudioStats max = { 0 };
+
+	if (!nwindows)
+		return;
+	b = &windows[nwindows - 1].audio;
+	for (unsigned int w = 0; w < nwindows; w++) {
+		const struct AudioStats *x = &windows[w].audio;
+
+		if (x->events_max > max.events_max)
+			max.events_max = x->events_max;
+		if (x->synth_max_ns > max.synth_max_ns)
+			max.synth_max_ns = x->synth_max_ns;
+		if (x->write_max_ns > max.write_max_ns)
+			max.write_max_ns = x->write_max_ns;
+		if (x->delay_max_us > max.delay_max_us)
+			max.delay_max_us = x->delay_max_us;
+	}
+
+	fprintf(out, "  \"audio\": {\n");
+	fprintf(out, "    \"frames\": %lu,\n", b->frames - a->frames);
+	fprintf(out, "    \"synth_ms\": { \"mean\": %.4f, \"max\": %.4f },\n",
+	        MS(mean(a->synth_ns, b->synth_ns, b->frames - a->frames)),
+	        MS(max.synth_max_ns));
+	fprintf(out, "    \"write_ms\": { \"count\": %lu, \"mean\": %.4f, \"max\": %.4f },\n",
+	        b->writes - a->writes,
+	        MS(mean(a->write_ns, b->write_ns, b->writes - a->writes)),
+	        MS(max.write_max_ns));
+	fprintf(out, "    \"device_delay_ms\": { \"count\": %lu, \"mean\": %.3f, \"max\": %.3f },\n",
+	        b->delays - a->delays,
+	        mean(a->delay_us, b->delay_us, b->delays - a->delays) / 1e3,
+	        max.delay_max_us / 1e3);
+	fprintf(out, "    \"underruns\": %lu,\n", b->underruns - a->underruns);
+	fprintf(out, "    \"overruns\": %lu,\n", b->overruns - a->overruns);
+	fprintf(out, "    \"event_ring\": { \"high_water\": %u, \"full\": %lu, \"dropped\": %lu }\n",
+	        max.events_max, b->events_full - a->events_full,
+	        b->events_dropped - a->events_dropped);
+	fprintf(out, "  },\n");
+
+	fprintf(out, "  \"audio_timeline\": [\n");
+	for (unsigned int w = 0; w < nwindows; w++) {
+		const struct AudioStats *x = &windows[w].audio;
+
+		fprintf(out, "    { \"frames\": %u, \"frame_ms_max\": %.4f, ",
+		        w + 1 < nwindows ? (w + 1) * WINDOW : frames,
+		        MS(windows[w].frame_max));
+		fprintf(out, "\"synth_ms\": %.4f, \"synth_ms_max\": %.4f, ",
+		        MS(mean(a->synth_ns, x->synth_ns, x->frames - a->frames)),
+		        MS(x->synth_max_ns));
+		fprintf(out, "\"write_ms_max\": %.4f, ", MS(x->write_max_ns));
+		fprintf(out, "\"delay_ms\": %.3f, \"delay_ms_max\": %.3f, ",
+		        mean(a->delay_us, x->delay_us, x->delays - a->delays) / 1e3,
+		        x->delay_max_us / 1e3);
+		fprintf(out, "\"underruns\": %lu, \"overruns\": %lu, ",
+		        x->underruns - a->underruns, x->overruns - a->overruns);
+		fprintf(out, "\"events_max\": %u, \"events_dropped\": %lu }%s\n",
+		        x->events_max, x->events_dropped - a->events_dropped,
+		        w + 1 < nwindows ? "," : "");
+		a = x;
+	}
+	fprintf(out, "  ]\n");
+}
+
+void
+stats_report(FILE *out)
+{
+	/* histogram bucket upper bounds, in microseconds */
+	static const unsigned int bucket[] = {
+		125, 250, 500, 1000, 2000, 4000, 8000, 16000, 17000, 33000, 67000,
+	};
+	unsigned int count[sizeof bucket / sizeof *bucket + 1] = { 0 };
+	uint64_t wall = last_frame - start;
+	uint64_t cpu = wall;
+	uint64_t render = __atomic_load_n(&render_total, __ATOMIC_RELAXED);
+
+	if (!frames)
+		return;
+	qsort(frametime, frames, sizeof *frametime, compare_times);
+	for (unsigned int i = 0; i < frames; i++) {
+		unsigned int b = 0;
+		while (b < sizeof bucket / sizeof *bucket
+		    && frametime[i] > bucket[b] * (uint64_t)1000)
+			b++;
+		count[b]++;
+	}
+	for (int part = 0; part < STAT_PARTS; part++)
+		cpu -= part_total[part];
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"renderer\": \"%s\",\n", renderer->name);
+	fprintf(out, "  \"draw\": %s,\n",
+	        fb && benchmark_draw ? "true" : "false");
+	fprintf(out, "  \"ppu_thread\": %s,\n", render ? "true" : "false");
+	fprintf(out, "  \"frames\": %u,\n", frames);
+	fprintf(out, "  \"wall_s\": %.6f,\n", (double)wall / 1e9);
+	fprintf(out, "  \"fps\": %.2f,\n", frames / ((double)wall / 1e9));
+	fprintf(out, "  \"frame_ms\": {\n");
+	fprintf(out, "    \"mean\": %.4f,\n", MS(wall) / frames);
+	fprintf(out, "    \"min\": %.4f,\n", MS(frametime[0]));
+	fprintf(out, "    \"p50\": %.4f,\n", MS(frametime[frames * 50 / 100]));
+	fprintf(out, "    \"p95\": %.4f,\n", MS(frametime[frames * 95 / 100]));
+	fprintf(out, "    \"p99\": %.4f,\n", MS(frametime[frames * 99 / 100]));
+	fprintf(out, "    \"max\": %.4f\n", MS(frametime[frames - 1]));
+	fprintf(out, "  },\n");
+	fprintf(out, "  \"histogram\": [\n");
+	for (unsigned int b = 0; b <= sizeof bucket / sizeof *bucket; b++) {
+		if (b < sizeof bucket / sizeof *bucket)
+			fprintf(out, "    { \"le_ms\": %g, ", bucket[b] / 1000.0);
+		else
+			fprintf(out, "    { \"le_ms\": null, ");
+		fprintf(out, "\"count\": %u }%s\n", count[b],
+		        b < sizeof bucket / sizeof *bucket ? "," : "");
+	}
+	fprintf(out, "  ],\n");
+	fprintf(out, "  \"breakdown_ms_per_frame\": {\n");
+	fprintf(out, "    \"cpu\": %.4f,\n", MS(cpu) / frames);
+	for (int part = 0; part < STAT_PARTS; part++)
+		fprintf(out, "    \"%s\": %.4f,\n", part_name[part],
+		        MS(part_total[part]) / frames);
+	fprintf(out, "    \"render_thread\": %.4f\n", MS(render) / frames);
+	fprintf(out, "  }%s\n", nwindows ? "," : "");
+	report_audio(out);
+	fprintf(out, "}\n");
+	fflush(out);
+}
@@ -0,0 +1,56 @@
+// SPDX-FileCopyrightText: Authors of TuxNES
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * Description: Frame timing and sound pipeline statistics for --benchmark
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Parts of a frame timed separately; the CPU emulation is the rest */
+#define STAT_DRAW       0       /* drawimage */
+#define STAT_AUDIO      1       /* UpdateAudio */
+#define STAT_DISPLAY    2       /* renderer->UpdateDisplay */
+#define STAT_PARTS      3
+#define STAT_RENDER     3       /* drawimage on the --ppu-thread render
+                                   thread, which overlaps the rest */
+
+/*
+ * Counters of the sound pipeline, kept by sound.c; the times and delays
+ * only with --benchmark.  Each is written by one thread, the audio
+ * thread where there is one, and read with __atomic_load_n().
+ */
+struct AudioStats {
+	unsigned long   underruns;      /* times the device ran dry */
+	unsigned long   overruns;       /* frames dropped to catch up */
+	unsigned long   events_full;    /* times the event ring filled up */
+	unsigned long   events_dropped; /* writes lost to a full ring */
+	unsigned int    events_max;     /* most events in the ring at once */
+	unsigned long   frames;         /* frames synthesized */
+	uint64_t        synth_ns, synth_max_ns;
+	unsigned long   writes;         /* to the audio backend */
+	uint64_t        write_ns, write_max_ns;
+	unsigned long   delays;         /* readings of the device's delay */
+	uint64_t        delay_us, delay_max_us;
+};
+
+extern struct AudioStats audio_stats;
+
+extern int      stats_enabled;
+extern unsigned int benchmark_frames;  /* quit after this many frames */
+extern int      benchmark_draw;         /* draw the pixels in the bench renderer */
+
+extern void     stats_init(unsigned int frames);
+extern uint64_t stats_now(void);
+extern void     stats_add(int part, uint64_t ns);
+extern void     stats_count(unsigned long *n, uint64_t *total, uint64_t *max,
+                            uint64_t x);
+extern void     stats_time(int part, void (*fn)(void));
+extern int      stats_frame(void);
+extern void     stats_report(FILE *out);
+
+#endif
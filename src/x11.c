@@ -40,8 +40,12 @@
 #include "controller.h"
 #include "globals.h"
 #include "joystick.h"
+#include "ppulog.h"
 #include "renderer.h"
+#include "rewind.h"
+#include "savestate.h"
 #include "screenshot.h"
+#include "sound.h"
 
 #ifdef HAVE_X
 
@@ -102,6 +106,7 @@
 
 /* external and forward declarations */
 void    fbinit(void);
+int     fbdirtyrows(const char *, unsigned char *);
 void    quit(void);
 
 /* exported functions */
@@ -117,6 +122,8 @@ static int      mapped;
 static Colormap colormap;
 static GC       gc;
 static XImage   *image = NULL;
+static char     *hqxedge = NULL;
+static unsigned char    dirtyrows[240];  /* rows changed since last refresh */
 
 static unsigned char    *keystate[32];
 static unsigned long    colortableX11[25];
@@ -165,15 +172,36 @@ shm_cleanup(void)
 static void
 InitScreenshotX11(void)
 {
-#ifdef HAVE_XPM
+#if defined(SCREENSHOT_PNG)
+	screenshot_init(".png");
+#elif defined(HAVE_XPM)
 	screenshot_init(".xpm");
 #endif
 }
 
+/* Hand a finished frame to the screenshot code, with the colours it uses */
+static void
+FrameScreenshotX11(const char *frame)
+{
+	unsigned int rgb[64];
+
+	if (renderer_config.indexedcolor) {
+		rgb[24] = NES_palette[VRAM[0x3f00] & 0x3f];
+		for (int x = 0; x < 24; x++)
+			rgb[x] = NES_palette[VRAM[0x3f01 + x + (x / 3)] & 0x3f];
+		screenshot_frame(frame, colortableX11, rgb, 25);
+	} else {
+		screenshot_frame(frame, paletteX11, NES_palette, 64);
+	}
+}
+
 static void
 SaveScreenshotX11(void)
 {
-#ifdef HAVE_XPM
+#if defined(SCREENSHOT_PNG)
+	/* taken from the next frame drawn, see FrameScreenshotX11() */
+	screenshot_request();
+#elif defined(HAVE_XPM)
 	screenshot_new();
 	int status = XpmWriteFileFromImage(display, screenshotfile, image, NULL, NULL);
 	if (status != XpmSuccess) {
@@ -502,6 +530,11 @@ shm_done:
 			perror("malloc");
 			exit(EXIT_FAILURE);
 		}
+		/* room to save two scaled rows, see ScaleRowsX11 */
+		if (!(hqxedge = malloc(2 * renderer_config.scaler_magstep * image->bytes_per_line))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
 		hqxInit();
 	}
 	InitScreenshotX11();
@@ -695,6 +728,8 @@ HandleKeyboardX11(const XEvent *ev)
 	}
 
 	/* emulator keys */
+	if (keysym == XK_F6)
+		rewind_hold(press);
 	if (press)
 		switch (keysym) {
 		case XK_F7:
@@ -703,6 +738,21 @@ HandleKeyboardX11(const XEvent *ev)
 		case XK_s:
 			SaveScreenshotX11();
 			break;
+		case XK_F5:
+			savestate_request(STATE_SAVE);
+			break;
+		case XK_F8:
+			savestate_request(STATE_LOAD);
+			break;
+		case XK_F9:
+			SoundChannelControl(SOUND_SELECT);
+			break;
+		case XK_F10:
+			SoundChannelControl(SOUND_MUTE);
+			break;
+		case XK_F11:
+			SoundChannelControl(SOUND_SOLO);
+			break;
 		case XK_BackSpace:
 			RESET = 1;
 			break;
@@ -783,6 +833,7 @@ HandleEventX11(const XEvent *ev)
 		const XExposeEvent *xev = (const XExposeEvent *)&ev;
 
 		if (!xev->count) {
+			memset(dirtyrows, 1, sizeof(dirtyrows));
 			renderer_data.needsrefresh = 1;
 		}
 	} else if (ev->type == ConfigureNotify) {
@@ -793,6 +844,8 @@ HandleEventX11(const XEvent *ev)
 			window_w = ce->width;
 			window_h = ce->height;
 			XClearWindow(display, window);
+			memset(dirtyrows, 1, sizeof(dirtyrows));
+			renderer_data.needsrefresh = 1;
 		}
 	} else if (ev->type == DestroyNotify) {
 		quit();
@@ -820,23 +873,85 @@ HandleEventX11(const XEvent *ev)
 	}
 }
 
+/* Scale rows [y0, y1) of an unscaled frame into the image */
 static void
-RedrawImageX11(void)
+ScaleRowsX11(char *frame, int y0, int y1)
 {
-	drawimage(PBL);
+	unsigned int rowbytes = renderer_config.scaler_magstep * image->bytes_per_line;
+	/*
+	 * hqx looks at the rows above and below, so it is fed one extra row
+	 * on each side. The output for those rows is wrong (hqx treats them
+	 * as the picture edge) and gets put back from hqxedge afterwards.
+	 */
+	int s0 = y0 > 0 ? y0 - 1 : 0;
+	int s1 = y1 < 240 ? y1 + 1 : 240;
+	uint32_t *src = (uint32_t *)(frame + s0 * bytes_per_line);
+	uint32_t *dst = (uint32_t *)(image->data + s0 * rowbytes);
+
+	if (s0 < y0)
+		memcpy(hqxedge, image->data + s0 * rowbytes, rowbytes);
+	if (s1 > y1)
+		memcpy(hqxedge + rowbytes, image->data + y1 * rowbytes, rowbytes);
 
 	switch (renderer_config.scaler_magstep) {
 	case 2:
-		hq2x_32_rb((uint32_t *)fb, bytes_per_line, (uint32_t *)image->data, image->bytes_per_line, 256, 240);
+		hq2x_32_rb(src, bytes_per_line, dst, image->bytes_per_line, 256, s1 - s0);
 		break;
 	case 3:
-		hq3x_32_rb((uint32_t *)fb, bytes_per_line, (uint32_t *)image->data, image->bytes_per_line, 256, 240);
+		hq3x_32_rb(src, bytes_per_line, dst, image->bytes_per_line, 256, s1 - s0);
 		break;
 	case 4:
-		hq4x_32_rb((uint32_t *)fb, bytes_per_line, (uint32_t *)image->data, image->bytes_per_line, 256, 240);
+		hq4x_32_rb(src, bytes_per_line, dst, image->bytes_per_line, 256, s1 - s0);
 		break;
 	}
 
+	if (s0 < y0)
+		memcpy(image->data + s0 * rowbytes, hqxedge, rowbytes);
+	if (s1 > y1)
+		memcpy(image->data + y1 * rowbytes, hqxedge + rowbytes, rowbytes);
+}
+
+static void
+RedrawImageX11(char *frame)
+{
+	unsigned char changed[240];
+	int y0, y1;
+
+	/* Only the rows that differ from the last frame need any work */
+	if (!fbdirtyrows(frame, changed) && !renderer_data.redrawall) {
+		renderer_data.skippedframes++;
+		return;
+	}
+	if (renderer_data.redrawall)
+		memset(changed, 1, sizeof(changed));
+
+	/* A scaled row also depends on the rows above and below it */
+	if (renderer_config.scaler_magstep > 1) {
+		unsigned char grown[240];
+
+		for (int y = 0; y < 240; y++)
+			grown[y] = changed[y]
+			        || (y > 0 && changed[y - 1])
+			        || (y < 239 && changed[y + 1]);
+		memcpy(changed, grown, sizeof(changed));
+	}
+
+	for (y0 = 0; y0 < 240; y0 = y1) {
+		while (y0 < 240 && !changed[y0])
+			y0++;
+		for (y1 = y0; y1 < 240 && changed[y1]; y1++)
+			dirtyrows[y1] = 1;
+		if (y0 >= y1)
+			continue;
+		if (renderer_config.scaler_magstep > 1)
+			ScaleRowsX11(frame, y0, y1);
+		else if (frame != image->data)
+			/* drawn into a separate buffer by the render thread */
+			memcpy(image->data + y0 * bytes_per_line,
+			       frame + y0 * bytes_per_line,
+			       (y1 - y0) * bytes_per_line);
+	}
+
 	renderer_data.needsrefresh = 1;
 	renderer_data.redrawbackground = 0;
 	renderer_data.redrawall = 0;
@@ -846,9 +961,10 @@ static void
 RefreshImageX11(void)
 {
 	Drawable target;
-	int sx = 0, sy = 0;
 	int dx = 0, dy = 0;
 	unsigned int w = image->width, h = image->height;
+	int span[120][2], spans = 0;
+	int y0, y1;
 
 #ifdef HAVE_XRENDER
 	if (renderer_config.magstep > renderer_config.scaler_magstep) {
@@ -861,15 +977,38 @@ RefreshImageX11(void)
 		dy = (window_h - h) / 2;
 	}
 
+	/* Upload only the bands of rows that changed */
+	for (y0 = 0; y0 < 240; y0 = y1) {
+		while (y0 < 240 && !dirtyrows[y0])
+			y0++;
+		for (y1 = y0; y1 < 240 && dirtyrows[y1]; y1++)
+			;
+		if (y0 < y1) {
+			span[spans][0] = y0 * renderer_config.scaler_magstep;
+			span[spans][1] = (y1 - y0) * renderer_config.scaler_magstep;
+			spans++;
+		}
+	}
+	memset(dirtyrows, 0, sizeof(dirtyrows));
+
 #ifdef HAVE_SHM
 	if (shm_attached) {
-		XShmPutImage(display, target, gc, image, sx, sy, dx, dy, w, h, True);
+		for (int i = 0; i < spans; i++) {
+			/* ask for a ShmCompletion on the last band only */
+			XShmPutImage(display, target, gc, image,
+			             0, span[i][0], dx, dy + span[i][0], w, span[i][1],
+			             i == spans - 1);
+		}
 		/* hang the event loop until we get a ShmCompletion */
-		shm_incomplete = 1;
+		if (spans)
+			shm_incomplete = 1;
 	} else
 #endif
 	{
-		XPutImage(display, target, gc, image, sx, sy, dx, dy, w, h);
+		for (int i = 0; i < spans; i++) {
+			XPutImage(display, target, gc, image,
+			          0, span[i][0], dx, dy + span[i][0], w, span[i][1]);
+		}
 		XFlush(display);
 	}
 
@@ -889,48 +1028,22 @@ RefreshImageX11(void)
 void
 UpdateDisplayX11(void)
 {
-	struct timeval time;
-	static unsigned int frame;
-	unsigned int timeframe;
+	char *drawn;
 #ifdef HAVE_SCRNSAVER
 	static int sssuspend = 0;
 #endif
 
-	if (!frameskip) {
-		RedrawImageX11();
-		if (mapped) {
+	/* NULL if the frame was skipped */
+	drawn = ppu_endframe();
+	if (drawn) {
+		FrameScreenshotX11(drawn);
+		RedrawImageX11(drawn);
+		if (mapped && renderer_data.needsrefresh) {
 			RefreshImageX11();
 		}
 	}
 
-	/* Check the time.  If we're getting behind, skip next frame to stay in sync. */
-	gettimeofday(&time, NULL);
-	if (renderer_data.desync)
-		renderer_data.basetime = time.tv_sec;
-	timeframe = (time.tv_sec - renderer_data.basetime) * 50 + time.tv_usec / 20000;     /* PAL */
-	timeframe = (time.tv_sec - renderer_data.basetime) * 60 + time.tv_usec / 16666;     /* NTSC */
-	frame++;
-	if (renderer_data.halfspeed)
-		timeframe >>= 1;
-	else if (renderer_data.doublespeed)
-		timeframe *= renderer_data.doublespeed;
-	if (renderer_data.desync) {
-		renderer_data.desync = 0;
-		frame = timeframe;
-	}
-	frameskip = frame < timeframe;
-	if (frameskip && frame % 20 == 0) {
-		frameskip = 0;
-		if (frame < timeframe - 20) {
-			/* If we're more than 20 frames behind, might as well stop counting. */
-			renderer_data.desync = 1;
-		}
-	}
-
-	/* Slow down if we're getting ahead */
-	if (frame > timeframe + 1) {
-		usleep(16666 * (frame - timeframe - 1));
-	}
+	PaceDisplay();
 
 	/* Input loop */
 	struct pollfd fds[] = {